@@ -0,0 +1,344 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of the decoder of the text protocol and of the conversion
+ * into Ruby objects, without a server and without the GObject bindings.
+ *
+ * The rows are replayed from memory, so the time is the one of decoding
+ * only.  The synthetic rows are made per column type, value width and
+ * NULL density, and the recordings written by Mysql2::Result#record_rows
+ * are replayed when their paths are given by MYSQL2_ARROW_RECORDINGS,
+ * separated by colons.  The items per second are the cells per second.
+ *
+ * The parsers of numeric values are also measured per value against the
+ * C library functions used before them (parse/...).
+ *
+ * Build and run with `rake benchmark:decoder`.
+ */
+
+#include "decoder.h"
+#include "parsers.h"
+#include "recording.h"
+#include "row_source.h"
+
+#include "record_batch_ext.h"
+
+#include <benchmark/benchmark.h>
+
+#include <ruby.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using internal::ChunkRowSource;
+using internal::DecodeOptions;
+using internal::FieldInfo;
+using internal::RowChunk;
+using internal::RowDecoder;
+
+const int64_t kSyntheticRows = 10000;
+const unsigned int kSyntheticColumns = 8;
+
+/* The rows and the fields of a benchmark, which are synthetic or recorded */
+struct Dataset {
+  std::vector<FieldInfo> fields;
+  std::unique_ptr<RowChunk> chunk;
+};
+
+DecodeOptions decode_options() {
+  return DecodeOptions{true, false, false, "UTC"};
+}
+
+/* A column type of the synthetic rows, and the value of a cell of it */
+struct ColumnType {
+  const char* name;
+  enum enum_field_types type;
+  unsigned int flags;
+  unsigned long length;
+  unsigned int decimals;
+  bool utf8;
+  std::string (*make_value)(std::mt19937_64* rng, int width);
+};
+
+std::string digits(std::mt19937_64* rng, int width) {
+  std::string value(width, '0');
+  for (auto& c : value) c = '0' + (*rng)() % 10;
+  if (value[0] == '0') value[0] = '1';
+  return value;
+}
+
+std::string make_integer(std::mt19937_64* rng, int width) {
+  return digits(rng, width);
+}
+
+std::string make_double(std::mt19937_64* rng, int width) {
+  return digits(rng, width) + "." + digits(rng, 6);
+}
+
+std::string make_decimal(std::mt19937_64* rng, int width) {
+  return digits(rng, width) + "." + digits(rng, 2);
+}
+
+std::string make_datetime(std::mt19937_64* rng, int) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "20%02d-%02d-%02d %02d:%02d:%02d",
+                static_cast<int>((*rng)() % 30), static_cast<int>((*rng)() % 12 + 1),
+                static_cast<int>((*rng)() % 28 + 1), static_cast<int>((*rng)() % 24),
+                static_cast<int>((*rng)() % 60), static_cast<int>((*rng)() % 60));
+  return buf;
+}
+
+std::string make_string(std::mt19937_64* rng, int width) {
+  std::string value(width, 'a');
+  for (auto& c : value) c = 'a' + (*rng)() % 26;
+  return value;
+}
+
+const ColumnType kColumnTypes[] = {
+  {"int",      MYSQL_TYPE_LONG,       0,               11, 0, false, make_integer},
+  {"bigint",   MYSQL_TYPE_LONGLONG,   0,               20, 0, false, make_integer},
+  {"double",   MYSQL_TYPE_DOUBLE,     0,               22, 31, false, make_double},
+  {"decimal",  MYSQL_TYPE_NEWDECIMAL, 0,               22, 2, false, make_decimal},
+  {"datetime", MYSQL_TYPE_DATETIME,   BINARY_FLAG,     19, 0, false, make_datetime},
+  {"varchar",  MYSQL_TYPE_VAR_STRING, 0,             1024, 0, true,  make_string},
+  {"blob",     MYSQL_TYPE_BLOB,       BINARY_FLAG | BLOB_FLAG, 65535, 0, false, make_string},
+};
+
+/* The widths of the integer parts of numbers and the lengths of strings */
+const int kWidths[] = {4, 16};
+
+/* The percentages of NULL cells */
+const int kNullPercents[] = {0, 10, 50};
+
+std::shared_ptr<Dataset>
+make_synthetic(const ColumnType& column, int width, int null_percent) {
+  auto dataset = std::make_shared<Dataset>();
+  for (unsigned int i = 0; i < kSyntheticColumns; ++i) {
+    dataset->fields.push_back(FieldInfo{std::string("c") + std::to_string(i), column.type,
+                                        column.flags, column.length, column.decimals,
+                                        column.utf8 ? 33u : 63u, column.utf8});
+  }
+
+  std::mt19937_64 rng(42);
+  dataset->chunk.reset(new RowChunk(kSyntheticColumns, true));
+  std::vector<std::string> values(kSyntheticColumns);
+  std::vector<const char*> row(kSyntheticColumns);
+  std::vector<unsigned long> lengths(kSyntheticColumns);
+  for (int64_t r = 0; r < kSyntheticRows; ++r) {
+    for (unsigned int i = 0; i < kSyntheticColumns; ++i) {
+      if (static_cast<int>(rng() % 100) < null_percent) {
+        row[i] = nullptr;
+        lengths[i] = 0;
+      } else {
+        values[i] = column.make_value(&rng, width);
+        row[i] = values[i].data();
+        lengths[i] = values[i].size();
+      }
+    }
+    dataset->chunk->add_row(row.data(), lengths.data());
+  }
+  dataset->chunk->finish();
+  return dataset;
+}
+
+void check(const arrow::Status& status) {
+  if (!status.ok()) {
+    std::fprintf(stderr, "%s\n", status.ToString().c_str());
+    std::exit(1);
+  }
+}
+
+/* Decode all the rows of a dataset into a record batch */
+class BatchDecoder {
+ public:
+  explicit BatchDecoder(const Dataset& dataset)
+      : decoder_(dataset.fields, decode_options()), source_(*dataset.chunk) {
+    const auto options = decode_options();
+    std::vector<std::shared_ptr<arrow::Field>> fields;
+    for (const auto& f : dataset.fields) {
+      fields.push_back(arrow::field(f.name, internal::field_arrow_type(f, options, false)));
+      decoders_.push_back(internal::field_decoder(f, options, false));
+    }
+    schema_ = arrow::schema(fields);
+    decoder_.set_decoders(decoders_.data());
+  }
+
+  std::shared_ptr<arrow::RecordBatch> Decode(int64_t* bytes) {
+    std::unique_ptr<arrow::RecordBatchBuilder> rbb;
+    check(arrow::RecordBatchBuilder::Make(schema_, arrow::default_memory_pool(), &rbb));
+    source_.Rewind();
+    while (decoder_.decode_row(&source_, rbb.get(), bytes)) {}
+    std::shared_ptr<arrow::RecordBatch> batch;
+    check(rbb->Flush(&batch));
+    return batch;
+  }
+
+ private:
+  RowDecoder decoder_;
+  ChunkRowSource source_;
+  std::vector<internal::ColumnDecoder> decoders_;
+  std::shared_ptr<arrow::Schema> schema_;
+};
+
+void BM_Decode(benchmark::State& state, std::shared_ptr<Dataset> dataset) {
+  BatchDecoder decoder(*dataset);
+  int64_t bytes = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(decoder.Decode(&bytes));
+  }
+  const int64_t cells = dataset->chunk->num_rows() * dataset->fields.size();
+  state.SetItemsProcessed(state.iterations() * cells);
+  state.SetBytesProcessed(bytes);
+}
+
+void BM_ToA(benchmark::State& state, std::shared_ptr<Dataset> dataset) {
+  int64_t bytes = 0;
+  auto batch = BatchDecoder(*dataset).Decode(&bytes);
+  const internal::ConvertOptions options = {false, 0};
+  for (auto _ : state) {
+    /* the conversion of Arrow::RecordBatch#to_a */
+    VALUE rows = internal::record_batch_rows_to_a(batch, 0, batch->num_rows(), options);
+    benchmark::DoNotOptimize(rows);
+    /* The rows of an iteration are collected in the next ones, and the
+     * time of GC is included as in Ruby */
+  }
+  const int64_t cells = batch->num_rows() * batch->num_columns();
+  state.SetItemsProcessed(state.iterations() * cells);
+}
+
+/* The values of a parser benchmark, which are NUL-terminated for the C
+ * library functions */
+std::shared_ptr<std::vector<std::string>>
+make_values(std::string (*make_value)(std::mt19937_64* rng, int width), int width) {
+  std::mt19937_64 rng(42);
+  auto values = std::make_shared<std::vector<std::string>>();
+  for (int64_t r = 0; r < kSyntheticRows; ++r) {
+    values->push_back(make_value(&rng, width));
+  }
+  return values;
+}
+
+template <typename Parse>
+void BM_Parse(benchmark::State& state, std::shared_ptr<std::vector<std::string>> values,
+              Parse parse) {
+  for (auto _ : state) {
+    for (const auto& value : *values) {
+      benchmark::DoNotOptimize(parse(value));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * values->size());
+}
+
+void register_parser_benchmarks() {
+  for (int width : kWidths) {
+    const std::string suffix = "/width:" + std::to_string(width);
+
+    auto integers = make_values(make_integer, width);
+    benchmark::RegisterBenchmark(
+        ("parse/int64" + suffix + "/parsers").c_str(), BM_Parse<int64_t (*)(const std::string&)>,
+        integers, [](const std::string& v) {
+          return internal::parsers::parse_integer<int64_t>(v.data(), v.size());
+        });
+    benchmark::RegisterBenchmark(
+        ("parse/int64" + suffix + "/strtoll").c_str(), BM_Parse<int64_t (*)(const std::string&)>,
+        integers, [](const std::string& v) {
+          return static_cast<int64_t>(std::strtoll(v.c_str(), nullptr, 10));
+        });
+
+    auto doubles = make_values(make_double, width);
+    benchmark::RegisterBenchmark(
+        ("parse/double" + suffix + "/parsers").c_str(), BM_Parse<double (*)(const std::string&)>,
+        doubles, [](const std::string& v) {
+          return internal::parsers::parse_float<double>(v.data(), v.size());
+        });
+    benchmark::RegisterBenchmark(
+        ("parse/double" + suffix + "/strtod").c_str(), BM_Parse<double (*)(const std::string&)>,
+        doubles, [](const std::string& v) { return std::strtod(v.c_str(), nullptr); });
+
+    auto decimals = make_values(make_decimal, width);
+    benchmark::RegisterBenchmark(
+        ("parse/decimal" + suffix + "/parsers").c_str(), BM_Parse<uint64_t (*)(const std::string&)>,
+        decimals, [](const std::string& v) {
+          internal::parsers::Int128 value;
+          internal::parsers::parse_decimal(v.data(), v.size(), 2, &value);
+          return value.low;
+        });
+    benchmark::RegisterBenchmark(
+        ("parse/decimal" + suffix + "/Decimal128").c_str(), BM_Parse<uint64_t (*)(const std::string&)>,
+        decimals, [](const std::string& v) {
+          return arrow::Decimal128(v).low_bits();
+        });
+  }
+}
+
+void register_dataset(const std::string& name, std::shared_ptr<Dataset> dataset) {
+  benchmark::RegisterBenchmark(("decode/" + name).c_str(), BM_Decode, dataset);
+  benchmark::RegisterBenchmark(("to_a/" + name).c_str(), BM_ToA, dataset);
+}
+
+void register_benchmarks() {
+  register_parser_benchmarks();
+
+  for (const auto& column : kColumnTypes) {
+    for (int width : kWidths) {
+      for (int null_percent : kNullPercents) {
+        std::ostringstream name;
+        name << column.name << "/width:" << width << "/null:" << null_percent << "%";
+        register_dataset(name.str(), make_synthetic(column, width, null_percent));
+      }
+    }
+  }
+
+  const char* recordings = std::getenv("MYSQL2_ARROW_RECORDINGS");
+  if (recordings == nullptr) return;
+  std::istringstream paths(recordings);
+  std::string path;
+  while (std::getline(paths, path, ':')) {
+    if (path.empty()) continue;
+    auto dataset = std::make_shared<Dataset>();
+    std::string error;
+    if (!internal::read_recording(path, &dataset->fields, &dataset->chunk, &error)) {
+      std::fprintf(stderr, "%s\n", error.c_str());
+      std::exit(1);
+    }
+    register_dataset("recording/" + path.substr(path.rfind('/') + 1), dataset);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ruby_sysinit(&argc, &argv);
+  {
+    RUBY_INIT_STACK;
+    ruby_init();
+    ruby_init_loadpath();
+    Init_record_batch_converter();
+
+    register_benchmarks();
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+  }
+  return ruby_cleanup(0);
+}
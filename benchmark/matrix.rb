@@ -0,0 +1,187 @@
+# End-to-end benchmark matrix of pluck, pluck_by_arrow and to_arrow on Linux.
+#
+# The queries read the table made by `rake db:setup` (Mysql2Arrow::Task::DB),
+# and the matrix sweeps the column types, the number of the columns, the
+# density of NULL values and the number of the rows.  Each method of each
+# case is measured in a forked process, so the peak RSS and the allocated
+# objects of a case do not affect the others.
+#
+#   bundle exec ruby matrix.rb [--rows 1000,10000] [--types integer,string]
+#                              [--columns 1,8] [--nulls 0,0.5] [--repeat 5]
+#                              [--output matrix.json]
+#
+# The results are written as JSON, which is plotted by plot_matrix_result.rb.
+
+require 'etc'
+require 'json'
+require 'optparse'
+require 'time'
+
+$LOAD_PATH.unshift __dir__
+require 'prelude'
+
+module Mysql2ArrowBenchmark
+  # The columns of mysql2_test grouped by the decoders they exercise
+  COLUMN_GROUPS = {
+    'integer'  => %w[tiny_int_test small_int_test medium_int_test int_test big_int_test year_test],
+    'float'    => %w[float_test float_zero_test double_test],
+    'decimal'  => %w[decimal_test decimal_zero_test],
+    'temporal' => %w[date_test date_time_test timestamp_test time_test],
+    'string'   => %w[char_test varchar_test tiny_text_test text_test medium_text_test long_text_test],
+    'binary'   => %w[bit_test binary_test varbinary_test tiny_blob_test blob_test medium_blob_test long_blob_test],
+    'enum_set' => %w[enum_test set_test],
+    'null'     => %w[null_test],
+  }
+  COLUMN_GROUPS['mixed'] = COLUMN_GROUPS.values.flatten
+
+  METHODS = %w[pluck pluck_by_arrow to_arrow]
+
+  Case = Struct.new(:type, :num_columns, :null_density, :num_rows) do
+    # The columns are repeated with aliases up to num_columns, and the values
+    # are replaced with NULL at the density by a seeded RAND()
+    def select_list
+      columns = Mysql2ArrowBenchmark::COLUMN_GROUPS.fetch(type)
+      Array.new(num_columns) do |i|
+        column = columns[i % columns.length]
+        expr = null_density > 0 ? "IF(RAND(#{i}) < #{null_density}, NULL, #{column})" : column
+        "#{expr} AS c#{i}"
+      end
+    end
+
+    def sql
+      "SELECT #{select_list.join(', ')} FROM mysql2_test LIMIT #{num_rows}"
+    end
+  end
+
+  module Measure
+    module_function
+
+    def run(method, bench_case)
+      case method
+      when 'pluck'
+        Mysql2Test.limit(bench_case.num_rows).pluck(*bench_case.select_list.map { |c| Arel.sql(c) })
+      when 'pluck_by_arrow'
+        Mysql2Test.limit(bench_case.num_rows).pluck_by_arrow(*bench_case.select_list.map { |c| Arel.sql(c) })
+      when 'to_arrow'
+        Mysql2Test.connection.raw_connection.query(bench_case.sql).to_arrow
+      end
+    end
+
+    # The peak RSS in kB since the last reset
+    def peak_rss_kb
+      File.foreach('/proc/self/status') do |line|
+        return Integer(line.split[1]) if line.start_with?('VmHWM:')
+      end
+      nil
+    end
+
+    # Reset the peak RSS to the current RSS (Linux 4.0 or later)
+    def reset_peak_rss
+      File.write('/proc/self/clear_refs', '5')
+      true
+    rescue SystemCallError
+      false
+    end
+
+    def measure(method, bench_case, repeat)
+      run(method, bench_case) # warm up the connection and the caches
+      GC.start
+      GC::Profiler.enable
+
+      samples = Array.new(repeat) do
+        GC::Profiler.clear
+        reset = reset_peak_rss
+        base_rss = peak_rss_kb
+        allocated = GC.stat(:total_allocated_objects)
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        run(method, bench_case)
+        wall = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+        sample = {
+          wall_ms: wall * 1000.0,
+          allocated_objects: GC.stat(:total_allocated_objects) - allocated,
+          gc_ms: GC::Profiler.total_time * 1000.0,
+          peak_rss_kb: peak_rss_kb,
+          rss_growth_kb: reset ? peak_rss_kb - base_rss : nil,
+        }
+        GC.start
+        sample
+      end
+      { method: method, **bench_case.to_h, samples: samples }
+    end
+
+    # Measure in a child process, and read the result through a pipe
+    def measure_in_child(method, bench_case, repeat)
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        writer.write(JSON.generate(measure(method, bench_case, repeat)))
+        writer.close
+        exit!(0) # skip the finalizers of the connections of the parent
+      end
+      writer.close
+      output = reader.read
+      reader.close
+      Process.wait(pid)
+      raise "#{method} #{bench_case.to_h} failed" unless $?.success?
+      JSON.parse(output, symbolize_names: true)
+    end
+  end
+
+  def self.environment
+    {
+      ruby: RUBY_DESCRIPTION,
+      mysql: Mysql2Test.connection.select_value('SELECT VERSION()'),
+      kernel: File.read('/proc/sys/kernel/osrelease').strip,
+      cpu: File.foreach('/proc/cpuinfo').grep(/\Amodel name/).first.to_s.split(':', 2).last.to_s.strip,
+      nprocessors: Etc.nprocessors,
+      time: Time.now.utc.iso8601,
+    }
+  end
+
+  def self.main(argv)
+    options = {
+      rows: [1_000, 10_000, 50_000],
+      types: COLUMN_GROUPS.keys,
+      columns: [1, 4, 16],
+      nulls: [0.0, 0.5],
+      methods: METHODS,
+      repeat: 5,
+      output: 'matrix.json',
+    }
+    OptionParser.new do |opts|
+      opts.on('--rows=LIST', Array) { |v| options[:rows] = v.map { |x| Integer(x) } }
+      opts.on('--types=LIST', Array) { |v| options[:types] = v }
+      opts.on('--columns=LIST', Array) { |v| options[:columns] = v.map { |x| Integer(x) } }
+      opts.on('--nulls=LIST', Array) { |v| options[:nulls] = v.map { |x| Float(x) } }
+      opts.on('--methods=LIST', Array) { |v| options[:methods] = v }
+      opts.on('--repeat=N', Integer) { |v| options[:repeat] = v }
+      opts.on('--output=PATH') { |v| options[:output] = v }
+    end.parse!(argv)
+
+    unknown = options[:types] - COLUMN_GROUPS.keys
+    abort "Unknown types: #{unknown.join(', ')}" unless unknown.empty?
+    num_rows = Mysql2Test.count
+    if num_rows < options[:rows].max
+      abort "mysql2_test has #{num_rows} rows; run `rake db:setup` first"
+    end
+
+    environment = self.environment
+    # The children make their own connections
+    ActiveRecord::Base.connection_pool.disconnect!
+
+    cases = options[:types].product(options[:columns], options[:nulls], options[:rows])
+    results = []
+    cases.each_with_index do |params, k|
+      bench_case = Case.new(*params)
+      options[:methods].each do |method|
+        $stderr.puts "[#{k + 1}/#{cases.length}] #{method} #{bench_case.to_h}"
+        results << Measure.measure_in_child(method, bench_case, options[:repeat])
+      end
+    end
+
+    File.write(options[:output], JSON.pretty_generate(environment: environment, results: results))
+    $stderr.puts "Wrote #{options[:output]}"
+  end
+end
+
+Mysql2ArrowBenchmark.main(ARGV) if $0 == __FILE__
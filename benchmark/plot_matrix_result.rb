@@ -0,0 +1,46 @@
+require 'json'
+require 'matplotlib/pyplot'
+require 'pandas'
+
+# Plot the results of matrix.rb.  A figure is written per metric, with a
+# panel per column type, and the speedup of pluck_by_arrow over pluck is
+# printed per case to decide where the Arrow path pays off.
+
+input = ARGV[0] || 'matrix.json'
+output_prefix = ARGV[1] || 'matrix'
+results = JSON.parse(File.read(input))['results']
+
+records = results.flat_map do |result|
+  result['samples'].map do |sample|
+    [result['method'], result['type'], result['num_columns'], result['null_density'],
+     result['num_rows'], sample['wall_ms'], sample['allocated_objects'],
+     sample['gc_ms'], sample['rss_growth_kb'] || sample['peak_rss_kb']]
+  end
+end
+
+columns = %w[method type columns null_density rows wall_ms allocated_objects gc_ms rss_kb]
+data = Pandas::DataFrame.new(records, columns: columns)
+
+medians = data.groupby(%w[type columns null_density rows method])['wall_ms'].median.unstack
+if medians.columns.include?('pluck') && medians.columns.include?('pluck_by_arrow')
+  medians['speedup'] = medians['pluck'] / medians['pluck_by_arrow']
+end
+puts medians
+
+plt = Matplotlib::Pyplot
+sns = PyCall.import_module('seaborn')
+{
+  'wall_ms'           => 'Wall time per query [ms]',
+  'allocated_objects' => 'Allocated objects per query',
+  'gc_ms'             => 'GC time per query [ms]',
+  'rss_kb'            => 'Peak RSS growth per query [kB]',
+}.each do |metric, label|
+  grid = sns.relplot(x: 'rows', y: metric, data: data, kind: 'line',
+                     hue: 'method', style: 'columns', col: 'type', col_wrap: 3,
+                     markers: true, dashes: false, ci: 68,
+                     facet_kws: { sharey: false })
+  grid.set(xscale: 'log', yscale: 'log', xlabel: 'Rows', ylabel: label)
+  plt.tight_layout()
+  plt.savefig("#{output_prefix}_#{metric}.png", dpi: 75)
+  plt.close()
+end
@@ -0,0 +1,605 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_DECODER_H
+#define MYSQL2_ARROW_DECODER_H 1
+
+/*
+ * The decoder of the values of the text protocol into Arrow builders.
+ *
+ * The decoder depends on the metadata of the fields and the options, not on
+ * Ruby, so it decodes the rows of any RowSource, such as the rows recorded
+ * by Mysql2::Result#record_rows and replayed by the decoder benchmark.
+ */
+
+#include "dictionary.h"
+#include "parsers.h"
+#include "row_source.h"
+#include "temporal.h"
+
+#include <arrow/api.h>
+#include <arrow/util/decimal.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace internal {
+
+/* The maximum precision of DECIMAL columns decoded into decimal128 */
+static const unsigned int kMaxDecimal128Precision = 38;
+
+/* The decoder of the text protocol values of a column */
+enum class ColumnDecoder : uint8_t {
+  null,
+  bytes,
+  dictionary,
+  boolean_bit,
+  boolean_tiny,
+  int8,
+  uint8,
+  int16,
+  uint16,
+  int32,
+  uint32,
+  int64,
+  uint64,
+  decimal,
+  float32,
+  float64,
+  time,
+  timestamp,
+  date,
+  skip
+};
+
+inline const char*
+column_decoder_name(ColumnDecoder decoder) {
+  switch (decoder) {
+    case ColumnDecoder::null:         return "null";
+    case ColumnDecoder::bytes:        return "bytes";
+    case ColumnDecoder::dictionary:   return "dictionary";
+    case ColumnDecoder::boolean_bit:  return "boolean";
+    case ColumnDecoder::boolean_tiny: return "boolean";
+    case ColumnDecoder::int8:         return "int8";
+    case ColumnDecoder::uint8:        return "uint8";
+    case ColumnDecoder::int16:        return "int16";
+    case ColumnDecoder::uint16:       return "uint16";
+    case ColumnDecoder::int32:        return "int32";
+    case ColumnDecoder::uint32:       return "uint32";
+    case ColumnDecoder::int64:        return "int64";
+    case ColumnDecoder::uint64:       return "uint64";
+    case ColumnDecoder::decimal:      return "decimal";
+    case ColumnDecoder::float32:      return "float";
+    case ColumnDecoder::float64:      return "double";
+    case ColumnDecoder::time:         return "time";
+    case ColumnDecoder::timestamp:    return "timestamp";
+    case ColumnDecoder::date:         return "date";
+    case ColumnDecoder::skip:         return "skip";
+  }
+  return "unknown";
+}
+
+/* The members of MYSQL_FIELD used for decoding */
+struct FieldInfo {
+  std::string name;
+  enum enum_field_types type;
+  unsigned int flags;
+  unsigned long length;
+  unsigned int decimals;
+  unsigned int charsetnr;
+  /* Whether the strings are UTF-8, which is resolved by the caller since
+   * the encodings of the fields are the ones of Ruby */
+  bool utf8;
+};
+
+inline FieldInfo
+field_info(const MYSQL_FIELD& f, bool utf8) {
+  return FieldInfo{std::string(f.name, f.name_length), f.type, f.flags, f.length,
+                   f.decimals, f.charsetnr, utf8};
+}
+
+struct DecodeOptions {
+  bool cast;
+  bool cast_booleans;
+  /* Whether DATETIME values are in the local time, or in UTC */
+  bool local_database_timezone;
+  /* The timezone of timestamp columns */
+  std::string timezone;
+};
+
+/* ENUM and SET columns are reported as strings with the flags */
+inline bool
+is_set_field(const FieldInfo& f) {
+  return f.type == MYSQL_TYPE_SET || (f.flags & SET_FLAG);
+}
+
+/* The precision of a DECIMAL field, computed from its display length
+ * in the same way as my_decimal_length_to_precision in MySQL */
+inline unsigned int
+decimal_precision(const FieldInfo& f) {
+  unsigned int precision = f.length;
+  if (f.decimals > 0) --precision;
+  if (!(f.flags & UNSIGNED_FLAG) && precision > 0) --precision;
+  return precision;
+}
+
+/* The decoder of the values of a field, which is compiled once per query
+ * shape into the decode plan */
+inline ColumnDecoder
+field_decoder(const FieldInfo& f, const DecodeOptions& options, bool dictionary) {
+  const bool is_unsigned = 0 != (f.flags & UNSIGNED_FLAG);
+
+  if (!options.cast) {
+    /* The bytes are passed through, and the encoding is in the schema */
+    return f.type == MYSQL_TYPE_NULL ? ColumnDecoder::null : ColumnDecoder::bytes;
+  }
+
+  if (dictionary) {
+    return ColumnDecoder::dictionary;
+  }
+
+  switch (f.type) {
+    case MYSQL_TYPE_NULL:
+      return ColumnDecoder::null;
+
+    case MYSQL_TYPE_BIT:
+      if (options.cast_booleans && f.length == 1) {
+        return ColumnDecoder::boolean_bit;
+      }
+      return ColumnDecoder::bytes;
+
+    case MYSQL_TYPE_TINY:
+      if (options.cast_booleans && f.length == 1) {
+        return ColumnDecoder::boolean_tiny;
+      }
+      return is_unsigned ? ColumnDecoder::uint8 : ColumnDecoder::int8;
+
+    case MYSQL_TYPE_SHORT:
+      return is_unsigned ? ColumnDecoder::uint16 : ColumnDecoder::int16;
+
+    case MYSQL_TYPE_YEAR:
+      return ColumnDecoder::uint16;
+
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+      return is_unsigned ? ColumnDecoder::uint32 : ColumnDecoder::int32;
+
+    case MYSQL_TYPE_LONGLONG:
+      return is_unsigned ? ColumnDecoder::uint64 : ColumnDecoder::int64;
+
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+      return ColumnDecoder::decimal;
+
+    case MYSQL_TYPE_FLOAT:
+      return ColumnDecoder::float32;
+
+    case MYSQL_TYPE_DOUBLE:
+      return ColumnDecoder::float64;
+
+    case MYSQL_TYPE_TIME:
+      return ColumnDecoder::time;
+
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_DATETIME:
+      return ColumnDecoder::timestamp;
+
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_NEWDATE:
+      return ColumnDecoder::date;
+
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:
+    case MYSQL_TYPE_VAR_STRING:
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_STRING:
+    case MYSQL_TYPE_GEOMETRY:
+      return ColumnDecoder::bytes;
+
+    default:
+      return ColumnDecoder::skip;
+  }
+}
+
+/* The type of string values.  UTF-8 strings are utf8, and the others are
+ * binary with the encoding in the field metadata (see makeArrowSchema). */
+inline std::shared_ptr<arrow::DataType>
+string_field_type(const FieldInfo& f) {
+  return f.utf8 ? arrow::utf8() : arrow::binary();
+}
+
+/* The type of the builder of a field */
+inline std::shared_ptr<arrow::DataType>
+field_arrow_type(const FieldInfo& f, const DecodeOptions& options, bool dictionary) {
+  const bool is_unsigned = 0 != (f.flags & UNSIGNED_FLAG);
+
+  if (!options.cast) {
+    switch (f.type) {
+      case MYSQL_TYPE_NULL:
+        return arrow::null();
+
+      case MYSQL_TYPE_BIT:
+      case MYSQL_TYPE_TINY_BLOB:
+      case MYSQL_TYPE_MEDIUM_BLOB:
+      case MYSQL_TYPE_LONG_BLOB:
+      case MYSQL_TYPE_BLOB:
+      case MYSQL_TYPE_VAR_STRING:
+      case MYSQL_TYPE_VARCHAR:
+      case MYSQL_TYPE_STRING:
+      case MYSQL_TYPE_ENUM:
+      case MYSQL_TYPE_SET:
+      case MYSQL_TYPE_GEOMETRY:
+        return string_field_type(f);
+
+      default:
+        /* numbers and temporal values are in ASCII */
+        return arrow::utf8();
+    }
+  }
+
+  if (dictionary) {
+    /* the placeholders of dictionary arrays, see finish_batch */
+    return is_set_field(f) ? arrow::list(arrow::int32()) : arrow::int32();
+  }
+
+  switch (f.type) {
+    case MYSQL_TYPE_TINY:     /* TINYINT:   1 byte  */
+      if (options.cast_booleans && f.length == 1) {
+        return arrow::boolean();
+      } else {
+        return is_unsigned ? arrow::uint8() : arrow::int8();
+      }
+
+    case MYSQL_TYPE_SHORT:    /* SMALLINT:  2 bytes */
+      return is_unsigned ? arrow::uint16() : arrow::int16();
+
+    case MYSQL_TYPE_INT24:    /* MEDIUMINT: 3 bytes */
+    case MYSQL_TYPE_LONG:     /* INTEGER:   4 bytes */
+      return is_unsigned ? arrow::uint32() : arrow::int32();
+
+    case MYSQL_TYPE_LONGLONG: /* BIGINT:    8 bytes */
+      return is_unsigned ? arrow::uint64() : arrow::int64();
+
+    case MYSQL_TYPE_DECIMAL:  /* DECIMAL or NUMERIC */
+    case MYSQL_TYPE_NEWDECIMAL: /* high precision DECIMAL or NUMERIC */
+      if (decimal_precision(f) > kMaxDecimal128Precision) {
+        /* DECIMAL can have up to 65 digits */
+        return arrow::utf8();
+      }
+      return std::make_shared<arrow::Decimal128Type>(decimal_precision(f), f.decimals);
+
+    case MYSQL_TYPE_FLOAT:    /* FLOAT: 4 bytes */
+      return arrow::float32();
+
+    case MYSQL_TYPE_DOUBLE:   /* DOUBLE or REAL: 8 bytes */
+      return arrow::float64();
+
+    case MYSQL_TYPE_BIT:  /* 1 to 64 bits */
+      if (options.cast_booleans && f.length == 1) {
+        return arrow::boolean();
+      }
+      return arrow::binary();
+
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_DATETIME:
+      return arrow::timestamp(arrow::TimeUnit::MICRO, options.timezone);
+
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_NEWDATE:
+      return arrow::date32();
+
+    case MYSQL_TYPE_TIME:
+      /* TIME values can be negative or longer than a day */
+      return std::make_shared<arrow::Time64Type>(arrow::TimeUnit::MICRO);
+
+    case MYSQL_TYPE_YEAR:    /* YEAR: 1 byte */
+      return arrow::uint16();
+
+    case MYSQL_TYPE_STRING:     /* CHAR, BINARY */
+    case MYSQL_TYPE_VAR_STRING: /* VARCHAR, VARBINARY */
+    case MYSQL_TYPE_VARCHAR:
+      return string_field_type(f);
+
+    case MYSQL_TYPE_TINY_BLOB:   /* TINYBLOB, TINYTEXT */
+    case MYSQL_TYPE_MEDIUM_BLOB: /* MEDIUMBLOB, MEDIUMTEXT */
+    case MYSQL_TYPE_LONG_BLOB:   /* LONGBLOB, LONGTEXT */
+    case MYSQL_TYPE_BLOB:        /* BLOB, TEXT */
+      return string_field_type(f);
+
+    case MYSQL_TYPE_GEOMETRY:    /* the SRID and the WKB bytes */
+      return arrow::binary();
+
+    case MYSQL_TYPE_NULL:
+      return arrow::null();
+
+    default:
+      break;
+  }
+
+  return arrow::binary();
+}
+
+class RowDecoder {
+ public:
+  RowDecoder(std::vector<FieldInfo> fields, const DecodeOptions& options)
+      : fields_(std::move(fields)),
+        local_database_timezone_(options.local_database_timezone),
+        decoders_(nullptr),
+        dictionaries_(fields_.size(), nullptr),
+        local_time_converters_(fields_.size()) {}
+
+  unsigned int num_fields() const { return static_cast<unsigned int>(fields_.size()); }
+
+  const FieldInfo& field(unsigned int i) const { return fields_[i]; }
+
+  /* Use the decoders of a decode plan, which must outlive the decoder */
+  void set_decoders(const ColumnDecoder* decoders) { decoders_ = decoders; }
+
+  /* Use a dictionary for the column i, which must outlive the decoder */
+  void set_dictionary(unsigned int i, StringDictionary* dictionary) {
+    dictionaries_[i] = dictionary;
+  }
+
+  /* Decode the next row of a source, and add the lengths of its values to
+   * *bytes.  Returns false at the end of the rows. */
+  bool decode_row(RowSource* source, arrow::RecordBatchBuilder* rbb, int64_t* bytes) {
+    const char* const* row;
+    const unsigned long* lengths;
+    if (!source->Next(&row, &lengths)) {
+      return false;
+    }
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      *bytes += lengths[i];
+      append_cell(rbb, i, row[i], lengths[i]);
+    }
+    return true;
+  }
+
+  /* Decode a value of the text protocol.  val is the pointer to the cell,
+   * which is NULL for SQL NULL.
+   * This touches only the builder and the state of the column i, so
+   * different columns can be decoded concurrently.  The decoder of the
+   * column is taken from the decode plan, see field_decoder. */
+  void append_cell(arrow::RecordBatchBuilder* rbb, unsigned int i,
+                   const char* val, unsigned long length) {
+    switch (decoders_[i]) {
+      case ColumnDecoder::null:
+        rbb->GetFieldAs<arrow::NullBuilder>(i)->AppendNull();
+        return;
+
+      case ColumnDecoder::bytes:
+        append_bytes(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::dictionary:
+        append_dictionary(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::boolean_bit:
+        append_value<arrow::BooleanBuilder>(rbb, i, val, val && *val == 1);
+        return;
+
+      case ColumnDecoder::boolean_tiny:
+        append_value<arrow::BooleanBuilder>(
+            rbb, i, val, val && parsers::parse_integer<int8_t>(val, length) != 0);
+        return;
+
+      case ColumnDecoder::int8:
+        append_integer<arrow::Int8Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::uint8:
+        append_integer<arrow::UInt8Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::int16:
+        append_integer<arrow::Int16Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::uint16:
+        append_integer<arrow::UInt16Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::int32:
+        append_integer<arrow::Int32Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::uint32:
+        append_integer<arrow::UInt32Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::int64:
+        append_integer<arrow::Int64Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::uint64:
+        append_integer<arrow::UInt64Builder>(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::decimal:
+        append_decimal(rbb, i, val, length);
+        return;
+
+      case ColumnDecoder::float32:
+        append_value<arrow::FloatBuilder>(
+            rbb, i, val, val ? parsers::parse_float<float>(val, length) : 0.0f);
+        return;
+
+      case ColumnDecoder::float64:
+        append_value<arrow::DoubleBuilder>(
+            rbb, i, val, val ? parsers::parse_float<double>(val, length) : 0.0);
+        return;
+
+      case ColumnDecoder::time:
+        {
+          auto builder = rbb->GetFieldAs<arrow::Time64Builder>(i);
+          temporal::CivilTime t;
+          if (val == nullptr || !temporal::parse_time(val, length, &t)) {
+            builder->AppendNull();
+          } else {
+            builder->Append(temporal::time_microseconds(t));
+          }
+        }
+        return;
+
+      case ColumnDecoder::timestamp:
+        {
+          auto builder = rbb->GetFieldAs<arrow::TimestampBuilder>(i);
+          temporal::CivilTime t;
+          if (val == nullptr || !temporal::parse_datetime(val, length, &t) ||
+              temporal::is_invalid_date(t)) {
+            builder->AppendNull();
+          } else {
+            builder->Append(timestamp_microseconds(i, t));
+          }
+        }
+        return;
+
+      case ColumnDecoder::date:
+        {
+          auto builder = rbb->GetFieldAs<arrow::Date32Builder>(i);
+          temporal::CivilTime t;
+          if (val == nullptr || !temporal::parse_date(val, length, &t) ||
+              temporal::is_invalid_date(t)) {
+            builder->AppendNull();
+          } else {
+            builder->Append(temporal::days_from_civil(t.year, t.month, t.day));
+          }
+        }
+        return;
+
+      case ColumnDecoder::skip:
+        return;
+    }
+  }
+
+  /* Append a value parsed from the text protocol.  val is the pointer to
+   * the cell, which is NULL for SQL NULL. */
+  template <typename BuilderType, typename ValueType>
+  static void append_value(arrow::RecordBatchBuilder* rbb, unsigned int i,
+                           const char* val, ValueType parsed) {
+    if (val == nullptr) {
+      rbb->GetFieldAs<BuilderType>(i)->AppendNull();
+    } else {
+      rbb->GetFieldAs<BuilderType>(i)->Append(parsed);
+    }
+  }
+
+  template <typename BuilderType>
+  static void append_integer(arrow::RecordBatchBuilder* rbb, unsigned int i,
+                             const char* val, unsigned long length) {
+    typedef typename BuilderType::value_type value_type;
+    if (val == nullptr) {
+      rbb->GetFieldAs<BuilderType>(i)->AppendNull();
+    } else {
+      rbb->GetFieldAs<BuilderType>(i)->Append(
+          parsers::parse_integer<value_type>(val, length));
+    }
+  }
+
+  /* Append a string value as is.  This works for both utf8 and binary
+   * columns since StringBuilder is a BinaryBuilder. */
+  static void append_bytes(arrow::RecordBatchBuilder* rbb, unsigned int i,
+                           const char* val, unsigned long length) {
+    auto builder = static_cast<arrow::BinaryBuilder*>(rbb->GetField(i));
+    if (val == nullptr) {
+      builder->AppendNull();
+    } else {
+      builder->Append(val, length);
+    }
+  }
+
+  void append_decimal(arrow::RecordBatchBuilder* rbb, unsigned int i,
+                      const char* val, unsigned long length) const {
+    if (decimal_precision(field(i)) > kMaxDecimal128Precision) {
+      /* too wide for decimal128, see field_arrow_type */
+      auto builder = rbb->GetFieldAs<arrow::StringBuilder>(i);
+      if (val == nullptr) {
+        builder->AppendNull();
+      } else {
+        builder->Append(val, length);
+      }
+      return;
+    }
+
+    auto builder = rbb->GetFieldAs<arrow::Decimal128Builder>(i);
+    parsers::Int128 parsed;
+    if (val == nullptr) {
+      builder->AppendNull();
+    } else if (parsers::parse_decimal(val, length, field(i).decimals, &parsed)) {
+      builder->Append(arrow::Decimal128(parsed.high, parsed.low));
+    } else {
+      builder->Append(arrow::Decimal128(std::string(val, length)));
+    }
+  }
+
+  /* Append the dictionary index of a value.  The values of SET columns are
+   * split by commas into lists of indices. */
+  void append_dictionary(arrow::RecordBatchBuilder* rbb, unsigned int i,
+                         const char* val, unsigned long length) {
+    StringDictionary* dictionary = dictionaries_[i];
+    if (!is_set_field(field(i))) {
+      append_value<arrow::Int32Builder>(
+          rbb, i, val, val ? dictionary->GetOrInsert(val, length) : 0);
+      return;
+    }
+
+    auto builder = rbb->GetFieldAs<arrow::ListBuilder>(i);
+    if (val == nullptr) {
+      builder->AppendNull();
+      return;
+    }
+    builder->Append();
+    if (length == 0) return;  /* the empty set */
+
+    auto value_builder = static_cast<arrow::Int32Builder*>(builder->value_builder());
+    const char* const end = val + length;
+    for (const char* p = val; ; ) {
+      const char* comma = static_cast<const char*>(memchr(p, ',', end - p));
+      const char* stop = comma ? comma : end;
+      value_builder->Append(dictionary->GetOrInsert(p, stop - p));
+      if (comma == nullptr) break;
+      p = comma + 1;
+    }
+  }
+
+  /* The microseconds since the epoch of a DATETIME or TIMESTAMP value,
+   * which is a civil time in the database timezone */
+  int64_t timestamp_microseconds(unsigned int i, const temporal::CivilTime& t) {
+    int64_t seconds = temporal::seconds_from_civil(t);
+    if (local_database_timezone_) {
+      seconds = local_time_converters_[i].to_utc(seconds);
+    }
+    return seconds * 1000000LL + t.microsecond;
+  }
+
+ private:
+  const std::vector<FieldInfo> fields_;
+  const bool local_database_timezone_;
+  const ColumnDecoder* decoders_;
+  std::vector<StringDictionary*> dictionaries_;
+  std::vector<temporal::LocalTimeConverter> local_time_converters_;
+};
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_DECODER_H */
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_DICTIONARY_H
+#define MYSQL2_ARROW_DICTIONARY_H 1
+
+/*
+ * Dictionary encoding of string columns.
+ *
+ * The type of a dictionary array holds its dictionary in Arrow 0.11, so the
+ * type is not known until all the values of a batch are seen.  The values
+ * are decoded into int32 indices at first, and the indices are replaced
+ * with a dictionary array of the narrowest index type by finish_indices.
+ *
+ * Each batch has its own dictionary in its type, so the dictionary is
+ * cleared after a batch is finished.  The memory and the copies are then
+ * bounded by the distinct values of a batch, rather than of the result.
+ */
+
+#include <arrow/api.h>
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace internal {
+
+class StringDictionary {
+ public:
+  /* The index of the value, which is added to the dictionary if it is new */
+  int32_t GetOrInsert(const char* ptr, size_t len) {
+    key_.assign(ptr, len);
+    auto it = indices_.find(key_);
+    if (it != indices_.end()) {
+      return it->second;
+    }
+    const int32_t index = static_cast<int32_t>(values_.size());
+    indices_.emplace(key_, index);
+    values_.push_back(key_);
+    return index;
+  }
+
+  size_t size() const { return values_.size(); }
+
+  /* Forget the values of the last batch */
+  void Clear() {
+    indices_.clear();
+    values_.clear();
+  }
+
+  /* Make the dictionary array of the values seen since the last Clear */
+  arrow::Status MakeDictionary(arrow::MemoryPool* pool,
+                               std::shared_ptr<arrow::Array>* out) const {
+    arrow::StringBuilder builder(pool);
+    RETURN_NOT_OK(builder.Reserve(values_.size()));
+    for (const auto& value : values_) {
+      RETURN_NOT_OK(builder.Append(value));
+    }
+    return builder.Finish(out);
+  }
+
+  /* Make the dictionary array from int32 indices.
+   * The indices are narrowed to int8 or int16 if the dictionary is small. */
+  arrow::Status FinishIndices(const std::shared_ptr<arrow::Array>& indices,
+                              arrow::MemoryPool* pool,
+                              std::shared_ptr<arrow::Array>* out) const {
+    std::shared_ptr<arrow::Array> dictionary;
+    RETURN_NOT_OK(MakeDictionary(pool, &dictionary));
+
+    const auto& int32_indices = static_cast<const arrow::Int32Array&>(*indices);
+    std::shared_ptr<arrow::Array> narrow_indices;
+    if (size() <= static_cast<size_t>(std::numeric_limits<int8_t>::max()) + 1) {
+      RETURN_NOT_OK(Narrow<arrow::Int8Builder>(int32_indices, pool, &narrow_indices));
+    } else if (size() <= static_cast<size_t>(std::numeric_limits<int16_t>::max()) + 1) {
+      RETURN_NOT_OK(Narrow<arrow::Int16Builder>(int32_indices, pool, &narrow_indices));
+    } else {
+      narrow_indices = indices;
+    }
+
+    auto type = arrow::dictionary(narrow_indices->type(), dictionary);
+    *out = std::make_shared<arrow::DictionaryArray>(type, narrow_indices);
+    return arrow::Status::OK();
+  }
+
+ private:
+  template <typename BuilderType>
+  static arrow::Status Narrow(const arrow::Int32Array& indices,
+                              arrow::MemoryPool* pool,
+                              std::shared_ptr<arrow::Array>* out) {
+    typedef typename BuilderType::value_type value_type;
+    BuilderType builder(pool);
+    RETURN_NOT_OK(builder.Reserve(indices.length()));
+    for (int64_t i = 0; i < indices.length(); ++i) {
+      if (indices.IsNull(i)) {
+        RETURN_NOT_OK(builder.AppendNull());
+      } else {
+        RETURN_NOT_OK(builder.Append(static_cast<value_type>(indices.Value(i))));
+      }
+    }
+    return builder.Finish(out);
+  }
+
+  std::unordered_map<std::string, int32_t> indices_;
+  std::vector<std::string> values_;
+  /* reused for lookups not to allocate a string for each value */
+  std::string key_;
+};
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_DICTIONARY_H */
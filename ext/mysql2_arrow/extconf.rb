@@ -38,6 +38,14 @@ checking_for(checking_message("mysql2"), "%s") do
   mysql2_spec.version
 end
 
-$CXXFLAGS += ' -std=c++11 -Wno-deprecated-register'
+have_func("rb_gc_adjust_memory_usage", "ruby.h")
+
+# Parquet output of write_arrow is optional
+if PKGConfig.have_package("parquet")
+  $defs << "-DHAVE_PARQUET"
+end
+
+$CXXFLAGS += ' -std=c++11 -Wno-deprecated-register -pthread'
+$LDFLAGS += ' -pthread'
 
 create_makefile('mysql2_arrow')
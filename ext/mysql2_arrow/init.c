@@ -13,4 +13,5 @@ Init_mysql2_arrow(void)
   ma_eMysql2Error = rb_path2class("Mysql2::Error");
 
   Init_mysql2_result_extension();
+  Init_mysql2_arrow_memory_pool();
 }
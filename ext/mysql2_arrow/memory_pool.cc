@@ -0,0 +1,169 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The memory pool tracking the buffers of the results.
+ *
+ * The buffers of record batches are invisible to Ruby's GC, so a process
+ * holding many large results looks small and the GC does not run.  The
+ * pool counts the bytes of the buffers, and reports them to the GC by
+ * rb_gc_adjust_memory_usage.
+ *
+ * The buffers are allocated by the decoding threads without the GVL and
+ * freed while the GC sweeps the objects, so the bytes are accumulated and
+ * reported later by report_memory_usage with the GVL.
+ */
+
+#include "mysql2-arrow.h"
+#include "memory_pool.h"
+
+#include <arrow/status.h>
+
+#include <atomic>
+#include <cstdint>
+
+static VALUE sym_tracking, sym_default, sym_bytes_allocated, sym_peak_bytes,
+             sym_allocations, sym_reallocations, sym_frees;
+
+namespace internal {
+
+class TrackingMemoryPool : public arrow::MemoryPool {
+ public:
+  explicit TrackingMemoryPool(arrow::MemoryPool* pool)
+      : pool_(pool),
+        bytes_allocated_(0),
+        max_memory_(0),
+        num_allocations_(0),
+        num_reallocations_(0),
+        num_frees_(0),
+        unreported_bytes_(0) {}
+
+  arrow::Status Allocate(int64_t size, uint8_t** out) override {
+    RETURN_NOT_OK(pool_->Allocate(size, out));
+    ++num_allocations_;
+    Add(size);
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Reallocate(int64_t old_size, int64_t new_size, uint8_t** ptr) override {
+    RETURN_NOT_OK(pool_->Reallocate(old_size, new_size, ptr));
+    ++num_reallocations_;
+    Add(new_size - old_size);
+    return arrow::Status::OK();
+  }
+
+  void Free(uint8_t* buffer, int64_t size) override {
+    pool_->Free(buffer, size);
+    ++num_frees_;
+    Add(-size);
+  }
+
+  int64_t bytes_allocated() const override { return bytes_allocated_.load(); }
+
+  int64_t max_memory() const override { return max_memory_.load(); }
+
+  int64_t num_allocations() const { return num_allocations_.load(); }
+  int64_t num_reallocations() const { return num_reallocations_.load(); }
+  int64_t num_frees() const { return num_frees_.load(); }
+
+  /* The bytes allocated (or freed if negative) since the last call */
+  int64_t TakeUnreportedBytes() { return unreported_bytes_.exchange(0); }
+
+ private:
+  void Add(int64_t diff) {
+    const int64_t allocated = bytes_allocated_ += diff;
+    unreported_bytes_ += diff;
+    int64_t max = max_memory_.load();
+    while (allocated > max && !max_memory_.compare_exchange_weak(max, allocated)) {
+    }
+  }
+
+  arrow::MemoryPool* pool_;
+  std::atomic<int64_t> bytes_allocated_;
+  std::atomic<int64_t> max_memory_;
+  std::atomic<int64_t> num_allocations_;
+  std::atomic<int64_t> num_reallocations_;
+  std::atomic<int64_t> num_frees_;
+  std::atomic<int64_t> unreported_bytes_;
+};
+
+/* The buffers can be freed at exit after the extension is unloaded, so the
+ * pool is never destroyed. */
+TrackingMemoryPool*
+tracking_memory_pool() {
+  static TrackingMemoryPool* pool = new TrackingMemoryPool(arrow::default_memory_pool());
+  return pool;
+}
+
+arrow::MemoryPool*
+memory_pool_for(VALUE name) {
+  if (NIL_P(name) || name == sym_tracking) {
+    return tracking_memory_pool();
+  } else if (name == sym_default) {
+    return arrow::default_memory_pool();
+  }
+  return nullptr;
+}
+
+int64_t
+tracked_reallocations() {
+  return tracking_memory_pool()->num_reallocations();
+}
+
+void
+report_memory_usage() {
+  const int64_t bytes = tracking_memory_pool()->TakeUnreportedBytes();
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  if (bytes != 0) {
+    rb_gc_adjust_memory_usage(static_cast<ssize_t>(bytes));
+  }
+#else
+  (void)bytes;
+#endif
+}
+
+}  // namespace internal
+
+/* The statistics of the tracking memory pool in a hash */
+static VALUE
+mysql2_arrow_memory_stats(VALUE self)
+{
+  internal::report_memory_usage();
+
+  auto pool = internal::tracking_memory_pool();
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, sym_bytes_allocated, LL2NUM(pool->bytes_allocated()));
+  rb_hash_aset(stats, sym_peak_bytes, LL2NUM(pool->max_memory()));
+  rb_hash_aset(stats, sym_allocations, LL2NUM(pool->num_allocations()));
+  rb_hash_aset(stats, sym_reallocations, LL2NUM(pool->num_reallocations()));
+  rb_hash_aset(stats, sym_frees, LL2NUM(pool->num_frees()));
+  return stats;
+}
+
+extern "C" void
+Init_mysql2_arrow_memory_pool(void)
+{
+  rb_define_module_function(ma_mMysql2Arrow, "memory_stats",
+                            reinterpret_cast<VALUE (*)(...)>(mysql2_arrow_memory_stats), 0);
+
+  sym_tracking        = ID2SYM(rb_intern("tracking"));
+  sym_default         = ID2SYM(rb_intern("default"));
+  sym_bytes_allocated = ID2SYM(rb_intern("bytes_allocated"));
+  sym_peak_bytes      = ID2SYM(rb_intern("peak_bytes"));
+  sym_allocations     = ID2SYM(rb_intern("allocations"));
+  sym_reallocations   = ID2SYM(rb_intern("reallocations"));
+  sym_frees           = ID2SYM(rb_intern("frees"));
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_MEMORY_POOL_H
+#define MYSQL2_ARROW_MEMORY_POOL_H 1
+
+#include <ruby.h>
+
+#include <arrow/memory_pool.h>
+
+#include <cstdint>
+
+namespace internal {
+
+/* The memory pool of the results given by the memory_pool option, which
+ * is :tracking (the default) or :default for Arrow's default pool.
+ * nullptr is returned for unknown names. */
+arrow::MemoryPool* memory_pool_for(VALUE name);
+
+/* The number of the reallocations in the tracking pool, which are the
+ * builders grown beyond their reserved capacities */
+int64_t tracked_reallocations();
+
+/* Report the bytes allocated and freed in the tracking pool since the last
+ * report to Ruby's GC.  This must be called with the GVL. */
+void report_memory_usage();
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_MEMORY_POOL_H */
@@ -37,6 +37,7 @@ extern "C" {
   Data_Get_Struct(self, mysql2_result_wrapper, wrapper);
 
 void Init_mysql2_result_extension(void);
+void Init_mysql2_arrow_memory_pool(void);
 
 extern VALUE ma_mMysql2Arrow;
 extern VALUE ma_eMysql2Error;
@@ -0,0 +1,313 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_PARSERS_H
+#define MYSQL2_ARROW_PARSERS_H 1
+
+/*
+ * Parsers of the values in the text protocol.
+ *
+ * MySQL sends numeric values in the canonical decimal notation, and the
+ * lengths of them are known from mysql_fetch_lengths.  These parsers rely on
+ * them instead of scanning NUL terminators, and never depend on the locale.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace internal {
+
+namespace parsers {
+
+inline bool is_digit(char c) {
+  return static_cast<unsigned char>(c - '0') < 10;
+}
+
+/* Parse 8 digits at once.  The caller must check they are all digits. */
+inline uint32_t parse_eight_digits(const char* ptr) {
+  uint64_t val;
+  std::memcpy(&val, ptr, sizeof(val));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  val = __builtin_bswap64(val);
+#endif
+  val -= 0x3030303030303030ULL;
+  val = (val * 10) + (val >> 8);
+  val = (((val & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((val >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  return static_cast<uint32_t>(val);
+}
+
+inline bool is_eight_digits(const char* ptr) {
+  uint64_t val;
+  std::memcpy(&val, ptr, sizeof(val));
+  return ((val & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+    0x3333333333333333ULL;
+}
+
+/* Parse the digits in [ptr, end) as an unsigned integer.
+ * Parsing stops at the first non-digit character, and the position is
+ * stored in *stop. */
+inline uint64_t parse_digits(const char* ptr, const char* end, const char** stop) {
+  uint64_t val = 0;
+  while (end - ptr >= 8 && is_eight_digits(ptr)) {
+    val = val * 100000000ULL + parse_eight_digits(ptr);
+    ptr += 8;
+  }
+  while (ptr < end && is_digit(*ptr)) {
+    val = val * 10 + static_cast<unsigned char>(*ptr - '0');
+    ++ptr;
+  }
+  *stop = ptr;
+  return val;
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_unsigned<T>::value, T>::type
+parse_integer(const char* ptr, size_t len) {
+  const char* stop;
+  return static_cast<T>(parse_digits(ptr, ptr + len, &stop));
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_signed<T>::value, T>::type
+parse_integer(const char* ptr, size_t len) {
+  const char* end = ptr + len;
+  const char* stop;
+  if (len > 0 && *ptr == '-') {
+    const uint64_t val = parse_digits(ptr + 1, end, &stop);
+    return static_cast<T>(static_cast<int64_t>(0 - val));
+  }
+  return static_cast<T>(parse_digits(ptr, end, &stop));
+}
+
+/* Fallback for the values that cannot be converted exactly by the fast path */
+template <typename T>
+inline T parse_float_slow(const char* ptr, size_t len) {
+  char buf[64];
+  std::string str;
+  const char* cstr;
+  if (len < sizeof(buf)) {
+    std::memcpy(buf, ptr, len);
+    buf[len] = '\0';
+    cstr = buf;
+  } else {
+    str.assign(ptr, len);
+    cstr = str.c_str();
+  }
+  return std::is_same<T, float>::value
+    ? static_cast<T>(std::strtof(cstr, nullptr))
+    : static_cast<T>(std::strtod(cstr, nullptr));
+}
+
+template <typename T>
+struct FloatTraits;
+
+template <>
+struct FloatTraits<double> {
+  /* the largest integer represented exactly */
+  static constexpr uint64_t kMaxExactInteger = 1ULL << 53;
+  /* the largest power of ten represented exactly */
+  static constexpr int kMaxExactExponent = 22;
+
+  static double pow10(int e) {
+    static const double table[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    return table[e];
+  }
+};
+
+template <>
+struct FloatTraits<float> {
+  static constexpr uint64_t kMaxExactInteger = 1ULL << 24;
+  static constexpr int kMaxExactExponent = 10;
+
+  static float pow10(int e) {
+    static const float table[] = {
+      1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+    };
+    return table[e];
+  }
+};
+
+/* Parse a floating point number.
+ *
+ * When both the significand and the power of ten are represented exactly,
+ * one multiplication or division gives the correctly rounded result
+ * (Clinger's fast path).  The other values are passed to strtod/strtof. */
+template <typename T>
+inline T parse_float(const char* ptr, size_t len) {
+  typedef FloatTraits<T> traits;
+
+  const char* p = ptr;
+  const char* end = ptr + len;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    ++p;
+  }
+
+  uint64_t mantissa = 0;
+  int num_digits = 0;
+  int exponent = 0;
+  const char* digits_begin = p;
+  for (; p < end && is_digit(*p); ++p) {
+    mantissa = mantissa * 10 + static_cast<unsigned char>(*p - '0');
+    ++num_digits;
+  }
+  if (p < end && *p == '.') {
+    const char* frac_begin = ++p;
+    for (; p < end && is_digit(*p); ++p) {
+      mantissa = mantissa * 10 + static_cast<unsigned char>(*p - '0');
+    }
+    num_digits += static_cast<int>(p - frac_begin);
+    exponent -= static_cast<int>(p - frac_begin);
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool exp_negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      exp_negative = *p == '-';
+      ++p;
+    }
+    int e = 0;
+    for (; p < end && is_digit(*p) && e < 10000; ++p) {
+      e = e * 10 + (*p - '0');
+    }
+    exponent += exp_negative ? -e : e;
+  }
+
+  if (p != end || p == digits_begin || num_digits > 19 ||
+      mantissa > traits::kMaxExactInteger ||
+      exponent < -traits::kMaxExactExponent ||
+      exponent > traits::kMaxExactExponent) {
+    return parse_float_slow<T>(ptr, len);
+  }
+
+  T val = static_cast<T>(mantissa);
+  if (exponent < 0) {
+    val /= traits::pow10(-exponent);
+  } else {
+    val *= traits::pow10(exponent);
+  }
+  return negative ? -val : val;
+}
+
+/* The 128-bit two's complement integer consisting of two 64-bit words */
+struct Int128 {
+  int64_t high;
+  uint64_t low;
+};
+
+/* (*high, *low) = (*high, *low) * mul + add */
+inline void multiply_add_128(uint64_t* high, uint64_t* low, uint64_t mul, uint64_t add) {
+  const uint64_t a0 = *low & 0xFFFFFFFFULL, a1 = *low >> 32;
+  const uint64_t b0 = mul & 0xFFFFFFFFULL, b1 = mul >> 32;
+  const uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+  const uint64_t mid = (p00 >> 32) + (p01 & 0xFFFFFFFFULL) + (p10 & 0xFFFFFFFFULL);
+  uint64_t new_low = (mid << 32) | (p00 & 0xFFFFFFFFULL);
+  uint64_t new_high = *high * mul + p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+  new_low += add;
+  new_high += new_low < add;
+  *high = new_high;
+  *low = new_low;
+}
+
+/* Parse a DECIMAL value into the unscaled 128-bit integer at the given scale.
+ *
+ * The fractional digits are padded with zeros or truncated to the scale.
+ * Returns false when the value has more than 38 significant digits. */
+inline bool parse_decimal(const char* ptr, size_t len, int32_t scale, Int128* out) {
+  static const uint64_t kPow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL
+  };
+  const int kMaxChunkDigits = 18;
+
+  const char* p = ptr;
+  const char* end = ptr + len;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    ++p;
+  }
+
+  uint64_t high = 0, low = 0;
+  int num_digits = 0;
+
+  /* accumulate the digits up to 18 digits at a time */
+  uint64_t chunk = 0;
+  int chunk_digits = 0;
+  int frac_digits = -1;
+  for (; p < end; ++p) {
+    if (*p == '.' && frac_digits < 0) {
+      frac_digits = 0;
+      continue;
+    }
+    if (!is_digit(*p)) {
+      return false;
+    }
+    if (frac_digits >= 0) {
+      if (frac_digits == scale) continue;
+      ++frac_digits;
+    }
+    if (num_digits > 0 || *p != '0') {
+      ++num_digits;
+    }
+    chunk = chunk * 10 + static_cast<unsigned char>(*p - '0');
+    if (++chunk_digits == kMaxChunkDigits) {
+      multiply_add_128(&high, &low, kPow10[chunk_digits], chunk);
+      chunk = 0;
+      chunk_digits = 0;
+    }
+  }
+  if (chunk_digits > 0) {
+    multiply_add_128(&high, &low, kPow10[chunk_digits], chunk);
+  }
+
+  for (int pad = scale - (frac_digits < 0 ? 0 : frac_digits); pad > 0; ) {
+    const int n = pad < kMaxChunkDigits ? pad : kMaxChunkDigits;
+    multiply_add_128(&high, &low, kPow10[n], 0);
+    num_digits += num_digits > 0 ? n : 0;
+    pad -= n;
+  }
+
+  if (num_digits > 38) {
+    return false;
+  }
+
+  if (negative) {
+    low = ~low + 1;
+    high = ~high + (low == 0 ? 1 : 0);
+  }
+  out->high = static_cast<int64_t>(high);
+  out->low = low;
+  return true;
+}
+
+}  // namespace parsers
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_PARSERS_H */
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_RECORDING_H
+#define MYSQL2_ARROW_RECORDING_H 1
+
+/*
+ * Recordings of the result sets of the text protocol, which are replayed by
+ * the decoder benchmark in benchmark/decoder.
+ *
+ * A recording has the metadata of the fields and the bytes of the rows:
+ *
+ *   "M2AREC01"
+ *   uint32 number of fields
+ *   per field: uint32 name length, name, uint32 type, uint32 flags,
+ *              uint64 length, uint32 decimals, uint32 charsetnr, uint8 utf8
+ *   uint64 number of rows
+ *   per cell:  uint64 length, or kNullLength for NULL, and the bytes
+ *
+ * The integers are in the byte order of the host, since the recordings are
+ * replayed on the machine where they are made.
+ */
+
+#include "decoder.h"
+#include "row_source.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace internal {
+
+namespace recording {
+
+static const char kMagic[8] = {'M', '2', 'A', 'R', 'E', 'C', '0', '1'};
+
+/* The length written for NULL values */
+static const uint64_t kNullLength = static_cast<uint64_t>(-1);
+
+struct FileCloser {
+  void operator()(std::FILE* fp) const { std::fclose(fp); }
+};
+
+typedef std::unique_ptr<std::FILE, FileCloser> File;
+
+template <typename T>
+inline bool write_value(std::FILE* fp, T value) {
+  return std::fwrite(&value, sizeof(T), 1, fp) == 1;
+}
+
+template <typename T>
+inline bool read_value(std::FILE* fp, T* value) {
+  return std::fread(value, sizeof(T), 1, fp) == 1;
+}
+
+inline bool write_bytes(std::FILE* fp, const char* data, size_t length) {
+  return length == 0 || std::fwrite(data, 1, length, fp) == length;
+}
+
+inline bool read_bytes(std::FILE* fp, std::string* data, size_t length) {
+  data->resize(length);
+  return length == 0 || std::fread(&(*data)[0], 1, length, fp) == length;
+}
+
+}  // namespace recording
+
+/* Write the fields and the rows of a chunk to path.  Returns false and sets
+ * *error when the file cannot be written. */
+inline bool
+write_recording(const std::string& path, const std::vector<FieldInfo>& fields,
+                const RowChunk& chunk, std::string* error) {
+  using namespace recording;
+  File fp(std::fopen(path.c_str(), "wb"));
+  if (!fp) {
+    *error = "cannot open " + path;
+    return false;
+  }
+
+  bool ok = std::fwrite(kMagic, sizeof(kMagic), 1, fp.get()) == 1;
+  ok = ok && write_value<uint32_t>(fp.get(), fields.size());
+  for (const auto& f : fields) {
+    ok = ok && write_value<uint32_t>(fp.get(), f.name.size());
+    ok = ok && write_bytes(fp.get(), f.name.data(), f.name.size());
+    ok = ok && write_value<uint32_t>(fp.get(), f.type);
+    ok = ok && write_value<uint32_t>(fp.get(), f.flags);
+    ok = ok && write_value<uint64_t>(fp.get(), f.length);
+    ok = ok && write_value<uint32_t>(fp.get(), f.decimals);
+    ok = ok && write_value<uint32_t>(fp.get(), f.charsetnr);
+    ok = ok && write_value<uint8_t>(fp.get(), f.utf8 ? 1 : 0);
+  }
+
+  ok = ok && write_value<uint64_t>(fp.get(), chunk.num_rows());
+  for (int64_t r = 0; ok && r < chunk.num_rows(); ++r) {
+    for (unsigned int i = 0; ok && i < chunk.num_fields(); ++i) {
+      const char* value = chunk.value(r, i);
+      if (value == nullptr) {
+        ok = write_value<uint64_t>(fp.get(), kNullLength);
+      } else {
+        ok = write_value<uint64_t>(fp.get(), chunk.length(r, i)) &&
+             write_bytes(fp.get(), value, chunk.length(r, i));
+      }
+    }
+  }
+
+  if (!ok || std::fflush(fp.get()) != 0) {
+    *error = "cannot write " + path;
+    return false;
+  }
+  return true;
+}
+
+/* Read a recording written by write_recording.  The rows are copied into a
+ * finished chunk made with the number of the fields. */
+inline bool
+read_recording(const std::string& path, std::vector<FieldInfo>* fields,
+               std::unique_ptr<RowChunk>* chunk, std::string* error) {
+  using namespace recording;
+  File fp(std::fopen(path.c_str(), "rb"));
+  if (!fp) {
+    *error = "cannot open " + path;
+    return false;
+  }
+
+  char magic[sizeof(kMagic)];
+  if (std::fread(magic, sizeof(magic), 1, fp.get()) != 1 ||
+      std::string(magic, sizeof(magic)) != std::string(kMagic, sizeof(kMagic))) {
+    *error = path + " is not a recording";
+    return false;
+  }
+
+  uint32_t num_fields;
+  bool ok = read_value(fp.get(), &num_fields);
+  fields->clear();
+  for (uint32_t i = 0; ok && i < num_fields; ++i) {
+    FieldInfo f;
+    uint32_t name_length, type, flags, decimals, charsetnr;
+    uint64_t length;
+    uint8_t utf8;
+    ok = read_value(fp.get(), &name_length) &&
+         read_bytes(fp.get(), &f.name, name_length) &&
+         read_value(fp.get(), &type) && read_value(fp.get(), &flags) &&
+         read_value(fp.get(), &length) && read_value(fp.get(), &decimals) &&
+         read_value(fp.get(), &charsetnr) && read_value(fp.get(), &utf8);
+    f.type = static_cast<enum enum_field_types>(type);
+    f.flags = flags;
+    f.length = length;
+    f.decimals = decimals;
+    f.charsetnr = charsetnr;
+    f.utf8 = utf8 != 0;
+    fields->push_back(f);
+  }
+
+  uint64_t num_rows = 0;
+  ok = ok && read_value(fp.get(), &num_rows);
+  chunk->reset(new RowChunk(num_fields, true));
+  std::vector<std::string> values(num_fields);
+  std::vector<const char*> row(num_fields);
+  std::vector<unsigned long> lengths(num_fields);
+  for (uint64_t r = 0; ok && r < num_rows; ++r) {
+    for (uint32_t i = 0; ok && i < num_fields; ++i) {
+      uint64_t length;
+      ok = read_value(fp.get(), &length);
+      if (!ok) break;
+      if (length == kNullLength) {
+        row[i] = nullptr;
+        lengths[i] = 0;
+      } else {
+        ok = read_bytes(fp.get(), &values[i], length);
+        row[i] = values[i].data();
+        lengths[i] = length;
+      }
+    }
+    if (ok) (*chunk)->add_row(row.data(), lengths.data());
+  }
+  (*chunk)->finish();
+
+  if (!ok) {
+    *error = path + " is truncated";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_RECORDING_H */
@@ -15,18 +15,40 @@
  */
 
 #include "mysql2-arrow.h"
+#include "decoder.h"
+#include "dictionary.h"
+#include "memory_pool.h"
+#include "parsers.h"
+#include "recording.h"
+#include "row_source.h"
+#include "schema_cache.h"
+#include "stats.h"
+#include "temporal.h"
+#include "thread_pool.h"
+#include "writer.h"
 #include <mysql2/mysql_enc_to_ruby.h>
 
 #include <ruby/thread.h>
 
 #include <arrow/api.h>
 #include <arrow/util/decimal.h>
+#include <arrow/util/key_value_metadata.h>
 
 #include <arrow-glib/record-batch.h>
 #include <rbgobject.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace ruby {
 
@@ -45,14 +67,25 @@ class error {
   VALUE exc_;
 };
 
-}  // namespace ruby
+/* A non-local exit (raise, break, throw, ...) caught by rb_protect */
+class tag {
+ public:
+  explicit tag(int state) : state_(state) {}
+
+  int state() const { return state_; }
+
+ private:
+  int state_;
+};
 
-static rb_encoding *binaryEncoding;
+}  // namespace ruby
 
-static ID intern_utc, intern_local, intern_merge;
+static ID intern_utc, intern_local, intern_merge, intern_write;
 static VALUE sym_symbolize_keys, sym_as, sym_array, sym_cast_booleans,
              sym_cache_rows, sym_cast, sym_database_timezone, sym_application_timezone, sym_local,
-             sym_utc;
+             sym_utc, sym_batch_size, sym_batch_bytes, sym_dictionary, sym_threads, sym_pipeline,
+             sym_format, sym_compression, sym_ipc_stream, sym_ipc_file, sym_parquet,
+             sym_memory_pool, sym_stats;
 
 /* this is copied from mysql2/result.c */
 /* this may be called manually or during GC */
@@ -100,19 +133,23 @@ static void rb_mysql_result_free_result(mysql2_result_wrapper * wrapper) {
   }
 }
 
-static void *nogvl_fetch_row(void *ptr) {
-  MYSQL_RES *result = reinterpret_cast<MYSQL_RES*>(ptr);
-  return mysql_fetch_row(result);
-}
+namespace internal {
 
-static void *nogvl_stmt_fetch(void *ptr) {
-  MYSQL_STMT *stmt = reinterpret_cast<MYSQL_STMT*>(ptr);
-  uintptr_t r = mysql_stmt_fetch(stmt);
+/* The initial buffer size of variable-length columns in prepared statements
+ * when MYSQL_FIELD::max_length is not available */
+static const unsigned long kInitialVarBufferLength = 1024;
 
-  return (void *)r;
-}
+/* The upper bound of the data buffer reserved from max_length of fields */
+static const int64_t kMaxEstimatedDataLength = 64 * 1024 * 1024;
 
-namespace internal {
+/* The number of rows fetched in one region without the GVL */
+static const int64_t kFetchChunkSize = 1024;
+
+/* The default number of rows in a record batch of each_arrow_batch */
+static const int64_t kDefaultBatchSize = 10000;
+
+/* The number of row chunks in the ring of the pipelined fetch */
+static const size_t kPipelineDepth = 4;
 
 struct Timezone {
   enum type {
@@ -122,14 +159,194 @@ struct Timezone {
   };
 };
 
+/* The fetch of a streaming result by a producer thread.
+ * The producer reads rows from the connection into a bounded ring of row
+ * chunks, while the consumer decodes the chunks read before.  The producer
+ * is paused while Ruby code runs, since it may use the same connection. */
+class RowPipeline {
+ public:
+  RowPipeline(MYSQL_RES* result, unsigned int num_fields)
+      : source_(result),
+        done_(false),
+        interrupted_(false),
+        parked_(false),
+        paused_(false),
+        stopping_(false) {
+    for (size_t k = 0; k < kPipelineDepth; ++k) {
+      chunks_.emplace_back(new RowChunk(num_fields, true));
+      free_chunks_.push_back(chunks_.back().get());
+    }
+    producer_ = std::thread(&RowPipeline::ProducerMain, this);
+  }
+
+  ~RowPipeline() { Stop(); }
+
+  /* Wait for the next chunk filled by the producer.  Returns nullptr at the
+   * end of the result, or when the wait is interrupted. */
+  RowChunk* Acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    chunk_ready_.wait(lock, [this] {
+      return !ready_chunks_.empty() || done_ || interrupted_;
+    });
+    if (ready_chunks_.empty() || interrupted_) {
+      interrupted_ = false;
+      return nullptr;
+    }
+    RowChunk* chunk = ready_chunks_.front();
+    ready_chunks_.pop_front();
+    return chunk;
+  }
+
+  /* Return a consumed chunk to the producer */
+  void Release(RowChunk* chunk) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_chunks_.push_back(chunk);
+    }
+    chunk_free_.notify_one();
+  }
+
+  /* Whether all the rows have been read and consumed */
+  bool finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_ && ready_chunks_.empty();
+  }
+
+  /* Wake up the consumer waiting in Acquire.  This is used as the unblocking
+   * function of rb_thread_call_without_gvl. */
+  void Interrupt() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      interrupted_ = true;
+    }
+    chunk_ready_.notify_all();
+  }
+
+  /* Park the producer, so the connection can be used by Ruby code, where
+   * mysql2 raises "Commands out of sync" instead of racing with the
+   * producer.  This waits for the row being read by the producer, and no
+   * more rows are read until Resume. */
+  void Pause() {
+    if (!producer_.joinable()) return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    paused_ = true;
+    producer_parked_.wait(lock, [this] { return parked_; });
+  }
+
+  void Resume() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      paused_ = false;
+    }
+    chunk_free_.notify_all();
+  }
+
+  /* Stop and join the producer.  This must be called before the result is
+   * freed.  If the producer is waiting for a row from the network, this
+   * waits for it, so it is called without the GVL (see
+   * ResultWrapper::stop_pipeline). */
+  void Stop() {
+    if (!producer_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    chunk_free_.notify_all();
+    producer_.join();
+  }
+
+ private:
+  void ProducerMain() {
+    mysql_thread_init();
+    bool end = false;
+    while (!end) {
+      RowChunk* chunk;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        parked_ = true;
+        producer_parked_.notify_all();
+        chunk_free_.wait(lock, [this] {
+          return (!free_chunks_.empty() && !paused_) || stopping_;
+        });
+        if (stopping_) break;
+        parked_ = false;
+        chunk = free_chunks_.front();
+        free_chunks_.pop_front();
+      }
+
+      chunk->clear();
+      while (chunk->num_rows() < kFetchChunkSize && !stopping_ && !paused_) {
+        const char* const* row;
+        const unsigned long* lengths;
+        if (!source_.Next(&row, &lengths)) {
+          /* errors are checked by the consumer with mysql_error */
+          end = true;
+          break;
+        }
+        chunk->add_row(row, lengths);
+      }
+      chunk->finish();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (chunk->num_rows() == 0 && !end) {
+          /* paused before reading a row */
+          free_chunks_.push_front(chunk);
+          continue;
+        }
+        ready_chunks_.push_back(chunk);
+        done_ = end;
+      }
+      chunk_ready_.notify_all();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      parked_ = true;
+    }
+    producer_parked_.notify_all();
+    mysql_thread_end();
+  }
+
+  MysqlRowSource source_;
+  std::vector<std::unique_ptr<RowChunk>> chunks_;
+  std::deque<RowChunk*> free_chunks_;
+  std::deque<RowChunk*> ready_chunks_;
+  std::mutex mutex_;
+  std::condition_variable chunk_ready_;
+  std::condition_variable chunk_free_;
+  std::condition_variable producer_parked_;
+  bool done_;
+  bool interrupted_;
+  /* whether the producer is not reading the connection */
+  bool parked_;
+  std::atomic<bool> paused_;
+  std::atomic<bool> stopping_;
+  std::thread producer_;
+};
+
 class ResultWrapper {
  public:
   ResultWrapper(mysql2_result_wrapper* wrapper)
-      : result_(wrapper->result),
+      : wrapper_(wrapper),
+        result_(wrapper->result),
         num_fields_(mysql_num_fields(result_)),
         fields_(mysql_fetch_fields(result_)),
-        default_internal_enc_(rb_default_internal_encoding()),
-        conn_enc(rb_to_encoding(wrapper->encoding)) {}
+        row_source_(result_),
+        conn_enc(rb_to_encoding(wrapper->encoding)),
+        rebind_result_(true),
+        fetched_bytes_(0),
+        eof_(false),
+        jump_state_(0),
+        dictionaries_(num_fields_),
+        memory_pool_(arrow::default_memory_pool()),
+        current_chunk_(nullptr),
+        current_row_(0) {
+    if (wrapper->stmt_wrapper && wrapper->result_buffers == nullptr) {
+      alloc_result_buffers();
+    }
+  }
+
+  ~ResultWrapper() { stop_pipeline(); }
 
   bool symbolizeKeys;
   bool asArray;
@@ -146,34 +363,516 @@ class ResultWrapper {
 
   unsigned int field_flags(unsigned int i) const { return field(i).flags; }
 
+  /* ENUM and SET columns are reported as strings with the flags */
+  bool is_enum_field(unsigned int i) const {
+    return field(i).type == MYSQL_TYPE_ENUM || (field_flags(i) & ENUM_FLAG);
+  }
+
+  bool is_set_field(unsigned int i) const {
+    return field(i).type == MYSQL_TYPE_SET || (field_flags(i) & SET_FLAG);
+  }
+
+  /* Whether the field is a non-binary string */
+  bool is_text_field(unsigned int i) const {
+    switch (field(i).type) {
+      case MYSQL_TYPE_STRING:
+      case MYSQL_TYPE_VAR_STRING:
+      case MYSQL_TYPE_VARCHAR:
+      case MYSQL_TYPE_TINY_BLOB:
+      case MYSQL_TYPE_MEDIUM_BLOB:
+      case MYSQL_TYPE_LONG_BLOB:
+      case MYSQL_TYPE_BLOB:
+      case MYSQL_TYPE_ENUM:
+      case MYSQL_TYPE_SET:
+        return field(i).charsetnr != 63;
+      default:
+        return false;
+    }
+  }
+
+  /* Choose the columns decoded into dictionary arrays.
+   * ENUM and SET columns are always dictionary-encoded.  The other string
+   * columns are encoded if they are listed in names, or names is true.
+   * This must be called before the schema is made. */
+  void set_dictionary_fields(VALUE names) {
+    if (!cast) return;
+
+    if (!NIL_P(names) && names != Qtrue && names != Qfalse) {
+      Check_Type(names, T_ARRAY);
+    }
+
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      if (is_enum_field(i) || is_set_field(i) ||
+          (names == Qtrue && is_text_field(i))) {
+        dictionaries_[i].reset(new StringDictionary());
+      }
+    }
+
+    if (!RB_TYPE_P(names, T_ARRAY)) return;
+
+    for (long j = 0; j < RARRAY_LEN(names); ++j) {
+      VALUE name = RARRAY_AREF(names, j);
+      if (SYMBOL_P(name)) {
+        name = rb_sym2str(name);
+      }
+      StringValue(name);
+
+      unsigned int i = 0;
+      for (; i < num_fields(); ++i) {
+        if (field(i).name_length == static_cast<unsigned long>(RSTRING_LEN(name)) &&
+            memcmp(field(i).name, RSTRING_PTR(name), RSTRING_LEN(name)) == 0) {
+          break;
+        }
+      }
+      if (i == num_fields()) {
+        throw ruby::error(rb_eArgError,
+                          std::string("unknown column for dictionary: ") +
+                          std::string(RSTRING_PTR(name), RSTRING_LEN(name)));
+      }
+      if (!is_text_field(i)) {
+        throw ruby::error(rb_eArgError,
+                          std::string("column is not a string for dictionary: ") + field(i).name);
+      }
+      if (!dictionaries_[i]) {
+        dictionaries_[i].reset(new StringDictionary());
+      }
+    }
+  }
+
+  /* The total length of the values fetched since the last reset */
+  int64_t fetched_bytes() const { return fetched_bytes_; }
+
+  void reset_fetched_bytes() { fetched_bytes_ = 0; }
+
+  /* The schema of the builders.  Dictionary-encoded columns are built as
+   * int32 indices, and they are replaced by finish_batch. */
   std::shared_ptr<arrow::Schema> schema() {
-    if (schema_ == nullptr) { makeArrowSchema(); }
-    return schema_;
+    if (plan_ == nullptr) { makeDecodePlan(); }
+    return plan_->schema;
+  }
+
+  /* The key of the query shape in the schema cache, which is valid after
+   * the schema is made */
+  const std::string& schema_key() const { return schema_key_; }
+
+  /* Copy the remaining rows of the text protocol with the metadata of the
+   * fields into a recording for the decoder benchmark */
+  int64_t record_rows(const std::string& path) {
+    if (wrapper_->stmt_wrapper) {
+      throw ruby::error(rb_eNotImpError, "record_rows is not supported for prepared statements");
+    }
+    if (plan_ == nullptr) { makeDecodePlan(); }
+
+    std::vector<FieldInfo> fields;
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      fields.push_back(decoder_->field(i));
+    }
+    RowChunk chunk(num_fields(), true);
+    const char* const* row;
+    const unsigned long* lengths;
+    while (row_source_.Next(&row, &lengths)) {
+      chunk.add_row(row, lengths);
+    }
+    chunk.finish();
+    eof_ = true;
+
+    std::string error;
+    if (!write_recording(path, fields, chunk, &error)) {
+      throw ruby::error(rb_eIOError, error);
+    }
+    return chunk.num_rows();
+  }
+
+  /* Replace the indices of dictionary-encoded columns in a flushed batch
+   * with dictionary arrays, and start new dictionaries for the next batch */
+  std::shared_ptr<arrow::RecordBatch>
+  finish_batch(const std::shared_ptr<arrow::RecordBatch>& batch) {
+    if (std::none_of(dictionaries_.begin(), dictionaries_.end(),
+                     [](const std::unique_ptr<StringDictionary>& d) { return d != nullptr; })) {
+      return batch;
+    }
+
+    std::vector<std::shared_ptr<arrow::Field>> fields;
+    std::vector<std::shared_ptr<arrow::Array>> columns;
+    fields.reserve(num_fields());
+    columns.reserve(num_fields());
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      auto field = batch->schema()->field(i);
+      auto column = batch->column(i);
+      if (dictionaries_[i]) {
+        arrow::Status status;
+        if (is_set_field(i)) {
+          const auto& list = static_cast<const arrow::ListArray&>(*column);
+          std::shared_ptr<arrow::Array> values;
+          status = dictionaries_[i]->FinishIndices(list.values(), memory_pool_, &values);
+          if (status.ok()) {
+            column = std::make_shared<arrow::ListArray>(
+                arrow::list(values->type()), list.length(), list.value_offsets(),
+                values, list.null_bitmap(), list.null_count(), list.offset());
+          }
+        } else {
+          status = dictionaries_[i]->FinishIndices(column, memory_pool_, &column);
+        }
+        if (!status.ok()) {
+          throw ruby::error(rb_eRuntimeError, status.message());
+        }
+        dictionaries_[i]->Clear();
+        field = std::make_shared<arrow::Field>(field->name(), column->type(), field->nullable());
+      }
+      fields.push_back(field);
+      columns.push_back(column);
+    }
+    return arrow::RecordBatch::Make(arrow::schema(fields), batch->num_rows(), columns);
+  }
+
+  /* Compute the total lengths of the values in each field of a stored result.
+   * For prepared statements, they are estimated from the max_length of the
+   * fields, which are updated by mysql_stmt_store_result.
+   * This does not move the row cursor. */
+  void total_field_lengths(std::vector<int64_t>* lengths) {
+    lengths->assign(num_fields(), 0);
+
+    if (wrapper_->stmt_wrapper) {
+      const int64_t num_rows = mysql_stmt_num_rows(wrapper_->stmt_wrapper->stmt);
+      for (unsigned int i = 0; i < num_fields(); ++i) {
+        (*lengths)[i] = std::min<int64_t>(field(i).max_length * num_rows,
+                                          kMaxEstimatedDataLength);
+      }
+      return;
+    }
+
+    MYSQL_ROW_OFFSET offset = mysql_row_tell(result_);
+    while (mysql_fetch_row(result_) != nullptr) {
+      unsigned long* field_lengths = mysql_fetch_lengths(result_);
+      for (unsigned int i = 0; i < num_fields(); ++i) {
+        (*lengths)[i] += field_lengths[i];
+      }
+    }
+    mysql_row_seek(result_, offset);
+  }
+
+  /* The pool of the buffers of the batches */
+  void set_memory_pool(arrow::MemoryPool* pool) { memory_pool_ = pool; }
+
+  arrow::MemoryPool* memory_pool() const { return memory_pool_; }
+
+  void enable_stats() { stats_.reset(new FetchStats(num_fields())); }
+
+  /* The counters of the phases, or nullptr if they are not collected */
+  FetchStats* stats() const { return stats_.get(); }
+
+  /* The decoder of the column i in the decode plan */
+  ColumnDecoder decoder(unsigned int i) const { return plan_->decoders[i]; }
+
+  /* Decode the columns of the text protocol in parallel on num_threads
+   * threads.  The rows of prepared statements are always decoded serially,
+   * since they are decoded from the bind buffers reused for every row. */
+  void set_num_threads(int num_threads) {
+    /* no more threads than columns are used */
+    num_threads = std::min(num_threads, static_cast<int>(num_fields()));
+    if (num_threads > 1 && wrapper_->stmt_wrapper == nullptr) {
+      thread_pool_.reset(new ThreadPool(num_threads));
+      row_chunk_.reset(new RowChunk(num_fields(), wrapper_->is_streaming));
+    } else {
+      thread_pool_.reset();
+      row_chunk_.reset();
+    }
+  }
+
+  /* Read the rows of a streaming result on a producer thread, so the reads
+   * from the network overlap with the decoding. */
+  void start_pipeline() {
+    if (wrapper_->is_streaming && wrapper_->stmt_wrapper == nullptr) {
+      pipeline_.reset(new RowPipeline(result_, num_fields()));
+    }
+  }
+
+  /* Pause and resume the producer of the pipeline around Ruby code, which
+   * may use the connection.  The producer may be waiting for a row from
+   * the network, so it is waited for without the GVL. */
+  void pause_pipeline() {
+    if (pipeline_ == nullptr) return;
+    rb_thread_call_without_gvl(nogvl_pause_pipeline, pipeline_.get(), nullptr, nullptr);
+  }
+
+  void resume_pipeline() {
+    if (pipeline_ != nullptr) pipeline_->Resume();
+  }
+
+  /* Stop the producer of the pipeline without the GVL, such as when the
+   * reading is interrupted by an exception, so the other threads run while
+   * the producer waits for a row from the network.  rb_thread_call_without_gvl2
+   * does not raise pending interrupts on the unwind path, but it does not
+   * call the function either, and then the producer is joined with the GVL
+   * by the destructor of the pipeline. */
+  void stop_pipeline() {
+    if (pipeline_ == nullptr) return;
+    rb_thread_call_without_gvl2(nogvl_stop_pipeline, pipeline_.get(), nullptr, nullptr);
+    pipeline_.reset();
+  }
+
+  /* Whether the last fetch_rows reached the end of the result */
+  bool eof() const { return eof_; }
+
+  /* Fetch and decode rows until max_rows rows are fetched, or the total
+   * length of the fetched values reaches max_bytes (zero means unlimited).
+   * The whole chunk is processed in one region without the GVL.
+   * Returns the number of rows fetched. */
+  int64_t fetch_rows(arrow::RecordBatchBuilder* rbb, int64_t max_rows, int64_t max_bytes) {
+    FetchRowsArgs args = { this, rbb, max_rows, max_bytes, 0 };
+    ScopedTimer timer(stats_ ? &stats_->gvl_released_ns : nullptr);
+    if (pipeline_ != nullptr) {
+      rb_thread_call_without_gvl(nogvl_fetch_rows, &args, interrupt_pipeline, pipeline_.get());
+    } else {
+      rb_thread_call_without_gvl(nogvl_fetch_rows, &args, RUBY_UBF_IO, 0);
+    }
+
+    if (jump_state_) {
+      const int state = jump_state_;
+      jump_state_ = 0;
+      throw ruby::tag(state);
+    }
+    if (!error_message_.empty()) {
+      std::string message;
+      message.swap(error_message_);
+      throw ruby::error(ma_eMysql2Error, message);
+    }
+
+    return args.num_rows;
   }
 
-  bool fetch_row(std::unique_ptr<arrow::RecordBatchBuilder>& rbb) {
-    MYSQL_ROW row = (MYSQL_ROW)rb_thread_call_without_gvl(
-        (void* (*)(void*))nogvl_fetch_row, result_, RUBY_UBF_IO, 0);
-    if (row == nullptr) {
+ private:
+  struct FetchRowsArgs {
+    ResultWrapper* res;
+    arrow::RecordBatchBuilder* rbb;
+    int64_t max_rows;
+    int64_t max_bytes;
+    int64_t num_rows;
+  };
+
+  static void* nogvl_fetch_rows(void* ptr) {
+    FetchRowsArgs* args = static_cast<FetchRowsArgs*>(ptr);
+    ResultWrapper* res = args->res;
+    try {
+      if (res->pipeline_ != nullptr) {
+        res->fetch_rows_pipelined(args);
+        return nullptr;
+      }
+      if (res->thread_pool_ != nullptr) {
+        res->fetch_rows_parallel(args);
+        return nullptr;
+      }
+
+      while (args->num_rows < args->max_rows) {
+        if (args->max_bytes > 0 && res->fetched_bytes_ >= args->max_bytes) break;
+
+        bool fetched = res->wrapper_->stmt_wrapper
+          ? res->fetch_row_stmt(args->rbb)
+          : res->fetch_row(args->rbb);
+        if (!fetched) break;
+        ++args->num_rows;
+      }
+    } catch (const std::exception& e) {
+      res->error_message_ = e.what();
+    }
+    return nullptr;
+  }
+
+  /* Collect the rows of a chunk, and decode its columns on the thread pool.
+   * This is called without the GVL. */
+  void fetch_rows_parallel(FetchRowsArgs* args) {
+    row_chunk_->clear();
+    {
+      ScopedTimer timer(stats_ ? &stats_->fetch_ns : nullptr);
+      while (args->num_rows < args->max_rows) {
+        if (args->max_bytes > 0 && fetched_bytes_ >= args->max_bytes) break;
+
+        const char* const* row;
+        const unsigned long* field_lengths;
+        if (!row_source_.Next(&row, &field_lengths)) {
+          eof_ = true;
+          break;
+        }
+        for (unsigned int i = 0; i < num_fields(); ++i) {
+          fetched_bytes_ += field_lengths[i];
+        }
+        row_chunk_->add_row(row, field_lengths);
+        ++args->num_rows;
+      }
+      row_chunk_->finish();
+    }
+
+    decode_rows(args->rbb, *row_chunk_, 0, row_chunk_->num_rows());
+  }
+
+  static void interrupt_pipeline(void* ptr) {
+    static_cast<RowPipeline*>(ptr)->Interrupt();
+  }
+
+  static void* nogvl_pause_pipeline(void* ptr) {
+    static_cast<RowPipeline*>(ptr)->Pause();
+    return nullptr;
+  }
+
+  static void* nogvl_stop_pipeline(void* ptr) {
+    static_cast<RowPipeline*>(ptr)->Stop();
+    return nullptr;
+  }
+
+  /* Decode the rows of the chunks read by the producer thread.
+   * The rows of a chunk can be consumed across calls when max_rows or
+   * max_bytes is reached.  This is called without the GVL. */
+  void fetch_rows_pipelined(FetchRowsArgs* args) {
+    while (args->num_rows < args->max_rows) {
+      if (args->max_bytes > 0 && fetched_bytes_ >= args->max_bytes) break;
+
+      if (current_chunk_ == nullptr) {
+        {
+          /* the wait for the producer thread reading the socket */
+          ScopedTimer timer(stats_ ? &stats_->fetch_ns : nullptr);
+          current_chunk_ = pipeline_->Acquire();
+        }
+        current_row_ = 0;
+        if (current_chunk_ == nullptr) {
+          if (pipeline_->finished()) {
+            pipeline_->Stop();
+            eof_ = true;
+          }
+          /* otherwise interrupted */
+          break;
+        }
+      }
+
+      const RowChunk& chunk = *current_chunk_;
+      const int64_t begin = current_row_;
+      int64_t end = begin;
+      while (end < chunk.num_rows() && args->num_rows + (end - begin) < args->max_rows) {
+        if (args->max_bytes > 0 && fetched_bytes_ >= args->max_bytes) break;
+        for (unsigned int i = 0; i < num_fields(); ++i) {
+          fetched_bytes_ += chunk.length(end, i);
+        }
+        ++end;
+      }
+
+      decode_rows(args->rbb, chunk, begin, end);
+      args->num_rows += end - begin;
+      current_row_ = end;
+      if (current_row_ == chunk.num_rows()) {
+        pipeline_->Release(current_chunk_);
+        current_chunk_ = nullptr;
+      }
+    }
+  }
+
+  /* Decode the rows in [begin, end) of a chunk column by column,
+   * on the thread pool if available */
+  void decode_rows(arrow::RecordBatchBuilder* rbb, const RowChunk& chunk,
+                   int64_t begin, int64_t end) {
+    auto decode_column = [&](int64_t i) {
+      const unsigned int column = static_cast<unsigned int>(i);
+      ScopedTimer timer(stats_ ? &stats_->column_decode_ns[column] : nullptr);
+      for (int64_t r = begin; r < end; ++r) {
+        decoder_->append_cell(rbb, column, chunk.value(r, column), chunk.length(r, column));
+      }
+    };
+    if (thread_pool_ != nullptr) {
+      thread_pool_->Run(num_fields(), decode_column);
+    } else {
+      for (unsigned int i = 0; i < num_fields(); ++i) {
+        decode_column(i);
+      }
+    }
+  }
+
+  /* This is called without the GVL. */
+  bool fetch_row(arrow::RecordBatchBuilder* rbb) {
+    if (stats_) {
+      return fetch_row_timed(rbb);
+    }
+
+    if (!decoder_->decode_row(&row_source_, rbb, &fetched_bytes_)) {
+      eof_ = true;
       return false;
     }
+    return true;
+  }
+
+  /* fetch_row timing the fetch and each cell, which is kept apart so the
+   * rows are not slowed down without the stats option.
+   * This is called without the GVL. */
+  bool fetch_row_timed(arrow::RecordBatchBuilder* rbb) {
+    const char* const* row;
+    const unsigned long* field_lengths;
+    int64_t now = monotonic_ns();
+    const bool fetched = row_source_.Next(&row, &field_lengths);
+    int64_t last = monotonic_ns();
+    stats_->fetch_ns += last - now;
+    if (!fetched) {
+      eof_ = true;
+      return false;
+    }
+
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      fetched_bytes_ += field_lengths[i];
+      decoder_->append_cell(rbb, i, row[i], field_lengths[i]);
+      now = monotonic_ns();
+      stats_->column_decode_ns[i] += now - last;
+      last = now;
+    }
+
+    return true;
+  }
+
+  /* This is called without the GVL. */
+  bool fetch_row_stmt(arrow::RecordBatchBuilder* rbb) {
+    MYSQL_STMT* stmt = wrapper_->stmt_wrapper->stmt;
+
+    if (rebind_result_) {
+      if (mysql_stmt_bind_result(stmt, wrapper_->result_buffers)) {
+        error_message_ = mysql_stmt_error(stmt);
+        return false;
+      }
+      rebind_result_ = false;
+    }
+
+    int fetch_status;
+    {
+      ScopedTimer timer(stats_ ? &stats_->fetch_ns : nullptr);
+      fetch_status = mysql_stmt_fetch(stmt);
+    }
+    switch (fetch_status) {
+      case 0:
+        /* success */
+        break;
+
+      case MYSQL_NO_DATA:
+        /* no more row */
+        eof_ = true;
+        return false;
+
+      case MYSQL_DATA_TRUNCATED:
+        if (!fetch_truncated_columns(stmt)) {
+          return false;
+        }
+        break;
 
-    unsigned long* field_lengths = mysql_fetch_lengths(result_);
+      default:
+        error_message_ = mysql_stmt_error(stmt);
+        return false;
+    }
 
+    ScopedTimer decode_timer(stats_ ? &stats_->decode_ns : nullptr);
     for (unsigned int i = 0; i < num_fields(); ++i) {
+      const MYSQL_BIND& bind = wrapper_->result_buffers[i];
+      const bool is_null = *bind.is_null;
+      const unsigned long length = *bind.length;
+      fetched_bytes_ += length;
       const enum enum_field_types field_type = field(i).type;
       const unsigned int flags = field(i).flags;
       const bool is_unsigned = 0 != (flags & UNSIGNED_FLAG);
 
-      if (!cast) {
-        if (field_type == MYSQL_TYPE_NULL) {
-          rbb->GetFieldAs<arrow::NullBuilder>(i)->AppendNull();
-        } else {
-        as_binary:
-          VALUE val = rb_str_new(row[i], field_lengths[i]);
-          val = mysql2_set_field_string_encoding(val, field(i));
-          rbb->GetFieldAs<arrow::BinaryBuilder>(i)->Append(RSTRING_PTR(val), RSTRING_LEN(val));
-        }
+      if (dictionaries_[i]) {
+        decoder_->append_dictionary(rbb, i, is_null ? nullptr : static_cast<const char*>(bind.buffer), length);
         continue;
       }
 
@@ -183,88 +882,112 @@ class ResultWrapper {
           continue;
 
         case MYSQL_TYPE_BIT:
-          if (castBool && field_lengths[i] == 1) {
-            rbb->GetFieldAs<arrow::BooleanBuilder>(i)->Append(*row[i] == 1);
+          if (castBool && field(i).length == 1) {
+            append_stmt_value<arrow::BooleanBuilder>(
+                rbb, i, is_null, *static_cast<unsigned char*>(bind.buffer) != 0);
+          } else if (is_null) {
+            rbb->GetFieldAs<arrow::BinaryBuilder>(i)->AppendNull();
           } else {
-            rbb->GetFieldAs<arrow::BinaryBuilder>(i)->Append(row[i], field_lengths[i]);
+            rbb->GetFieldAs<arrow::BinaryBuilder>(i)->Append(
+                static_cast<const uint8_t*>(bind.buffer), length);
           }
           continue;
 
         case MYSQL_TYPE_TINY:
-          if (castBool && field_lengths[i] == 1) {
-            rbb->GetFieldAs<arrow::BooleanBuilder>(i)->Append(*row[i] == 1);
+          if (castBool && field(i).length == 1) {
+            append_stmt_value<arrow::BooleanBuilder>(
+                rbb, i, is_null, *static_cast<signed char*>(bind.buffer) != 0);
           } else if (is_unsigned) {
-            uint8_t val = static_cast<uint8_t>(std::strtoul(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::UInt8Builder>(i)->Append(val);
+            append_stmt_value<arrow::UInt8Builder>(
+                rbb, i, is_null, *static_cast<uint8_t*>(bind.buffer));
           } else {
-            int8_t val = static_cast<int8_t>(std::strtol(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::Int8Builder>(i)->Append(val);
+            append_stmt_value<arrow::Int8Builder>(
+                rbb, i, is_null, *static_cast<int8_t*>(bind.buffer));
           }
           continue;
 
         case MYSQL_TYPE_SHORT:
-        case MYSQL_TYPE_YEAR:
           if (is_unsigned) {
-            uint16_t val = static_cast<uint16_t>(std::strtoul(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::UInt16Builder>(i)->Append(val);
+            append_stmt_value<arrow::UInt16Builder>(
+                rbb, i, is_null, *static_cast<uint16_t*>(bind.buffer));
           } else {
-            int16_t val = static_cast<int16_t>(std::strtol(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::Int16Builder>(i)->Append(val);
+            append_stmt_value<arrow::Int16Builder>(
+                rbb, i, is_null, *static_cast<int16_t*>(bind.buffer));
           }
           continue;
 
+        case MYSQL_TYPE_YEAR:
+          append_stmt_value<arrow::UInt16Builder>(
+              rbb, i, is_null, *static_cast<uint16_t*>(bind.buffer));
+          continue;
+
         case MYSQL_TYPE_LONG:
         case MYSQL_TYPE_INT24:
           if (is_unsigned) {
-            uint32_t val = static_cast<uint32_t>(std::strtoul(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::UInt32Builder>(i)->Append(val);
+            append_stmt_value<arrow::UInt32Builder>(
+                rbb, i, is_null, *static_cast<uint32_t*>(bind.buffer));
           } else {
-            int32_t val = static_cast<int32_t>(std::strtol(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::Int32Builder>(i)->Append(val);
+            append_stmt_value<arrow::Int32Builder>(
+                rbb, i, is_null, *static_cast<int32_t*>(bind.buffer));
           }
           continue;
 
         case MYSQL_TYPE_LONGLONG:
           if (is_unsigned) {
-            uint64_t val = static_cast<uint64_t>(std::strtoull(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::UInt64Builder>(i)->Append(val);
+            append_stmt_value<arrow::UInt64Builder>(
+                rbb, i, is_null, *static_cast<uint64_t*>(bind.buffer));
           } else {
-            int64_t val = static_cast<int64_t>(std::strtoll(row[i], nullptr, 10));
-            rbb->GetFieldAs<arrow::Int64Builder>(i)->Append(val);
+            append_stmt_value<arrow::Int64Builder>(
+                rbb, i, is_null, *static_cast<int64_t*>(bind.buffer));
           }
           continue;
 
         case MYSQL_TYPE_DECIMAL:
         case MYSQL_TYPE_NEWDECIMAL:
-          rbb->GetFieldAs<arrow::Decimal128Builder>(i)->Append(arrow::Decimal128(row[i]));
+          decoder_->append_decimal(rbb, i, is_null ? nullptr : static_cast<const char*>(bind.buffer), length);
           continue;
 
         case MYSQL_TYPE_FLOAT:
-          rbb->GetFieldAs<arrow::FloatBuilder>(i)->Append(
-              std::strtof(row[i], nullptr));
+          append_stmt_value<arrow::FloatBuilder>(
+              rbb, i, is_null, *static_cast<float*>(bind.buffer));
           continue;
 
         case MYSQL_TYPE_DOUBLE:
-          rbb->GetFieldAs<arrow::DoubleBuilder>(i)->Append(
-              std::strtod(row[i], nullptr));
+          append_stmt_value<arrow::DoubleBuilder>(
+              rbb, i, is_null, *static_cast<double*>(bind.buffer));
           continue;
 
         case MYSQL_TYPE_TIME:
-          /* TODO */
-          goto as_binary;
+          append_stmt_value<arrow::Time64Builder>(
+              rbb, i, is_null,
+              temporal::time_microseconds(civil_time(*static_cast<MYSQL_TIME*>(bind.buffer))));
+          continue;
 
         case MYSQL_TYPE_TIMESTAMP:
-          /* TODO */
-          goto as_binary;
-
         case MYSQL_TYPE_DATETIME:
-          /* TODO */
-          goto as_binary;
+          {
+            const temporal::CivilTime t = civil_time(*static_cast<MYSQL_TIME*>(bind.buffer));
+            if (is_null || temporal::is_invalid_date(t)) {
+              /* zero dates are returned as nil by mysql2 */
+              rbb->GetFieldAs<arrow::TimestampBuilder>(i)->AppendNull();
+            } else {
+              rbb->GetFieldAs<arrow::TimestampBuilder>(i)->Append(decoder_->timestamp_microseconds(i, t));
+            }
+          }
+          continue;
 
         case MYSQL_TYPE_DATE:
         case MYSQL_TYPE_NEWDATE:
-          /* TODO */
-          goto as_binary;
+          {
+            const temporal::CivilTime t = civil_time(*static_cast<MYSQL_TIME*>(bind.buffer));
+            if (is_null || temporal::is_invalid_date(t)) {
+              rbb->GetFieldAs<arrow::Date32Builder>(i)->AppendNull();
+            } else {
+              rbb->GetFieldAs<arrow::Date32Builder>(i)->Append(
+                  temporal::days_from_civil(t.year, t.month, t.day));
+            }
+          }
+          continue;
 
         case MYSQL_TYPE_TINY_BLOB:
         case MYSQL_TYPE_MEDIUM_BLOB:
@@ -273,15 +996,8 @@ class ResultWrapper {
         case MYSQL_TYPE_VAR_STRING:
         case MYSQL_TYPE_VARCHAR:
         case MYSQL_TYPE_STRING:
-          /* TODO: encoding */
-          rbb->GetFieldAs<arrow::StringBuilder>(i)->Append(row[i], field_lengths[i]);
-          continue;
-
-        // TODO: support following types
-        case MYSQL_TYPE_SET:
-        case MYSQL_TYPE_ENUM:
         case MYSQL_TYPE_GEOMETRY:
-          /* TODO */
+          RowDecoder::append_bytes(rbb, i, is_null ? nullptr : static_cast<const char*>(bind.buffer), length);
           continue;
 
         default:
@@ -292,283 +1008,865 @@ class ResultWrapper {
     return true;
   }
 
-  bool fetch_row_stmt(std::unique_ptr<arrow::RecordBatchBuilder>& rbb) {
-    throw ruby::error(rb_eNotImpError, "Prepared statement is not supported");
-    return false;
+  template <typename BuilderType, typename ValueType>
+  static void append_stmt_value(arrow::RecordBatchBuilder* rbb,
+                                unsigned int i, bool is_null, ValueType val) {
+    if (is_null) {
+      rbb->GetFieldAs<BuilderType>(i)->AppendNull();
+    } else {
+      rbb->GetFieldAs<BuilderType>(i)->Append(val);
+    }
   }
 
- private:
-  VALUE mysql2_set_field_string_encoding(VALUE val, const MYSQL_FIELD& field) {
+  /* this is based on rb_mysql_result_alloc_result_buffers in mysql2/result.c */
+  void alloc_result_buffers() {
+    wrapper_->numberOfFields = num_fields();
+    wrapper_->result_buffers = static_cast<MYSQL_BIND*>(
+        xcalloc(num_fields(), sizeof(MYSQL_BIND)));
+    wrapper_->is_null = static_cast<decltype(wrapper_->is_null)>(
+        xcalloc(num_fields(), sizeof(*wrapper_->is_null)));
+    wrapper_->error = static_cast<decltype(wrapper_->error)>(
+        xcalloc(num_fields(), sizeof(*wrapper_->error)));
+    wrapper_->length = static_cast<decltype(wrapper_->length)>(
+        xcalloc(num_fields(), sizeof(*wrapper_->length)));
+
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      MYSQL_BIND& bind = wrapper_->result_buffers[i];
+      bind.buffer_type = field(i).type;
+
+      //      mysql type    |            C type
+      switch (field(i).type) {
+        case MYSQL_TYPE_NULL:         // NULL
+          break;
+        case MYSQL_TYPE_TINY:         // signed char
+          bind.buffer_length = sizeof(signed char);
+          break;
+        case MYSQL_TYPE_SHORT:        // short int
+        case MYSQL_TYPE_YEAR:         // short int
+          bind.buffer_length = sizeof(short int);
+          break;
+        case MYSQL_TYPE_INT24:        // int
+        case MYSQL_TYPE_LONG:         // int
+          bind.buffer_length = sizeof(int);
+          break;
+        case MYSQL_TYPE_LONGLONG:     // long long int
+          bind.buffer_length = sizeof(long long int);
+          break;
+        case MYSQL_TYPE_FLOAT:        // float
+        case MYSQL_TYPE_DOUBLE:       // double
+          bind.buffer_length = sizeof(double);
+          break;
+        case MYSQL_TYPE_TIME:         // MYSQL_TIME
+        case MYSQL_TYPE_DATE:         // MYSQL_TIME
+        case MYSQL_TYPE_NEWDATE:      // MYSQL_TIME
+        case MYSQL_TYPE_DATETIME:     // MYSQL_TIME
+        case MYSQL_TYPE_TIMESTAMP:    // MYSQL_TIME
+          bind.buffer_length = sizeof(MYSQL_TIME);
+          break;
+        default:                      // char[]
+          /* max_length is not available for streaming results,
+           * so the buffer is grown by fetch_truncated_columns. */
+          bind.buffer_length = field(i).max_length > 0
+            ? field(i).max_length
+            : std::min<unsigned long>(field(i).length, kInitialVarBufferLength);
+          break;
+      }
+
+      if (bind.buffer_length > 0) {
+        bind.buffer = xcalloc(1, bind.buffer_length);
+      }
+      bind.is_null = &wrapper_->is_null[i];
+      bind.length = &wrapper_->length[i];
+      bind.error = &wrapper_->error[i];
+      bind.is_unsigned = 0 != (field(i).flags & UNSIGNED_FLAG);
+    }
+  }
+
+  struct GrowBufferArgs {
+    MYSQL_BIND* bind;
+    unsigned long length;
+    int state;
+  };
+
+  static VALUE grow_buffer_protected(VALUE ptr) {
+    GrowBufferArgs* args = reinterpret_cast<GrowBufferArgs*>(ptr);
+    args->bind->buffer = xrealloc(args->bind->buffer, args->length);
+    args->bind->buffer_length = args->length;
+    return Qnil;
+  }
+
+  /* NoMemoryError raised by xrealloc is caught here, since it must not
+   * unwind the C++ frames without the GVL */
+  static void* grow_buffer_with_gvl(void* ptr) {
+    GrowBufferArgs* args = static_cast<GrowBufferArgs*>(ptr);
+    rb_protect(grow_buffer_protected, reinterpret_cast<VALUE>(args), &args->state);
+    return nullptr;
+  }
+
+  /* Grow the buffers of the columns truncated by the last fetch,
+   * and fetch the whole values of them again.  A non-local exit while
+   * growing a buffer is kept in jump_state_ and rethrown by fetch_rows.
+   * This is called without the GVL. */
+  bool fetch_truncated_columns(MYSQL_STMT* stmt) {
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      MYSQL_BIND& bind = wrapper_->result_buffers[i];
+      if (!*bind.error) continue;
+
+      GrowBufferArgs args = { &bind, *bind.length, 0 };
+      rb_thread_call_with_gvl(grow_buffer_with_gvl, &args);
+      if (args.state) {
+        jump_state_ = args.state;
+        return false;
+      }
+      if (mysql_stmt_fetch_column(stmt, &bind, i, 0)) {
+        error_message_ = mysql_stmt_error(stmt);
+        return false;
+      }
+      rebind_result_ = true;
+    }
+    return true;
+  }
+
+  static temporal::CivilTime civil_time(const MYSQL_TIME& ts) {
+    temporal::CivilTime t;
+    t.year = static_cast<int>(ts.year);
+    t.month = ts.month;
+    t.day = ts.day;
+    t.hour = ts.hour;
+    t.minute = ts.minute;
+    t.second = ts.second;
+    t.microsecond = ts.second_part;
+    t.negative = ts.neg;
+    return t;
+  }
+
+  /* The timezone of timestamp columns.  The values are converted into UTC,
+   * and the timezone is the one in which mysql2 returns Time objects.
+   * The local time zone is labelled by its name, or by "UTC" if the name
+   * is not known, which does not change the instants of the values. */
+  std::string timestamp_timezone() const {
+    const Timezone::type tz =
+      appTimezone != Timezone::unknown ? appTimezone : dbTimezone;
+    if (tz == Timezone::utc) {
+      return "UTC";
+    }
+    const std::string name = temporal::cached_local_timezone_name();
+    return name.empty() ? "UTC" : name;
+  }
+
+  /* The Ruby encoding of the values of a field, which is determined in the
+   * same way as mysql2_set_field_string_encoding in mysql2/result.c.
+   * Returns nullptr for binary strings. */
+  rb_encoding* field_encoding(unsigned int i) const {
+    const MYSQL_FIELD& f = field(i);
     /* if binary flag is set, respect its wishes */
-    if (field.flags & BINARY_FLAG && field.charsetnr == 63) {
-      rb_enc_associate(val, binaryEncoding);
-    } else if (!field.charsetnr) {
-      /* MySQL 4.x may not provide an encoding, binary will get the bytes through */
-      rb_enc_associate(val, binaryEncoding);
-    } else {
-      /* lookup the encoding configured on this field */
-      const char *enc_name;
-      int enc_index;
+    if ((f.flags & BINARY_FLAG && f.charsetnr == 63) || !f.charsetnr) {
+      return nullptr;
+    }
+
+    /* lookup the encoding configured on this field */
+    const char* enc_name = (f.charsetnr-1 < CHARSETNR_SIZE)
+      ? mysql2_mysql_enc_to_rb[f.charsetnr-1]
+      : nullptr;
+    /* otherwise fall-back to the connection's encoding */
+    rb_encoding* enc = enc_name != nullptr ? rb_enc_find(enc_name) : conn_enc;
+    return enc == rb_ascii8bit_encoding() ? nullptr : enc;
+  }
 
-      enc_name = (field.charsetnr-1 < CHARSETNR_SIZE)
-        ? mysql2_mysql_enc_to_rb[field.charsetnr-1]
-        : nullptr;
-      if (enc_name != nullptr) {
-        /* use the field encoding we were able to match */
-        enc_index = rb_enc_find_index(enc_name);
-        rb_enc_set_index(val, enc_index);
-      } else {
-        /* otherwise fall-back to the connection's encoding */
-        rb_enc_associate(val, conn_enc);
+  /* The key of the schema cache, which is made of the metadata of the
+   * fields and the options deciding their types and decoders, including
+   * the timezone of timestamp columns (see timestamp_timezone) */
+  std::string makeSchemaKey(const std::string& timezone) const {
+    std::string key;
+    auto append = [&key](const void* data, size_t size) {
+      key.append(static_cast<const char*>(data), size);
+    };
+    const char options[] = { cast, castBool, static_cast<char>(dbTimezone) };
+    append(options, sizeof(options));
+    key += timezone;
+    key += '\0';
+    /* the fallback of the encodings of the fields, see field_encoding */
+    key += rb_enc_name(conn_enc);
+    key += '\0';
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      const MYSQL_FIELD& f = field(i);
+      append(&f.name_length, sizeof(f.name_length));
+      append(f.name, f.name_length);
+      const unsigned long metadata[] = {
+        static_cast<unsigned long>(f.type), f.flags, f.length, f.decimals,
+        f.charsetnr, dictionaries_[i] ? 1UL : 0UL
+      };
+      append(metadata, sizeof(metadata));
+    }
+    return key;
+  }
+
+  /* Take the schema and the decoders of the columns from the schema cache,
+   * or make them for the first result of the query shape */
+  void makeDecodePlan() {
+    const DecodeOptions options = {
+      cast, castBool, dbTimezone == Timezone::local, timestamp_timezone()
+    };
+    std::vector<FieldInfo> fields;
+    fields.reserve(num_fields());
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      fields.push_back(field_info(field(i), field_encoding(i) == rb_utf8_encoding()));
+    }
+    decoder_.reset(new RowDecoder(std::move(fields), options));
+    for (unsigned int i = 0; i < num_fields(); ++i) {
+      if (dictionaries_[i]) {
+        decoder_->set_dictionary(i, dictionaries_[i].get());
       }
-      if (default_internal_enc_) {
-        val = rb_str_export_to_enc(val, default_internal_enc_);
+    }
+
+    auto& cache = SchemaCache::instance();
+    schema_key_ = makeSchemaKey(options.timezone);
+    plan_ = cache.Lookup(schema_key_);
+    if (plan_ == nullptr) {
+      auto plan = std::make_shared<DecodePlan>();
+      plan->schema = makeArrowSchema(options);
+      plan->decoders.reserve(num_fields());
+      for (unsigned int i = 0; i < num_fields(); ++i) {
+        plan->decoders.push_back(
+            field_decoder(decoder_->field(i), options, dictionaries_[i] != nullptr));
       }
+      plan_ = plan;
+      cache.Insert(schema_key_, plan_);
     }
-    return val;
+    decoder_->set_decoders(plan_->decoders.data());
   }
 
-  void makeArrowSchema() {
+  std::shared_ptr<arrow::Schema> makeArrowSchema(const DecodeOptions& options) const {
     std::vector<std::shared_ptr<arrow::Field>> arrow_fields;
     arrow_fields.reserve(num_fields());
     for (unsigned int i = 0; i < num_fields(); ++i) {
       bool nullable = 0 == (field_flags(i) & NOT_NULL_FLAG);
-      arrow_fields.emplace_back(std::make_shared<arrow::Field>(field_name(i), mysql_field_to_arrow_type(i), nullable));
+      auto type = field_arrow_type(decoder_->field(i), options, dictionaries_[i] != nullptr);
+      std::shared_ptr<arrow::KeyValueMetadata> metadata;
+      if (type->id() == arrow::Type::BINARY) {
+        /* RecordBatchExt#to_a makes strings in this encoding */
+        rb_encoding* enc = field_encoding(i);
+        if (enc != nullptr) {
+          metadata = std::make_shared<arrow::KeyValueMetadata>(
+              std::vector<std::string>{"encoding"},
+              std::vector<std::string>{rb_enc_name(enc)});
+        }
+      } else if (type->id() == arrow::Type::TIME64) {
+        /* RecordBatchExt#to_a makes Time objects on 2000-01-01 in the
+         * database timezone, and shows them in the one of timestamps */
+        metadata = std::make_shared<arrow::KeyValueMetadata>(
+            std::vector<std::string>{"database_timezone", "timezone"},
+            std::vector<std::string>{dbTimezone == Timezone::utc ? "UTC" : "local",
+                                     options.timezone});
+      }
+      arrow_fields.emplace_back(std::make_shared<arrow::Field>(field_name(i), type, nullable, metadata));
     }
-    schema_ = std::make_shared<arrow::Schema>(std::move(arrow_fields));
+    return std::make_shared<arrow::Schema>(std::move(arrow_fields));
   }
 
-  std::shared_ptr<arrow::DataType>
-  mysql_field_to_arrow_type(unsigned int i) const {
-    const enum enum_field_types field_type = field(i).type;
-    const unsigned int flags = field(i).flags;
-    const bool is_unsigned = 0 != (flags & UNSIGNED_FLAG);
+  mysql2_result_wrapper* wrapper_;
+  MYSQL_RES* result_;
+  unsigned int num_fields_;
+  MYSQL_FIELD* fields_;
+  /* the rows of the text protocol */
+  MysqlRowSource row_source_;
+  std::string schema_key_;
+  std::shared_ptr<const DecodePlan> plan_;
+  /* the decoder of the rows, which is made with the decode plan */
+  std::unique_ptr<RowDecoder> decoder_;
+  /* collected only with the stats option */
+  std::unique_ptr<FetchStats> stats_;
+  rb_encoding* conn_enc;
+  bool rebind_result_;
+  int64_t fetched_bytes_;
+  bool eof_;
+  std::string error_message_;
+  /* the state of a non-local exit with the GVL in the region without it */
+  int jump_state_;
+  std::vector<std::unique_ptr<StringDictionary>> dictionaries_;
+  std::unique_ptr<ThreadPool> thread_pool_;
+  /* the pool of the buffers of the batches */
+  arrow::MemoryPool* memory_pool_;
+  std::unique_ptr<RowChunk> row_chunk_;
+  /* declared last to be stopped first */
+  std::unique_ptr<RowPipeline> pipeline_;
+  RowChunk* current_chunk_;
+  int64_t current_row_;
+};
+
+VALUE record_batch_to_ruby(std::shared_ptr<arrow::RecordBatch> batch);
+
+class ResultBatchReader {
+ public:
+  ResultBatchReader(VALUE self, VALUE opts)
+      : wrapper_(get_result_wrapper(self)),
+        res_(wrapper_),
+        batch_capacity_(0),
+        exhausted_(false),
+        stats_hash_(Qnil),
+        reallocations_(0) {
+    if (wrapper_->stmt_wrapper && wrapper_->stmt_wrapper->closed) {
+      throw ruby::error(ma_eMysql2Error, "Statement handle already closed");
+    }
+
+    int cacheRows = RTEST(rb_hash_aref(opts, sym_cache_rows));
+    if (cacheRows) {
+      rb_warn(":cache_rows is ignored in to_arrow method");
+      cacheRows = 0;
+    }
 
-    if (!cast) {
-      if (field_type == MYSQL_TYPE_NULL) {
-        return arrow::null();
+    if (wrapper_->stmt_wrapper && !wrapper_->is_streaming) {
+      rb_warn("Rows are not cached in to_arrow method even for prepared statements (if not streaming)");
+    }
+
+    res_.symbolizeKeys = RTEST(rb_hash_aref(opts, sym_symbolize_keys));
+    res_.asArray       = rb_hash_aref(opts, sym_as) == sym_array;
+    res_.castBool      = RTEST(rb_hash_aref(opts, sym_cast_booleans));
+    res_.cast          = RTEST(rb_hash_aref(opts, sym_cast));
+
+    if (wrapper_->stmt_wrapper && !res_.cast) {
+      rb_warn(":cast is forced for prepared statements");
+      res_.cast = true;
+    }
+
+    res_.set_dictionary_fields(rb_hash_aref(opts, sym_dictionary));
+
+    VALUE memory_pool = rb_hash_aref(opts, sym_memory_pool);
+    res_.set_memory_pool(memory_pool_for(memory_pool));
+    if (res_.memory_pool() == nullptr) {
+      VALUE inspect = rb_inspect(memory_pool);
+      throw ruby::error(rb_eArgError,
+                        std::string("Unknown memory pool: ") + StringValueCStr(inspect));
+    }
+
+    stats_hash_ = rb_hash_aref(opts, sym_stats);
+    if (!NIL_P(stats_hash_)) {
+      if (!RB_TYPE_P(stats_hash_, T_HASH)) {
+        throw ruby::error(rb_eArgError, ":stats must be a hash");
       }
+      res_.enable_stats();
+      reallocations_ = tracked_reallocations();
+    }
 
-      return arrow::utf8();
+    VALUE threads = rb_hash_aref(opts, sym_threads);
+    if (!NIL_P(threads)) {
+      if (wrapper_->stmt_wrapper) {
+        rb_warn(":threads is ignored for prepared statements");
+      }
+      res_.set_num_threads(NUM2INT(threads));
     }
 
-    switch (field_type) {
-      case MYSQL_TYPE_TINY:     /* TINYINT:   1 byte  */
-        if (castBool && field(i).length == 1) {
-          return arrow::boolean();
-        } else {
-          return is_unsigned ? arrow::uint8() : arrow::int8();
-        }
+    VALUE dbTz = rb_hash_aref(opts, sym_database_timezone);
+    if (dbTz == sym_local) {
+      res_.dbTimezone = Timezone::local;
+    } else if (dbTz == sym_utc) {
+      res_.dbTimezone = Timezone::utc;
+    } else {
+      if (!NIL_P(dbTz)) {
+        rb_warn(":database_timezone option must be :utc or :local - defaulting to :local");
+      }
+      res_.dbTimezone = Timezone::local;
+    }
 
-      case MYSQL_TYPE_SHORT:    /* SMALLINT:  2 bytes */
-        return is_unsigned ? arrow::uint16() : arrow::int16();
+    VALUE appTz = rb_hash_aref(opts, sym_application_timezone);
+    if (appTz == sym_local) {
+      res_.appTimezone = Timezone::local;
+    } else if (appTz == sym_utc) {
+      res_.appTimezone = Timezone::utc;
+    } else {
+      res_.appTimezone = Timezone::unknown;
+    }
 
-      case MYSQL_TYPE_INT24:    /* MEDIUMINT: 3 bytes */
-      case MYSQL_TYPE_LONG:     /* INTEGER:   4 bytes */
-        return is_unsigned ? arrow::uint32() : arrow::int32();
+    wrapper_->numberOfRows = wrapper_->stmt_wrapper
+      ? mysql_stmt_num_rows(wrapper_->stmt_wrapper->stmt)
+      : mysql_num_rows(wrapper_->result);
 
-      case MYSQL_TYPE_LONGLONG: /* BIGINT:    8 bytes */
-        return is_unsigned ? arrow::uint64() : arrow::int64();
+    if (wrapper_->is_streaming) {
+      if (wrapper_->rows == Qnil) {
+        wrapper_->rows = rb_ary_new();
+      }
 
-      case MYSQL_TYPE_DECIMAL:  /* DECIMAL or NUMERIC */
-      case MYSQL_TYPE_NEWDECIMAL: /* high precision DECIMAL or NUMERIC */
-        return std::make_shared<arrow::Decimal128Type>(field(i).length, field(i).decimals);
+      if (wrapper_->streamingComplete) {
+        throw ruby::error(
+            ma_eMysql2Error,
+            "You have already fetched all the rows for this query and streaming is true. (to reiterate you must requery).");
+      }
+    }
 
-      case MYSQL_TYPE_FLOAT:    /* FLOAT: 4 bytes */
-        return arrow::float32();
+    if (RTEST(rb_hash_aref(opts, sym_pipeline))) {
+      if (!wrapper_->is_streaming || wrapper_->stmt_wrapper) {
+        rb_warn(":pipeline is ignored except for streaming results of queries");
+      }
+      res_.start_pipeline();
+    }
+  }
 
-      case MYSQL_TYPE_DOUBLE:   /* DOUBLE or REAL: 8 bytes */
-        return arrow::float64();
+  /* Keep the builders of a small result, which are empty after the last
+   * batch, for the next result of the same query shape */
+  ~ResultBatchReader() {
+    if (rbb_ == nullptr || !exhausted_) return;
+    if (batch_capacity_ <= 0 || batch_capacity_ > SchemaCache::kMaxRecycledRows) return;
+    for (int i = 0; i < rbb_->num_fields(); ++i) {
+      if (rbb_->GetField(i)->length() != 0) return;
+    }
+    SchemaCache::instance().ReturnBuilder(res_.schema_key(), res_.memory_pool(), std::move(rbb_));
+  }
 
-      case MYSQL_TYPE_BIT:  /* 1 to 64 bits */
-        if (castBool && field(i).length == 1) {
-          return arrow::boolean();
-        }
-        return arrow::binary();
+  std::shared_ptr<arrow::Schema> schema() { return res_.schema(); }
 
-      case MYSQL_TYPE_TIMESTAMP:
-        return std::make_shared<arrow::TimestampType>(arrow::TimeUnit::MICRO);
+  bool exhausted() const { return exhausted_; }
 
-      case MYSQL_TYPE_DATE:
-      case MYSQL_TYPE_NEWDATE:
-        /* TODO: need to reconsider about data type for DATE field */
-        return arrow::date32();
+  /* Make the builders for batches of batch_size rows (zero means the whole
+   * result).  The builders of stored results are reserved for the number of
+   * rows and the lengths of the values, so they are never grown. */
+  void MakeBuilder(int64_t batch_size) {
+    int64_t initial_capacity = batch_size;
+    if (!wrapper_->is_streaming) {
+      const int64_t num_rows = static_cast<int64_t>(wrapper_->numberOfRows);
+      if (initial_capacity <= 0 || initial_capacity > num_rows) {
+        initial_capacity = num_rows;
+      }
+      res_.total_field_lengths(&total_field_lengths_);
+    }
+    batch_capacity_ = initial_capacity;
 
-      case MYSQL_TYPE_TIME:
-        /* TODO: need to reconsider about data type for TIME field */
-        return std::make_shared<arrow::Time64Type>(arrow::TimeUnit::MICRO);
+    auto memory_pool = res_.memory_pool();
+    auto schema = this->schema();
+    if (initial_capacity > 0 && initial_capacity <= SchemaCache::kMaxRecycledRows) {
+      rbb_ = SchemaCache::instance().TakeBuilder(res_.schema_key(), memory_pool);
+    }
+    arrow::Status status;
+    if (rbb_ != nullptr) {
+      /* The recycled builders are reserved for the capacity of the last
+       * result of the shape */
+      rbb_->SetInitialCapacity(initial_capacity);
+      for (int i = 0; i < rbb_->num_fields() && status.ok(); ++i) {
+        status = rbb_->GetField(i)->Reserve(initial_capacity);
+      }
+    } else if (initial_capacity > 0) {
+      status = arrow::RecordBatchBuilder::Make(
+          schema, memory_pool, initial_capacity, &rbb_);
+    } else {
+      status = arrow::RecordBatchBuilder::Make(schema, memory_pool, &rbb_);
+    }
+    if (!status.ok()) {
+      throw ruby::error(rb_eRuntimeError, status.message());
+    }
 
-      case MYSQL_TYPE_DATETIME:
-        /* TODO: need to reconsider about data type for DATETIME field */
-        return std::make_shared<arrow::Time64Type>(arrow::TimeUnit::MICRO);
+    ReserveData();
+  }
 
-      case MYSQL_TYPE_YEAR:    /* YEAR: 1 byte */
-        return arrow::uint16();
+  /* Fetch the next rows up to max_rows rows or max_bytes bytes of values,
+   * and return them as a record batch.  Zero means unlimited. */
+  std::shared_ptr<arrow::RecordBatch> ReadNext(int64_t max_rows = 0,
+                                               int64_t max_bytes = 0) {
+    if (rbb_ == nullptr) {
+      MakeBuilder(max_rows);
+    }
 
-      case MYSQL_TYPE_STRING:     /* CHAR, BINARY */
-      case MYSQL_TYPE_VAR_STRING: /* VARCHAR, VARBINARY */
-      case MYSQL_TYPE_VARCHAR:
-        return arrow::utf8();
+    res_.reset_fetched_bytes();
+    int64_t num_rows = 0;
+    while (!exhausted_) {
+      int64_t chunk_size = kFetchChunkSize;
+      if (max_rows > 0) {
+        if (num_rows >= max_rows) break;
+        chunk_size = std::min(chunk_size, max_rows - num_rows);
+      }
+      if (max_bytes > 0 && res_.fetched_bytes() >= max_bytes) break;
 
-      case MYSQL_TYPE_TINY_BLOB:   /* TINYBLOB, TINYTEXT */
-      case MYSQL_TYPE_MEDIUM_BLOB: /* MEDIUMBLOB, MEDIUMTEXT */
-      case MYSQL_TYPE_LONG_BLOB:   /* LONGBLOB, LONGTEXT */
-      case MYSQL_TYPE_BLOB:        /* BLOB, TEXT */
-        return arrow::utf8();
+      num_rows += res_.fetch_rows(rbb_.get(), chunk_size, max_bytes);
 
-      case MYSQL_TYPE_SET:
-      case MYSQL_TYPE_ENUM:
-      case MYSQL_TYPE_GEOMETRY:
-        /* TODO */
-        return nullptr;
+      /* Interrupts are checked between chunks */
+      check_interrupts();
 
-      case MYSQL_TYPE_NULL:
-        return arrow::null();
+      if (res_.eof()) {
+        Finish();
+      }
+    }
 
-      default:
-        break;
+    /* Flushing resets the builders with the initial capacity,
+     * so the next batch does not grow them from scratch. */
+    FetchStats* stats = res_.stats();
+    std::shared_ptr<arrow::RecordBatch> batch;
+    {
+      ScopedTimer timer(stats ? &stats->flush_ns : nullptr);
+      auto status = rbb_->Flush(&batch);
+      if (!status.ok()) {
+        throw ruby::error(rb_eRuntimeError, status.message());
+      }
+      if (!exhausted_) {
+        ReserveData();
+      }
+      batch = res_.finish_batch(batch);
+    }
+    if (stats) {
+      stats->rows += batch->num_rows();
+      stats->bytes += res_.fetched_bytes();
+      ++stats->batches;
     }
+    report_memory_usage();
+    return batch;
+  }
+
+  /* Stop reading the connection ahead while Ruby code runs, such as the
+   * block of each_arrow_batch */
+  void PauseFetch() { res_.pause_pipeline(); }
 
-    return arrow::binary();
+  void ResumeFetch() { res_.resume_pipeline(); }
+
+  /* Write the rows into a recording, see recording.h */
+  int64_t Record(const std::string& path) {
+    const int64_t num_rows = res_.record_rows(path);
+    Finish();
+    return num_rows;
   }
 
-  MYSQL_RES* result_;
-  unsigned int num_fields_;
-  MYSQL_FIELD* fields_;
-  std::shared_ptr<arrow::Schema> schema_;
-  rb_encoding* default_internal_enc_;
-  rb_encoding* conn_enc;
-};
+  /* Wrap a batch into a Ruby object */
+  VALUE ToRuby(const std::shared_ptr<arrow::RecordBatch>& batch) {
+    FetchStats* stats = res_.stats();
+    ScopedTimer timer(stats ? &stats->wrap_ns : nullptr);
+    return record_batch_to_ruby(batch);
+  }
 
-VALUE
-mysql2_result_to_arrow(int argc, VALUE* argv, VALUE self)
-{
-  using namespace internal;
+  /* Store the counters into the hash given by the stats option.  The
+   * decode time of the text protocol is also summed by the decoders of
+   * the columns, such as { "int32" => ..., "bytes" => ... } */
+  void WriteStats() {
+    FetchStats* stats = res_.stats();
+    if (stats == nullptr) return;
+
+    std::map<std::string, int64_t> decode_ns_by_type;
+    int64_t decode_ns = stats->decode_ns;
+    for (unsigned int i = 0; i < res_.num_fields(); ++i) {
+      const int64_t ns = stats->column_decode_ns[i];
+      if (ns == 0) continue;
+      decode_ns += ns;
+      decode_ns_by_type[column_decoder_name(res_.decoder(i))] += ns;
+    }
+    VALUE by_type = rb_hash_new();
+    for (const auto& entry : decode_ns_by_type) {
+      rb_hash_aset(by_type, rb_str_new_cstr(entry.first.c_str()), LL2NUM(entry.second));
+    }
 
-  GET_RESULT(self);
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("rows")), LL2NUM(stats->rows));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("bytes")), LL2NUM(stats->bytes));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("batches")), LL2NUM(stats->batches));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("gvl_released_ns")), LL2NUM(stats->gvl_released_ns));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("fetch_ns")), LL2NUM(stats->fetch_ns));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("decode_ns")), LL2NUM(decode_ns));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("decode_ns_by_type")), by_type);
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("flush_ns")), LL2NUM(stats->flush_ns));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("wrap_ns")), LL2NUM(stats->wrap_ns));
+    rb_hash_aset(stats_hash_, ID2SYM(rb_intern("builder_reallocations")),
+                 LL2NUM(tracked_reallocations() - reallocations_));
+  }
 
-  /* TODO: support prepared statement */
-  if (wrapper->stmt_wrapper) {
-    throw ruby::error(rb_eNotImpError, "Prepared statement is not supported");
+ private:
+  static mysql2_result_wrapper* get_result_wrapper(VALUE self) {
+    GET_RESULT(self);
+    return wrapper;
   }
 
-  if (wrapper->stmt_wrapper && wrapper->stmt_wrapper->closed) {
-    throw ruby::error(ma_eMysql2Error, "Statement handle already closed");
+  void Finish() {
+    exhausted_ = true;
+
+    if (wrapper_->is_streaming) {
+      rb_mysql_result_free_result(wrapper_);
+      wrapper_->streamingComplete = 1;
+
+      // Check for errors, the connection might have gone out from under us
+      // mysql_error returns an empty string if there is no error
+      const char* errstr = mysql_error(wrapper_->client_wrapper->client);
+      if (errstr[0]) {
+        throw ruby::error(ma_eMysql2Error, errstr);
+      }
+    }
   }
 
-  VALUE defaults = rb_iv_get(self, "@query_options");
-  Check_Type(defaults, T_HASH);
+  /* Reserve the data buffers of string and binary builders for a batch,
+   * in proportion to the total lengths of the values in the result */
+  void ReserveData() {
+    const int64_t num_rows = static_cast<int64_t>(wrapper_->numberOfRows);
+    if (total_field_lengths_.empty() || num_rows == 0) return;
+
+    auto schema = this->schema();
+    for (int i = 0; i < schema->num_fields(); ++i) {
+      switch (schema->field(i)->type()->id()) {
+        case arrow::Type::STRING:
+        case arrow::Type::BINARY:
+          break;
+        default:
+          continue;
+      }
 
-  VALUE opts;
-  if (rb_scan_args(argc, argv, "01", &opts) == 1) {
-    opts = rb_funcall(defaults, intern_merge, 1, opts);
-  } else {
-    opts = defaults;
+      int64_t length = total_field_lengths_[i];
+      if (batch_capacity_ < num_rows) {
+        length = (length * batch_capacity_ + num_rows - 1) / num_rows;
+      }
+      auto status = static_cast<arrow::BinaryBuilder*>(rbb_->GetField(i))->ReserveData(length);
+      if (!status.ok()) {
+        throw ruby::error(rb_eRuntimeError, status.message());
+      }
+    }
   }
 
-  int cacheRows = RTEST(rb_hash_aref(opts, sym_cache_rows));
-  if (cacheRows) {
-    rb_warn(":cache_rows is ignored in to_arrow method");
-    cacheRows = 0;
+  static VALUE check_interrupts_protected(VALUE) {
+    rb_thread_check_ints();
+    return Qnil;
   }
 
-  if (wrapper->stmt_wrapper && !wrapper->is_streaming) {
-    rb_warn("Rows are not cached in to_arrow method even for prepared statements (if not streaming)");
+  static void check_interrupts() {
+    int state = 0;
+    rb_protect(check_interrupts_protected, Qnil, &state);
+    if (state) {
+      throw ruby::tag(state);
+    }
   }
 
-  ResultWrapper res(wrapper);
+  mysql2_result_wrapper* wrapper_;
+  ResultWrapper res_;
+  std::unique_ptr<arrow::RecordBatchBuilder> rbb_;
+  int64_t batch_capacity_;
+  std::vector<int64_t> total_field_lengths_;
+  bool exhausted_;
+  /* the hash of the stats option, which is on the stack of the caller */
+  VALUE stats_hash_;
+  /* the reallocations in the tracking pool before the result is read */
+  int64_t reallocations_;
+};
 
-  res.symbolizeKeys = RTEST(rb_hash_aref(opts, sym_symbolize_keys));
-  res.asArray       = rb_hash_aref(opts, sym_as) == sym_array;
-  res.castBool      = RTEST(rb_hash_aref(opts, sym_cast_booleans));
-  res.cast          = RTEST(rb_hash_aref(opts, sym_cast));
+VALUE
+merge_query_options(VALUE self, VALUE opts)
+{
+  VALUE defaults = rb_iv_get(self, "@query_options");
+  Check_Type(defaults, T_HASH);
 
-  if (wrapper->stmt_wrapper && !res.cast) {
-    rb_warn(":cast is forced for prepared statements");
+  if (NIL_P(opts)) {
+    return defaults;
   }
+  return rb_funcall(defaults, intern_merge, 1, opts);
+}
 
-  VALUE dbTz = rb_hash_aref(opts, sym_database_timezone);
-  if (dbTz == sym_local) {
-    res.dbTimezone = Timezone::local;
-  } else if (dbTz == sym_utc) {
-    res.dbTimezone = Timezone::utc;
-  } else {
-    if (!NIL_P(dbTz)) {
-      rb_warn(":database_timezone option must be :utc or :local - defaulting to :local");
+VALUE
+record_batch_to_ruby(std::shared_ptr<arrow::RecordBatch> batch)
+{
+  auto gobj_batch = GARROW_RECORD_BATCH(
+      g_object_new(GARROW_TYPE_RECORD_BATCH,
+                   "record-batch", &batch, nullptr));
+  return GOBJ2RVAL(gobj_batch);
+}
+
+VALUE
+yield_record_batch(VALUE rb_batch)
+{
+  return rb_yield(rb_batch);
+}
+
+VALUE
+mysql2_result_to_arrow(int argc, VALUE* argv, VALUE self)
+{
+  VALUE opts = Qnil;
+  rb_scan_args(argc, argv, "01", &opts);
+
+  ResultBatchReader reader(self, merge_query_options(self, opts));
+  VALUE batch = reader.ToRuby(reader.ReadNext());
+  reader.WriteStats();
+  return batch;
+}
+
+VALUE
+mysql2_result_each_arrow_batch(int argc, VALUE* argv, VALUE self)
+{
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  VALUE opts = Qnil;
+  rb_scan_args(argc, argv, "01", &opts);
+
+  int64_t batch_size = kDefaultBatchSize;
+  int64_t batch_bytes = 0;
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    VALUE val = rb_hash_aref(opts, sym_batch_size);
+    if (!NIL_P(val)) {
+      batch_size = NUM2LL(val);
+    }
+    val = rb_hash_aref(opts, sym_batch_bytes);
+    if (!NIL_P(val)) {
+      batch_bytes = NUM2LL(val);
+    }
+    if (batch_size <= 0 && batch_bytes <= 0) {
+      throw ruby::error(rb_eArgError, "batch_size or batch_bytes must be positive");
     }
-    res.dbTimezone = Timezone::local;
   }
 
-  VALUE appTz = rb_hash_aref(opts, sym_application_timezone);
-  if (appTz == sym_local) {
-    res.appTimezone = Timezone::local;
-  } else if (appTz == sym_utc) {
-    res.appTimezone = Timezone::utc;
-  } else {
-    res.appTimezone = Timezone::unknown;
+  ResultBatchReader reader(self, merge_query_options(self, opts));
+  reader.MakeBuilder(batch_size);
+  while (!reader.exhausted()) {
+    auto batch = reader.ReadNext(batch_size, batch_bytes);
+    if (batch->num_rows() == 0) break;
+
+    reader.PauseFetch();
+    int state = 0;
+    rb_protect(yield_record_batch, reader.ToRuby(batch), &state);
+    if (state) {
+      throw ruby::tag(state);
+    }
+    reader.ResumeFetch();
   }
+  reader.WriteStats();
 
-  wrapper->numberOfRows = wrapper->stmt_wrapper
-    ? mysql_stmt_num_rows(wrapper->stmt_wrapper->stmt)
-    : mysql_num_rows(wrapper->result);
+  return self;
+}
 
-  using fetch_row_func_t = bool (internal::ResultWrapper::*)(
-      std::unique_ptr<arrow::RecordBatchBuilder>&);
-  fetch_row_func_t fetch_row_func;
-  if (wrapper->stmt_wrapper) {
-    fetch_row_func = &internal::ResultWrapper::fetch_row_stmt;
-  } else {
-    fetch_row_func = &internal::ResultWrapper::fetch_row;
+struct WriteBatchArgs {
+  writer::BatchWriter* writer;
+  const std::shared_ptr<arrow::RecordBatch>* batch;
+  arrow::Status status;
+};
+
+void*
+nogvl_write_batch(void* ptr)
+{
+  auto args = static_cast<WriteBatchArgs*>(ptr);
+  args->status = args->writer->Write(*args->batch);
+  return nullptr;
+}
+
+writer::Format
+parse_output_format(VALUE format)
+{
+  if (NIL_P(format) || format == sym_ipc_stream) {
+    return writer::Format::IPC_STREAM;
+  } else if (format == sym_ipc_file) {
+    return writer::Format::IPC_FILE;
+  } else if (format == sym_parquet) {
+    return writer::Format::PARQUET;
+  }
+  VALUE inspect = rb_inspect(format);
+  throw ruby::error(rb_eArgError, std::string("Unknown format: ") + StringValueCStr(inspect));
+}
+
+arrow::Compression::type
+parse_compression(VALUE compression)
+{
+  if (NIL_P(compression)) {
+    return arrow::Compression::UNCOMPRESSED;
   }
+  VALUE name = rb_sym2str(rb_to_symbol(compression));
+  const std::string str(RSTRING_PTR(name), RSTRING_LEN(name));
+  if (str == "gzip") return arrow::Compression::GZIP;
+  if (str == "snappy") return arrow::Compression::SNAPPY;
+  if (str == "zstd") return arrow::Compression::ZSTD;
+  if (str == "lz4") return arrow::Compression::LZ4;
+  if (str == "brotli") return arrow::Compression::BROTLI;
+  throw ruby::error(rb_eArgError, std::string("Unknown compression: ") + str);
+}
 
-  auto schema = res.schema();
-  auto num_fields = schema->num_fields();
-  auto memory_pool = arrow::default_memory_pool();
-  std::unique_ptr<arrow::RecordBatchBuilder> rbb;
-  auto status = arrow::RecordBatchBuilder::Make(schema, memory_pool, &rbb);
+void
+check_status(const arrow::Status& status, const writer::RubyIOOutputStream* io_stream)
+{
+  if (io_stream != nullptr && io_stream->state() != 0) {
+    throw ruby::tag(io_stream->state());
+  }
   if (!status.ok()) {
-    throw ruby::error(rb_eRuntimeError, status.message());
+    throw ruby::error(status.IsInvalid() || status.IsNotImplemented()
+                      ? rb_eArgError : rb_eIOError,
+                      status.message());
   }
+}
 
-  if (wrapper->is_streaming) {
-    if (wrapper->rows == Qnil) {
-      wrapper->rows = rb_ary_new();
+/* Write the rows into a file or an IO object batch by batch, so only a
+ * batch of the rows is in memory at once.  The batches are written without
+ * the GVL unless they are written to an IO object. */
+VALUE
+mysql2_result_write_arrow(int argc, VALUE* argv, VALUE self)
+{
+  VALUE dest, opts = Qnil;
+  rb_scan_args(argc, argv, "11", &dest, &opts);
+
+  writer::Format format = writer::Format::IPC_STREAM;
+  arrow::Compression::type compression = arrow::Compression::UNCOMPRESSED;
+  int64_t batch_size = kDefaultBatchSize;
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    format = parse_output_format(rb_hash_aref(opts, sym_format));
+    compression = parse_compression(rb_hash_aref(opts, sym_compression));
+    VALUE val = rb_hash_aref(opts, sym_batch_size);
+    if (!NIL_P(val)) {
+      batch_size = NUM2LL(val);
+      if (batch_size <= 0) {
+        throw ruby::error(rb_eArgError, "batch_size must be positive");
+      }
     }
+  }
 
-    if (!wrapper->streamingComplete) {
-      while ((res.*fetch_row_func)(rbb));
+  const bool to_io = rb_respond_to(dest, intern_write);
+  VALUE path = to_io ? Qnil : rb_get_path(dest);
 
-      rb_mysql_result_free_result(wrapper);
-      wrapper->streamingComplete = 1;
+  /* The result and the options are validated before the destination is
+   * opened, which truncates an existing file */
+  ResultBatchReader reader(self, merge_query_options(self, opts));
+  reader.MakeBuilder(batch_size);
 
-      // Check for errors, the connection might have gone out from under us
-      // mysql_error returns an empty string if there is no error
-      const char* errstr = mysql_error(wrapper->client_wrapper->client);
-      if (errstr[0]) {
-        throw ruby::error(ma_eMysql2Error, errstr);
-      }
+  std::shared_ptr<arrow::io::OutputStream> sink;
+  writer::RubyIOOutputStream* io_stream = nullptr;
+  if (to_io) {
+    auto stream = std::make_shared<writer::RubyIOOutputStream>(dest);
+    io_stream = stream.get();
+    sink = stream;
+  } else {
+    std::shared_ptr<arrow::io::FileOutputStream> file;
+    check_status(arrow::io::FileOutputStream::Open(
+        std::string(RSTRING_PTR(path), RSTRING_LEN(path)), &file), nullptr);
+    sink = file;
+  }
+
+  std::unique_ptr<writer::BatchWriter> batch_writer;
+  int64_t num_rows = 0;
+  while (true) {
+    std::shared_ptr<arrow::RecordBatch> batch;
+    check_status(writer::unpack_dictionaries(reader.ReadNext(batch_size), &batch), nullptr);
+    /* the methods of an IO object are Ruby code */
+    if (io_stream != nullptr) {
+      reader.PauseFetch();
+    }
+
+    /* the schema is the one of the first batch, which is empty for empty
+     * results, since the types of dictionaries are known after decoding */
+    if (batch_writer == nullptr) {
+      check_status(writer::open_batch_writer(
+          format, batch->schema(), sink, compression, &batch_writer), io_stream);
+    }
+    if (batch->num_rows() == 0) break;
+
+    WriteBatchArgs args = { batch_writer.get(), &batch, arrow::Status::OK() };
+    if (io_stream != nullptr) {
+      nogvl_write_batch(&args);
     } else {
-      throw ruby::error(
-          ma_eMysql2Error,
-          "You have already fetched all the rows for this query and streaming is true. (to reiterate you must requery).");
+      rb_thread_call_without_gvl(nogvl_write_batch, &args, RUBY_UBF_IO, 0);
     }
-  }
-  else { /* not streaming */
-    for (unsigned long i = 0; i < wrapper->numberOfRows; i++) {
-      (void)(res.*fetch_row_func)(rbb);
+    check_status(args.status, io_stream);
+    num_rows += batch->num_rows();
+
+    if (reader.exhausted()) break;
+    if (io_stream != nullptr) {
+      reader.ResumeFetch();
     }
   }
+  check_status(batch_writer->Close(), io_stream);
+  reader.WriteStats();
 
-  std::shared_ptr<arrow::RecordBatch> batch;
-  status = rbb->Flush(&batch);
-  if (!status.ok()) {
-    throw ruby::error(rb_eRuntimeError, status.message());
-  }
+  return LL2NUM(num_rows);
+}
 
-  auto gobj_batch = GARROW_RECORD_BATCH(
-      g_object_new(GARROW_TYPE_RECORD_BATCH,
-                   "record-batch", &batch, nullptr));
-  return GOBJ2RVAL(gobj_batch);
+/* Record the rows and the metadata of the fields for replaying them in the
+ * decoder benchmark */
+VALUE
+mysql2_result_record_rows(VALUE self, VALUE dest)
+{
+  VALUE path = rb_get_path(dest);
+  ResultBatchReader reader(self, merge_query_options(self, Qnil));
+  return LL2NUM(reader.Record(std::string(RSTRING_PTR(path), RSTRING_LEN(path))));
 }
 
 }  // namespace internal
@@ -576,11 +1874,78 @@ mysql2_result_to_arrow(int argc, VALUE* argv, VALUE self)
 static VALUE
 mysql2_result_to_arrow(int argc, VALUE* argv, VALUE self)
 {
+  int state = 0;
   try {
     return internal::mysql2_result_to_arrow(argc, argv, self);
   } catch (ruby::error err) {
     rb_exc_raise(err.exception_object());
+  } catch (ruby::tag tag) {
+    state = tag.state();
+  }
+  rb_jump_tag(state);
+}
+
+static VALUE
+mysql2_result_each_arrow_batch(int argc, VALUE* argv, VALUE self)
+{
+  int state = 0;
+  try {
+    return internal::mysql2_result_each_arrow_batch(argc, argv, self);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  } catch (ruby::tag tag) {
+    state = tag.state();
   }
+  rb_jump_tag(state);
+}
+
+static VALUE
+mysql2_result_write_arrow(int argc, VALUE* argv, VALUE self)
+{
+  int state = 0;
+  try {
+    return internal::mysql2_result_write_arrow(argc, argv, self);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  } catch (ruby::tag tag) {
+    state = tag.state();
+  }
+  rb_jump_tag(state);
+}
+
+static VALUE
+mysql2_result_record_rows(VALUE self, VALUE dest)
+{
+  int state = 0;
+  try {
+    return internal::mysql2_result_record_rows(self, dest);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  } catch (ruby::tag tag) {
+    state = tag.state();
+  }
+  rb_jump_tag(state);
+}
+
+/* The number of the query shapes in the schema cache, the lookups that
+ * hit and missed, and the builders reused */
+static VALUE
+mysql2_arrow_schema_cache_stats(VALUE self)
+{
+  auto stats = internal::SchemaCache::instance().stats();
+  VALUE res = rb_hash_new();
+  rb_hash_aset(res, ID2SYM(rb_intern("size")), SIZET2NUM(stats.size));
+  rb_hash_aset(res, ID2SYM(rb_intern("hits")), ULL2NUM(stats.hits));
+  rb_hash_aset(res, ID2SYM(rb_intern("misses")), ULL2NUM(stats.misses));
+  rb_hash_aset(res, ID2SYM(rb_intern("recycled_builders")), ULL2NUM(stats.recycled_builders));
+  return res;
+}
+
+static VALUE
+mysql2_arrow_clear_schema_cache(VALUE self)
+{
+  internal::SchemaCache::instance().Clear();
+  return Qnil;
 }
 
 extern "C" void
@@ -592,10 +1957,22 @@ Init_mysql2_result_extension(void)
 
   rb_define_method(mResultExtension, "to_arrow",
                    reinterpret_cast<VALUE (*)(...)>(mysql2_result_to_arrow), -1);
+  rb_define_method(mResultExtension, "each_arrow_batch",
+                   reinterpret_cast<VALUE (*)(...)>(mysql2_result_each_arrow_batch), -1);
+  rb_define_method(mResultExtension, "write_arrow",
+                   reinterpret_cast<VALUE (*)(...)>(mysql2_result_write_arrow), -1);
+  rb_define_method(mResultExtension, "record_rows",
+                   reinterpret_cast<VALUE (*)(...)>(mysql2_result_record_rows), 1);
+
+  rb_define_module_function(ma_mMysql2Arrow, "schema_cache_stats",
+                            reinterpret_cast<VALUE (*)(...)>(mysql2_arrow_schema_cache_stats), 0);
+  rb_define_module_function(ma_mMysql2Arrow, "clear_schema_cache",
+                            reinterpret_cast<VALUE (*)(...)>(mysql2_arrow_clear_schema_cache), 0);
 
   intern_utc          = rb_intern("utc");
   intern_local        = rb_intern("local");
   intern_merge        = rb_intern("merge");
+  intern_write        = rb_intern("write");
   // intern_localtime    = rb_intern("localtime");
   // intern_local_offset = rb_intern("local_offset");
   // intern_civil        = rb_intern("civil");
@@ -612,8 +1989,18 @@ Init_mysql2_result_extension(void)
   sym_application_timezone  = ID2SYM(rb_intern("application_timezone"));
   sym_cache_rows     = ID2SYM(rb_intern("cache_rows"));
   sym_cast           = ID2SYM(rb_intern("cast"));
+  sym_batch_size     = ID2SYM(rb_intern("batch_size"));
+  sym_batch_bytes    = ID2SYM(rb_intern("batch_bytes"));
+  sym_dictionary     = ID2SYM(rb_intern("dictionary"));
+  sym_threads        = ID2SYM(rb_intern("threads"));
+  sym_pipeline       = ID2SYM(rb_intern("pipeline"));
+  sym_format         = ID2SYM(rb_intern("format"));
+  sym_memory_pool    = ID2SYM(rb_intern("memory_pool"));
+  sym_stats          = ID2SYM(rb_intern("stats"));
+  sym_compression    = ID2SYM(rb_intern("compression"));
+  sym_ipc_stream     = ID2SYM(rb_intern("ipc_stream"));
+  sym_ipc_file       = ID2SYM(rb_intern("ipc_file"));
+  sym_parquet        = ID2SYM(rb_intern("parquet"));
   // sym_stream         = ID2SYM(rb_intern("stream"));
   // sym_name           = ID2SYM(rb_intern("name"));
-
-  binaryEncoding = rb_enc_find("binary");
 }
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_ROW_SOURCE_H
+#define MYSQL2_ARROW_ROW_SOURCE_H 1
+
+/*
+ * Sources of the rows of the text protocol, which are decoded by RowDecoder
+ * in decoder.h.
+ *
+ * A row is an array of pointers to the values, which are NULL for SQL NULL,
+ * and an array of the lengths of the values, in the same layout as
+ * MYSQL_ROW and mysql_fetch_lengths.  This file does not depend on Ruby, so
+ * the rows can be replayed outside of a Ruby process.
+ */
+
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#else
+#include <mysql/mysql.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace internal {
+
+class RowSource {
+ public:
+  virtual ~RowSource() {}
+
+  /* Read the next row.  The values and the lengths are valid until the
+   * next call.  Returns false at the end of the rows. */
+  virtual bool Next(const char* const** values, const unsigned long** lengths) = 0;
+};
+
+/* The rows of a result of libmysqlclient */
+class MysqlRowSource : public RowSource {
+ public:
+  explicit MysqlRowSource(MYSQL_RES* result) : result_(result) {}
+
+  bool Next(const char* const** values, const unsigned long** lengths) override {
+    MYSQL_ROW row = mysql_fetch_row(result_);
+    if (row == nullptr) {
+      return false;
+    }
+    *values = row;
+    *lengths = mysql_fetch_lengths(result_);
+    return true;
+  }
+
+ private:
+  MYSQL_RES* result_;
+};
+
+/* The offset of NULL values copied into RowChunk */
+static const size_t kNullOffset = static_cast<size_t>(-1);
+
+/* The rows fetched from the text protocol for decoding them column by column.
+ * The rows of stored results are valid until the result is freed, but the
+ * ones of streaming results are overwritten by the next fetch, so they are
+ * copied if copy is true. */
+class RowChunk {
+ public:
+  RowChunk(unsigned int num_fields, bool copy)
+      : num_fields_(num_fields), copy_(copy), num_rows_(0) {}
+
+  unsigned int num_fields() const { return num_fields_; }
+
+  int64_t num_rows() const { return num_rows_; }
+
+  void clear() {
+    num_rows_ = 0;
+    values_.clear();
+    lengths_.clear();
+    offsets_.clear();
+    data_.clear();
+  }
+
+  void add_row(const char* const* row, const unsigned long* lengths) {
+    for (unsigned int i = 0; i < num_fields_; ++i) {
+      lengths_.push_back(lengths[i]);
+      if (!copy_) {
+        values_.push_back(row[i]);
+      } else if (row[i] == nullptr) {
+        offsets_.push_back(kNullOffset);
+      } else {
+        offsets_.push_back(data_.size());
+        data_.insert(data_.end(), row[i], row[i] + lengths[i]);
+      }
+    }
+    ++num_rows_;
+  }
+
+  /* Resolve the pointers to the copied values after all the rows are added */
+  void finish() {
+    if (!copy_) return;
+    values_.resize(offsets_.size());
+    for (size_t k = 0; k < offsets_.size(); ++k) {
+      values_[k] = offsets_[k] == kNullOffset ? nullptr : data_.data() + offsets_[k];
+    }
+  }
+
+  const char* value(int64_t r, unsigned int i) const { return values_[r * num_fields_ + i]; }
+
+  unsigned long length(int64_t r, unsigned int i) const { return lengths_[r * num_fields_ + i]; }
+
+  /* The values and the lengths of the row r in the layout of MYSQL_ROW */
+  const char* const* row_values(int64_t r) const { return values_.data() + r * num_fields_; }
+
+  const unsigned long* row_lengths(int64_t r) const { return lengths_.data() + r * num_fields_; }
+
+ private:
+  const unsigned int num_fields_;
+  const bool copy_;
+  int64_t num_rows_;
+  std::vector<const char*> values_;
+  std::vector<unsigned long> lengths_;
+  std::vector<size_t> offsets_;
+  std::vector<char> data_;
+};
+
+/* The rows of a finished chunk, which can be replayed from the first row
+ * by Rewind */
+class ChunkRowSource : public RowSource {
+ public:
+  explicit ChunkRowSource(const RowChunk& chunk) : chunk_(chunk), next_row_(0) {}
+
+  bool Next(const char* const** values, const unsigned long** lengths) override {
+    if (next_row_ == chunk_.num_rows()) {
+      return false;
+    }
+    *values = chunk_.row_values(next_row_);
+    *lengths = chunk_.row_lengths(next_row_);
+    ++next_row_;
+    return true;
+  }
+
+  void Rewind() { next_row_ = 0; }
+
+ private:
+  const RowChunk& chunk_;
+  int64_t next_row_;
+};
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_ROW_SOURCE_H */
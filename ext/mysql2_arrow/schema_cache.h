@@ -0,0 +1,156 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_SCHEMA_CACHE_H
+#define MYSQL2_ARROW_SCHEMA_CACHE_H 1
+
+/*
+ * A process-wide cache of the schemas and the decode plans of the results,
+ * keyed by the metadata of the fields and the options affecting the types.
+ *
+ * The same query returns the same fields every time, so the schema and the
+ * decoders of the columns are derived once per query shape.  The builders
+ * of small results are also kept in the cache after the results are read,
+ * and reused for the next result of the same shape.
+ */
+
+#include "decoder.h"
+
+#include <arrow/api.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace internal {
+
+struct DecodePlan {
+  std::shared_ptr<arrow::Schema> schema;
+  std::vector<ColumnDecoder> decoders;
+};
+
+class SchemaCache {
+ public:
+  /* The number of the query shapes kept in the cache.  The cache is cleared
+   * when it is full, since an application has only a few hot shapes and the
+   * others are rebuilt cheaply. */
+  static const size_t kMaxEntries = 256;
+
+  /* The builders of the results up to this number of rows are recycled */
+  static const int64_t kMaxRecycledRows = 1024;
+
+  /* The number of the idle builders kept for a shape */
+  static const size_t kMaxIdleBuilders = 4;
+
+  static SchemaCache& instance() {
+    /* never destructed, since the builders may outlive the exit handlers */
+    static SchemaCache* cache = new SchemaCache();
+    return *cache;
+  }
+
+  std::shared_ptr<const DecodePlan> Lookup(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      ++misses_;
+      return nullptr;
+    }
+    ++hits_;
+    return it->second.plan;
+  }
+
+  void Insert(const std::string& key, std::shared_ptr<const DecodePlan> plan) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.size() >= kMaxEntries) {
+      entries_.clear();
+    }
+    entries_[key].plan = std::move(plan);
+  }
+
+  /* Take an idle builder of the shape allocating from pool, or nullptr */
+  std::unique_ptr<arrow::RecordBatchBuilder>
+  TakeBuilder(const std::string& key, arrow::MemoryPool* pool) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) return nullptr;
+    auto& builders = it->second.idle_builders;
+    for (auto b = builders.begin(); b != builders.end(); ++b) {
+      if (b->first == pool) {
+        auto builder = std::move(b->second);
+        builders.erase(b);
+        ++recycled_builders_;
+        return builder;
+      }
+    }
+    return nullptr;
+  }
+
+  /* Keep an empty builder of the shape for the next result */
+  void ReturnBuilder(const std::string& key, arrow::MemoryPool* pool,
+                     std::unique_ptr<arrow::RecordBatchBuilder> builder) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) return;
+    auto& builders = it->second.idle_builders;
+    if (builders.size() < kMaxIdleBuilders) {
+      builders.emplace_back(pool, std::move(builder));
+    }
+  }
+
+  /* Remove the entries and reset the counters */
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    hits_ = 0;
+    misses_ = 0;
+    recycled_builders_ = 0;
+  }
+
+  struct Stats {
+    size_t size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t recycled_builders;
+  };
+
+  Stats stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Stats{entries_.size(), hits_, misses_, recycled_builders_};
+  }
+
+ private:
+  SchemaCache() : hits_(0), misses_(0), recycled_builders_(0) {}
+
+  struct Entry {
+    std::shared_ptr<const DecodePlan> plan;
+    std::vector<std::pair<arrow::MemoryPool*,
+                          std::unique_ptr<arrow::RecordBatchBuilder>>> idle_builders;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t recycled_builders_;
+};
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_SCHEMA_CACHE_H */
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_STATS_H
+#define MYSQL2_ARROW_STATS_H 1
+
+/*
+ * The timers and the counters of the phases of reading a result, which are
+ * collected only if the stats option is given.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace internal {
+
+inline int64_t
+monotonic_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct FetchStats {
+  explicit FetchStats(unsigned int num_fields)
+      : rows(0),
+        bytes(0),
+        batches(0),
+        gvl_released_ns(0),
+        fetch_ns(0),
+        decode_ns(0),
+        flush_ns(0),
+        wrap_ns(0),
+        column_decode_ns(num_fields, 0) {}
+
+  int64_t rows;
+  int64_t bytes;
+  int64_t batches;
+  /* the time in the regions without the GVL */
+  int64_t gvl_released_ns;
+  /* the time in libmysqlclient reading the rows, which includes the waits
+   * on the socket for streaming results */
+  int64_t fetch_ns;
+  /* the time decoding the rows of prepared statements, whose columns are
+   * not timed one by one */
+  int64_t decode_ns;
+  /* the time flushing the builders into batches */
+  int64_t flush_ns;
+  /* the time wrapping the batches into Ruby objects */
+  int64_t wrap_ns;
+  /* the time decoding each column of the text protocol.  A column is
+   * decoded by one thread at a time, so the threads add to their own
+   * counters. */
+  std::vector<int64_t> column_decode_ns;
+};
+
+/* Add the time of a scope to a counter, or do nothing without counter */
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(int64_t* counter)
+      : counter_(counter), start_(counter ? monotonic_ns() : 0) {}
+
+  ~ScopedTimer() {
+    if (counter_) *counter_ += monotonic_ns() - start_;
+  }
+
+ private:
+  int64_t* counter_;
+  int64_t start_;
+};
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_STATS_H */
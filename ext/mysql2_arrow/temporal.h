@@ -0,0 +1,245 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_TEMPORAL_H
+#define MYSQL2_ARROW_TEMPORAL_H 1
+
+#include "parsers.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <string>
+
+#include <unistd.h>
+
+namespace internal {
+
+namespace temporal {
+
+/* The broken-down value of DATE, DATETIME, TIMESTAMP and TIME */
+struct CivilTime {
+  int year;
+  unsigned int month;
+  unsigned int day;
+  unsigned int hour;
+  unsigned int minute;
+  unsigned int second;
+  unsigned long microsecond;
+  bool negative;
+};
+
+/* The number of days since 1970-01-01 in the proleptic Gregorian calendar */
+inline int32_t days_from_civil(int y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const int era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = static_cast<unsigned>(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + static_cast<int>(doe) - 719468;
+}
+
+/* The seconds since the epoch of the civil time regarded as UTC */
+inline int64_t seconds_from_civil(const CivilTime& t) {
+  const int64_t days = days_from_civil(t.year, t.month, t.day);
+  return ((days * 24 + t.hour) * 60 + t.minute) * 60 + t.second;
+}
+
+/* The microseconds of TIME values, which can be negative or longer than a day */
+inline int64_t time_microseconds(const CivilTime& t) {
+  const int64_t usec = ((t.hour * 60LL + t.minute) * 60LL + t.second) * 1000000LL
+    + t.microsecond;
+  return t.negative ? -usec : usec;
+}
+
+/* Whether the value is a zero date like 0000-00-00, which mysql2 returns as nil.
+ * Dates with zero in month or day are also treated as invalid. */
+inline bool is_invalid_date(const CivilTime& t) {
+  return t.month == 0 || t.day == 0;
+}
+
+namespace detail {
+
+inline bool parse_number(const char*& p, const char* end, unsigned int* out) {
+  const char* stop;
+  *out = static_cast<unsigned int>(parsers::parse_digits(p, end, &stop));
+  if (stop == p) return false;
+  p = stop;
+  return true;
+}
+
+inline bool expect(const char*& p, const char* end, char c) {
+  if (p == end || *p != c) return false;
+  ++p;
+  return true;
+}
+
+/* Parse the optional fractional part of seconds as microseconds */
+inline bool parse_fraction(const char*& p, const char* end, unsigned long* out) {
+  *out = 0;
+  if (p == end || *p != '.') return true;
+  ++p;
+  unsigned long scale = 100000;
+  for (; p < end && parsers::is_digit(*p); ++p) {
+    *out += static_cast<unsigned long>(*p - '0') * scale;
+    scale /= 10;
+  }
+  return true;
+}
+
+inline bool parse_date_part(const char*& p, const char* end, CivilTime* out) {
+  unsigned int year;
+  if (!parse_number(p, end, &year) || !expect(p, end, '-') ||
+      !parse_number(p, end, &out->month) || !expect(p, end, '-') ||
+      !parse_number(p, end, &out->day)) {
+    return false;
+  }
+  out->year = static_cast<int>(year);
+  return true;
+}
+
+inline bool parse_time_part(const char*& p, const char* end, CivilTime* out) {
+  return parse_number(p, end, &out->hour) && expect(p, end, ':') &&
+    parse_number(p, end, &out->minute) && expect(p, end, ':') &&
+    parse_number(p, end, &out->second) &&
+    parse_fraction(p, end, &out->microsecond);
+}
+
+}  // namespace detail
+
+/* Parse "YYYY-MM-DD" */
+inline bool parse_date(const char* ptr, size_t len, CivilTime* out) {
+  const char* p = ptr;
+  const char* end = ptr + len;
+  *out = CivilTime();
+  return detail::parse_date_part(p, end, out) && p == end;
+}
+
+/* Parse "YYYY-MM-DD hh:mm:ss[.ffffff]" */
+inline bool parse_datetime(const char* ptr, size_t len, CivilTime* out) {
+  const char* p = ptr;
+  const char* end = ptr + len;
+  *out = CivilTime();
+  return detail::parse_date_part(p, end, out) && detail::expect(p, end, ' ') &&
+    detail::parse_time_part(p, end, out) && p == end;
+}
+
+/* Parse "[-]hhh:mm:ss[.ffffff]" */
+inline bool parse_time(const char* ptr, size_t len, CivilTime* out) {
+  const char* p = ptr;
+  const char* end = ptr + len;
+  *out = CivilTime();
+  if (p < end && *p == '-') {
+    out->negative = true;
+    ++p;
+  }
+  return detail::parse_time_part(p, end, out) && p == end;
+}
+
+/* Converter of local civil times into UTC.
+ *
+ * mktime is slow, so the UTC offsets are cached for each 15 minutes of
+ * local time, which is the granularity of the transitions in the tz
+ * database.  An instance must not be shared among threads. */
+class LocalTimeConverter {
+ public:
+  LocalTimeConverter() : cached_bucket_(INT64_MIN), cached_offset_(0) {}
+
+  /* Convert the seconds since the epoch in local time into ones in UTC */
+  int64_t to_utc(int64_t local_seconds) {
+    const int64_t bucket = floor_div(local_seconds, kBucketSeconds);
+    if (bucket != cached_bucket_) {
+      cached_offset_ = utc_offset(local_seconds);
+      cached_bucket_ = bucket;
+    }
+    return local_seconds - cached_offset_;
+  }
+
+ private:
+  static const int64_t kBucketSeconds = 15 * 60;
+
+  static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b < 0 ? 1 : 0);
+  }
+
+  static int64_t utc_offset(int64_t local_seconds) {
+    const time_t t = static_cast<time_t>(local_seconds);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    tm.tm_isdst = -1;
+    const time_t utc = mktime(&tm);
+    return local_seconds - static_cast<int64_t>(utc);
+  }
+
+  int64_t cached_bucket_;
+  int64_t cached_offset_;
+};
+
+/* The name of the local time zone in the tz database, which is given by
+ * TZ or the link of /etc/localtime.  Returns an empty string if it is not
+ * known, such as for POSIX TZ strings like "JST-9".  A fixed UTC offset is
+ * not used, since it is wrong for the values across DST transitions. */
+inline std::string local_timezone_name() {
+  std::string path;
+  const char* tz = getenv("TZ");
+  if (tz != nullptr && tz[0] != '\0') {
+    path = tz[0] == ':' ? tz + 1 : tz;
+  } else {
+    char buf[PATH_MAX];
+    const ssize_t len = readlink("/etc/localtime", buf, sizeof(buf) - 1);
+    if (len <= 0) return std::string();
+    path.assign(buf, len);
+  }
+
+  static const char kZoneinfo[] = "zoneinfo/";
+  const size_t pos = path.find(kZoneinfo);
+  std::string name = pos == std::string::npos ? path : path.substr(pos + sizeof(kZoneinfo) - 1);
+  if (name.empty() || name[0] == '/') return std::string();
+
+  const char* tzdir = getenv("TZDIR");
+  const std::string file = std::string(tzdir && tzdir[0] ? tzdir : "/usr/share/zoneinfo") + "/" + name;
+  if (access(file.c_str(), R_OK) != 0) return std::string();
+  return name;
+}
+
+/* local_timezone_name cached for the process, which is looked up again
+ * only when TZ changes, so a query does not read the file system */
+inline std::string cached_local_timezone_name() {
+  static std::mutex mutex;
+  static bool cached = false;
+  static std::string cached_tz;
+  static std::string cached_name;
+
+  const char* tz = getenv("TZ");
+  /* "=" followed by TZ, which is distinguished from an unset TZ */
+  const std::string current_tz = tz ? std::string(1, '=') + tz : std::string();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!cached || current_tz != cached_tz) {
+    cached_name = local_timezone_name();
+    cached_tz = current_tz;
+    cached = true;
+  }
+  return cached_name;
+}
+
+}  // namespace temporal
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_TEMPORAL_H */
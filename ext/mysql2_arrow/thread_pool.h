@@ -0,0 +1,149 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_THREAD_POOL_H
+#define MYSQL2_ARROW_THREAD_POOL_H 1
+
+/*
+ * A pool of native threads running the tasks of a loop in parallel.
+ *
+ * The tasks must not touch any Ruby object, since the threads are not Ruby
+ * threads and the GVL is not held.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace internal {
+
+class ThreadPool {
+ public:
+  /* The calling thread of Run is also a worker, so num_threads - 1 threads
+   * are started here. */
+  explicit ThreadPool(int num_threads)
+      : generation_(0),
+        stopping_(false),
+        task_(nullptr),
+        num_tasks_(0),
+        next_task_(0),
+        num_running_(0) {
+    for (int i = 1; i < num_threads; ++i) {
+      threads_.emplace_back(&ThreadPool::WorkerMain, this);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_available_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  int num_threads() const { return static_cast<int>(threads_.size()) + 1; }
+
+  /* Call task(0), ..., task(num_tasks - 1) in parallel, and wait for them.
+   * The tasks are taken one by one from a shared counter, so the threads
+   * that finish early take the rest of the tasks.  The first exception
+   * thrown by the tasks is rethrown as std::runtime_error. */
+  void Run(int64_t num_tasks, const std::function<void(int64_t)>& task) {
+    if (threads_.empty() || num_tasks <= 1) {
+      for (int64_t i = 0; i < num_tasks; ++i) task(i);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      num_tasks_ = num_tasks;
+      next_task_ = 0;
+      num_running_ = static_cast<int>(threads_.size());
+      error_message_.clear();
+      ++generation_;
+    }
+    work_available_.notify_all();
+
+    RunTasks();
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_done_.wait(lock, [this] { return num_running_ == 0; });
+    task_ = nullptr;
+    if (!error_message_.empty()) {
+      throw std::runtime_error(error_message_);
+    }
+  }
+
+ private:
+  void WorkerMain() {
+    uint64_t seen_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_available_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+        if (stopping_) return;
+        seen_generation = generation_;
+      }
+
+      RunTasks();
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        --num_running_;
+      }
+      work_done_.notify_one();
+    }
+  }
+
+  void RunTasks() {
+    for (int64_t i = next_task_++; i < num_tasks_; i = next_task_++) {
+      try {
+        (*task_)(i);
+      } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_message_.empty()) error_message_ = e.what();
+      }
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable work_done_;
+  uint64_t generation_;
+  bool stopping_;
+
+  /* the current loop, which is set by Run */
+  const std::function<void(int64_t)>* task_;
+  int64_t num_tasks_;
+  std::atomic<int64_t> next_task_;
+  int num_running_;
+  std::string error_message_;
+};
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_THREAD_POOL_H */
@@ -0,0 +1,348 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MYSQL2_ARROW_WRITER_H
+#define MYSQL2_ARROW_WRITER_H 1
+
+/*
+ * Writers of record batches into Arrow IPC streams, Arrow IPC files and
+ * Parquet files, which is available if the extension is built with Parquet.
+ *
+ * The dictionaries of a result grow batch by batch, but an IPC stream
+ * carries only the dictionaries of its schema, so dictionary-encoded
+ * columns are written as plain strings.
+ */
+
+#include <ruby.h>
+
+#include <arrow/api.h>
+#include <arrow/io/compressed.h>
+#include <arrow/io/file.h>
+#include <arrow/io/interfaces.h>
+#include <arrow/ipc/writer.h>
+#include <arrow/util/compression.h>
+
+#ifdef HAVE_PARQUET
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace internal {
+
+namespace writer {
+
+enum class Format {
+  IPC_STREAM,
+  IPC_FILE,
+  PARQUET
+};
+
+/* The output stream writing into a Ruby IO object by its write method.
+ * It must be used with the GVL.  The small writes of the IPC messages are
+ * buffered, and passed to write in kBufferSize bytes.  A non-local exit of
+ * write is returned as an IOError status, and its state is kept in state()
+ * to be resumed. */
+class RubyIOOutputStream : public arrow::io::OutputStream {
+ public:
+  explicit RubyIOOutputStream(VALUE io)
+      : io_(io), position_(0), closed_(false), state_(0) {}
+
+  using arrow::io::OutputStream::Write;
+
+  arrow::Status Write(const void* data, int64_t nbytes) override {
+    if (closed_) {
+      return arrow::Status::IOError("Stream is closed");
+    }
+    buffer_.append(static_cast<const char*>(data), nbytes);
+    position_ += nbytes;
+    if (buffer_.size() >= kBufferSize) {
+      return Flush();
+    }
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Flush() override {
+    if (buffer_.empty()) {
+      return arrow::Status::OK();
+    }
+    VALUE args[2];
+    args[0] = io_;
+    args[1] = rb_str_new(buffer_.data(), buffer_.size());
+    buffer_.clear();
+    rb_protect(call_write, reinterpret_cast<VALUE>(args), &state_);
+    if (state_ != 0) {
+      return arrow::Status::IOError("Failed to write to IO");
+    }
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Tell(int64_t* position) const override {
+    *position = position_;
+    return arrow::Status::OK();
+  }
+
+  /* The IO object itself is closed by its owner */
+  arrow::Status Close() override {
+    if (closed_) {
+      return arrow::Status::OK();
+    }
+    closed_ = true;
+    return Flush();
+  }
+
+  bool closed() const { return closed_; }
+
+  int state() const { return state_; }
+
+ private:
+  static VALUE call_write(VALUE arg) {
+    const VALUE* args = reinterpret_cast<const VALUE*>(arg);
+    return rb_funcall(args[0], rb_intern("write"), 1, args[1]);
+  }
+
+  static const size_t kBufferSize = 1024 * 1024;
+
+  VALUE io_;
+  std::string buffer_;
+  int64_t position_;
+  bool closed_;
+  int state_;
+};
+
+inline int64_t dictionary_index(const arrow::Array& indices, int64_t i) {
+  switch (indices.type_id()) {
+    case arrow::Type::INT8:
+      return static_cast<const arrow::Int8Array&>(indices).Value(i);
+    case arrow::Type::INT16:
+      return static_cast<const arrow::Int16Array&>(indices).Value(i);
+    case arrow::Type::INT32:
+      return static_cast<const arrow::Int32Array&>(indices).Value(i);
+    default:
+      return static_cast<const arrow::Int64Array&>(indices).Value(i);
+  }
+}
+
+/* Replace the dictionary arrays of strings, including the values of list
+ * arrays, with the plain arrays of the values */
+inline arrow::Status unpack_dictionary(const std::shared_ptr<arrow::Array>& array,
+                                       std::shared_ptr<arrow::Array>* out) {
+  if (array->type_id() == arrow::Type::LIST) {
+    const auto& list_array = static_cast<const arrow::ListArray&>(*array);
+    std::shared_ptr<arrow::Array> values;
+    RETURN_NOT_OK(unpack_dictionary(list_array.values(), &values));
+    if (values == list_array.values()) {
+      *out = array;
+      return arrow::Status::OK();
+    }
+    *out = std::make_shared<arrow::ListArray>(
+        arrow::list(values->type()), list_array.length(), list_array.value_offsets(),
+        values, list_array.null_bitmap(), list_array.null_count(), list_array.offset());
+    return arrow::Status::OK();
+  }
+
+  if (array->type_id() != arrow::Type::DICTIONARY) {
+    *out = array;
+    return arrow::Status::OK();
+  }
+
+  const auto& dict_array = static_cast<const arrow::DictionaryArray&>(*array);
+  const auto& dictionary = static_cast<const arrow::BinaryArray&>(*dict_array.dictionary());
+  const auto& indices = *dict_array.indices();
+
+  std::unique_ptr<arrow::ArrayBuilder> builder;
+  RETURN_NOT_OK(arrow::MakeBuilder(arrow::default_memory_pool(), dictionary.type(), &builder));
+  auto binary_builder = static_cast<arrow::BinaryBuilder*>(builder.get());
+  RETURN_NOT_OK(binary_builder->Reserve(indices.length()));
+  for (int64_t i = 0; i < indices.length(); ++i) {
+    if (indices.IsNull(i)) {
+      RETURN_NOT_OK(binary_builder->AppendNull());
+      continue;
+    }
+    int32_t length;
+    const uint8_t* value = dictionary.GetValue(dictionary_index(indices, i), &length);
+    RETURN_NOT_OK(binary_builder->Append(value, length));
+  }
+  return binary_builder->Finish(out);
+}
+
+inline arrow::Status unpack_dictionaries(const std::shared_ptr<arrow::RecordBatch>& batch,
+                                         std::shared_ptr<arrow::RecordBatch>* out) {
+  std::vector<std::shared_ptr<arrow::Field>> fields;
+  std::vector<std::shared_ptr<arrow::Array>> columns;
+  bool unpacked = false;
+  for (int i = 0; i < batch->num_columns(); ++i) {
+    std::shared_ptr<arrow::Array> column;
+    RETURN_NOT_OK(unpack_dictionary(batch->column(i), &column));
+    auto field = batch->schema()->field(i);
+    if (column != batch->column(i)) {
+      field = std::make_shared<arrow::Field>(
+          field->name(), column->type(), field->nullable(), field->metadata());
+      unpacked = true;
+    }
+    fields.push_back(field);
+    columns.push_back(column);
+  }
+  if (!unpacked) {
+    *out = batch;
+    return arrow::Status::OK();
+  }
+  auto schema = arrow::schema(fields, batch->schema()->metadata());
+  *out = arrow::RecordBatch::Make(schema, batch->num_rows(), columns);
+  return arrow::Status::OK();
+}
+
+class BatchWriter {
+ public:
+  virtual ~BatchWriter() {}
+
+  virtual arrow::Status Write(const std::shared_ptr<arrow::RecordBatch>& batch) = 0;
+
+  virtual arrow::Status Close() = 0;
+};
+
+/* The writer of Arrow IPC streams or files.  Streams can be compressed as
+ * a whole by a codec, and files are left uncompressed to be memory-mapped. */
+class IpcBatchWriter : public BatchWriter {
+ public:
+  static arrow::Status Open(Format format,
+                            const std::shared_ptr<arrow::Schema>& schema,
+                            const std::shared_ptr<arrow::io::OutputStream>& sink,
+                            arrow::Compression::type compression,
+                            std::unique_ptr<BatchWriter>* out) {
+    std::unique_ptr<IpcBatchWriter> writer(new IpcBatchWriter());
+    writer->sink_ = sink;
+    if (compression != arrow::Compression::UNCOMPRESSED) {
+      if (format == Format::IPC_FILE) {
+        return arrow::Status::Invalid("IPC files cannot be compressed");
+      }
+      RETURN_NOT_OK(arrow::util::Codec::Create(compression, &writer->codec_));
+      std::shared_ptr<arrow::io::CompressedOutputStream> compressed;
+      RETURN_NOT_OK(arrow::io::CompressedOutputStream::Make(
+          writer->codec_.get(), sink, &compressed));
+      writer->sink_ = compressed;
+    }
+
+    if (format == Format::IPC_FILE) {
+      RETURN_NOT_OK(arrow::ipc::RecordBatchFileWriter::Open(
+          writer->sink_.get(), schema, &writer->writer_));
+    } else {
+      RETURN_NOT_OK(arrow::ipc::RecordBatchStreamWriter::Open(
+          writer->sink_.get(), schema, &writer->writer_));
+    }
+    *out = std::move(writer);
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Write(const std::shared_ptr<arrow::RecordBatch>& batch) override {
+    return writer_->WriteRecordBatch(*batch);
+  }
+
+  arrow::Status Close() override {
+    RETURN_NOT_OK(writer_->Close());
+    /* the compressed stream writes its trailer on close */
+    return sink_->Close();
+  }
+
+ private:
+  IpcBatchWriter() {}
+
+  std::unique_ptr<arrow::util::Codec> codec_;
+  std::shared_ptr<arrow::io::OutputStream> sink_;
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> writer_;
+};
+
+#ifdef HAVE_PARQUET
+/* The writer of Parquet files.  Each batch is written as a row group. */
+class ParquetBatchWriter : public BatchWriter {
+ public:
+  static arrow::Status Open(const std::shared_ptr<arrow::Schema>& schema,
+                            const std::shared_ptr<arrow::io::OutputStream>& sink,
+                            arrow::Compression::type compression,
+                            std::unique_ptr<BatchWriter>* out) {
+    parquet::WriterProperties::Builder builder;
+    switch (compression) {
+      case arrow::Compression::SNAPPY:
+        builder.compression(parquet::Compression::SNAPPY);
+        break;
+      case arrow::Compression::GZIP:
+        builder.compression(parquet::Compression::GZIP);
+        break;
+      case arrow::Compression::BROTLI:
+        builder.compression(parquet::Compression::BROTLI);
+        break;
+      case arrow::Compression::ZSTD:
+        builder.compression(parquet::Compression::ZSTD);
+        break;
+      case arrow::Compression::LZ4:
+        builder.compression(parquet::Compression::LZ4);
+        break;
+      default:
+        builder.compression(parquet::Compression::UNCOMPRESSED);
+        break;
+    }
+
+    std::unique_ptr<ParquetBatchWriter> writer(new ParquetBatchWriter());
+    writer->sink_ = sink;
+    RETURN_NOT_OK(parquet::arrow::FileWriter::Open(
+        *schema, arrow::default_memory_pool(), sink, builder.build(), &writer->writer_));
+    *out = std::move(writer);
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Write(const std::shared_ptr<arrow::RecordBatch>& batch) override {
+    std::shared_ptr<arrow::Table> table;
+    RETURN_NOT_OK(arrow::Table::FromRecordBatches({batch}, &table));
+    return writer_->WriteTable(*table, batch->num_rows());
+  }
+
+  arrow::Status Close() override {
+    RETURN_NOT_OK(writer_->Close());
+    return sink_->Close();
+  }
+
+ private:
+  ParquetBatchWriter() {}
+
+  std::shared_ptr<arrow::io::OutputStream> sink_;
+  std::unique_ptr<parquet::arrow::FileWriter> writer_;
+};
+#endif
+
+inline arrow::Status open_batch_writer(Format format,
+                                       const std::shared_ptr<arrow::Schema>& schema,
+                                       const std::shared_ptr<arrow::io::OutputStream>& sink,
+                                       arrow::Compression::type compression,
+                                       std::unique_ptr<BatchWriter>* out) {
+  if (format == Format::PARQUET) {
+#ifdef HAVE_PARQUET
+    return ParquetBatchWriter::Open(schema, sink, compression, out);
+#else
+    return arrow::Status::NotImplemented("mysql2-arrow is built without Parquet");
+#endif
+  }
+  return IpcBatchWriter::Open(format, schema, sink, compression, out);
+}
+
+}  // namespace writer
+
+}  // namespace internal
+
+#endif /* MYSQL2_ARROW_WRITER_H */
@@ -0,0 +1,511 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PG_ARROW_BINARY_COPY_H
+#define PG_ARROW_BINARY_COPY_H 1
+
+/*
+ * The decoder of the binary format of COPY TO STDOUT (FORMAT binary).
+ *
+ * The stream is a header, the tuples, and a trailer:
+ *
+ *   "PGCOPY\n\377\r\n\0", int32 flags, int32 extension length, extension
+ *   per tuple: int16 number of fields, and per field int32 length (-1 for
+ *              NULL) and the value in the binary send format of its type
+ *   int16 -1
+ *
+ * The integers are in the network byte order.  The server sends a tuple in
+ * a CopyData message, with the header in the first one, so the messages
+ * are decoded one by one.  This file does not depend on Ruby nor libpq.
+ */
+
+#include "parsers.h"
+
+#include <arrow/api.h>
+#include <arrow/util/decimal.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace internal {
+
+/* The OIDs of the built-in types in pg_type.h */
+namespace oid {
+static const uint32_t kBool = 16;
+static const uint32_t kBytea = 17;
+static const uint32_t kName = 19;
+static const uint32_t kInt8 = 20;
+static const uint32_t kInt2 = 21;
+static const uint32_t kInt4 = 23;
+static const uint32_t kText = 25;
+static const uint32_t kOid = 26;
+static const uint32_t kJson = 114;
+static const uint32_t kFloat4 = 700;
+static const uint32_t kFloat8 = 701;
+static const uint32_t kBpchar = 1042;
+static const uint32_t kVarchar = 1043;
+static const uint32_t kDate = 1082;
+static const uint32_t kTime = 1083;
+static const uint32_t kTimestamp = 1114;
+static const uint32_t kTimestampTz = 1184;
+static const uint32_t kNumeric = 1700;
+static const uint32_t kUuid = 2950;
+static const uint32_t kJsonb = 3802;
+}  // namespace oid
+
+/* The maximum precision of NUMERIC columns decoded into decimal128 */
+static const int kMaxDecimal128Precision = 38;
+
+/* The microseconds and the days from 1970-01-01 to 2000-01-01, the epoch
+ * of the dates and the timestamps of PostgreSQL */
+static const int64_t kPostgresEpochMicroseconds = 946684800000000LL;
+static const int32_t kPostgresEpochDays = 10957;
+
+/* The column of a result given by PQdescribePrepared */
+struct PgField {
+  std::string name;
+  uint32_t type;
+  int32_t typmod;
+};
+
+/* The precision and the scale of a NUMERIC(p, s) column, or false for an
+ * unconstrained NUMERIC */
+inline bool
+numeric_precision_scale(const PgField& f, int* precision, int* scale) {
+  if (f.typmod < 4) return false;
+  *precision = ((f.typmod - 4) >> 16) & 0xffff;
+  *scale = (f.typmod - 4) & 0xffff;
+  return true;
+}
+
+/* The type of the builder of a column, or nullptr for unsupported types.
+ * Text values are utf8 if the client encoding is UTF8, or binary. */
+inline std::shared_ptr<arrow::DataType>
+pg_arrow_type(const PgField& f, bool utf8) {
+  int precision, scale;
+  switch (f.type) {
+    case oid::kBool:   return arrow::boolean();
+    case oid::kInt2:   return arrow::int16();
+    case oid::kInt4:   return arrow::int32();
+    case oid::kInt8:   return arrow::int64();
+    case oid::kOid:    return arrow::uint32();
+    case oid::kFloat4: return arrow::float32();
+    case oid::kFloat8: return arrow::float64();
+
+    case oid::kNumeric:
+      if (numeric_precision_scale(f, &precision, &scale) &&
+          precision <= kMaxDecimal128Precision) {
+        return std::make_shared<arrow::Decimal128Type>(precision, scale);
+      }
+      /* the scale of unconstrained NUMERIC varies by value */
+      return arrow::utf8();
+
+    case oid::kDate:
+      return arrow::date32();
+
+    case oid::kTime:
+      return std::make_shared<arrow::Time64Type>(arrow::TimeUnit::MICRO);
+
+    /* TIMESTAMP values are in UTC as ActiveRecord assumes by default */
+    case oid::kTimestamp:
+    case oid::kTimestampTz:
+      return arrow::timestamp(arrow::TimeUnit::MICRO, "UTC");
+
+    case oid::kName:
+    case oid::kText:
+    case oid::kBpchar:
+    case oid::kVarchar:
+    case oid::kJson:
+    case oid::kJsonb:
+      return utf8 ? arrow::utf8() : arrow::binary();
+
+    case oid::kBytea:
+      return arrow::binary();
+
+    /* in the canonical text form as the pg gem returns */
+    case oid::kUuid:
+      return arrow::utf8();
+
+    default:
+      return nullptr;
+  }
+}
+
+namespace binary {
+
+inline uint16_t read_uint16(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return static_cast<uint16_t>((u[0] << 8) | u[1]);
+}
+
+inline uint32_t read_uint32(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return (static_cast<uint32_t>(u[0]) << 24) | (static_cast<uint32_t>(u[1]) << 16) |
+         (static_cast<uint32_t>(u[2]) << 8) | static_cast<uint32_t>(u[3]);
+}
+
+inline uint64_t read_uint64(const char* p) {
+  return (static_cast<uint64_t>(read_uint32(p)) << 32) | read_uint32(p + 4);
+}
+
+inline int16_t read_int16(const char* p) { return static_cast<int16_t>(read_uint16(p)); }
+inline int32_t read_int32(const char* p) { return static_cast<int32_t>(read_uint32(p)); }
+inline int64_t read_int64(const char* p) { return static_cast<int64_t>(read_uint64(p)); }
+
+inline float read_float(const char* p) {
+  const uint32_t bits = read_uint32(p);
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+inline double read_double(const char* p) {
+  const uint64_t bits = read_uint64(p);
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static const uint16_t kNumericPositive = 0x0000;
+static const uint16_t kNumericNegative = 0x4000;
+static const uint16_t kNumericNaN = 0xC000;
+/* the infinities of PostgreSQL 14 or later */
+static const uint16_t kNumericPositiveInfinity = 0xD000;
+static const uint16_t kNumericNegativeInfinity = 0xF000;
+
+/* The text of the special NUMERIC values, NaN and the infinities, or
+ * nullptr for the other values */
+inline const char*
+numeric_special_text(const char* p, int32_t length) {
+  if (length < 8) return nullptr;
+  switch (read_uint16(p + 4)) {
+    case kNumericNaN:              return "NaN";
+    case kNumericPositiveInfinity: return "Infinity";
+    case kNumericNegativeInfinity: return "-Infinity";
+    default:                       return nullptr;
+  }
+}
+
+/* Format a NUMERIC value in the decimal notation with the digits of its
+ * display scale, in the same way as get_str_from_var in numeric.c.
+ * The value is int16 ndigits, int16 weight, uint16 sign, int16 dscale and
+ * ndigits base-10000 digits.  Returns false for the special values (see
+ * numeric_special_text) and malformed values. */
+inline bool
+format_numeric(const char* p, int32_t length, std::string* out) {
+  if (length < 8) return false;
+  const int ndigits = read_int16(p);
+  const int weight = read_int16(p + 2);
+  const uint16_t sign = read_uint16(p + 4);
+  const int dscale = read_int16(p + 6);
+  if (sign != kNumericPositive && sign != kNumericNegative) return false;
+  if (ndigits < 0 || length < 8 + 2 * ndigits) return false;
+  const char* digits = p + 8;
+
+  out->clear();
+  if (sign == kNumericNegative) out->push_back('-');
+
+  char group[4];
+  auto digit_at = [&](int k) -> int {
+    return 0 <= k && k < ndigits ? read_int16(digits + 2 * k) : 0;
+  };
+  auto format_group = [&](int value) {
+    for (int j = 3; j >= 0; --j) {
+      group[j] = '0' + value % 10;
+      value /= 10;
+    }
+  };
+
+  /* the integer part */
+  if (weight < 0) {
+    out->push_back('0');
+  } else {
+    for (int k = 0; k <= weight; ++k) {
+      format_group(digit_at(k));
+      if (k == 0) {
+        int skip = 0;
+        while (skip < 3 && group[skip] == '0') ++skip;
+        out->append(group + skip, 4 - skip);
+      } else {
+        out->append(group, 4);
+      }
+    }
+  }
+
+  /* the fractional part up to dscale digits */
+  if (dscale > 0) {
+    out->push_back('.');
+    int remaining = dscale;
+    for (int k = weight + 1; remaining > 0; ++k) {
+      format_group(digit_at(k));
+      const int n = remaining < 4 ? remaining : 4;
+      out->append(group, n);
+      remaining -= n;
+    }
+  }
+  return true;
+}
+
+/* Format a UUID value as xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx */
+inline void
+format_uuid(const char* p, char* out) {
+  static const char kHex[] = "0123456789abcdef";
+  for (int k = 0; k < 16; ++k) {
+    if (k == 4 || k == 6 || k == 8 || k == 10) *out++ = '-';
+    const unsigned char c = static_cast<unsigned char>(p[k]);
+    *out++ = kHex[c >> 4];
+    *out++ = kHex[c & 0xf];
+  }
+}
+
+}  // namespace binary
+
+/* The decoder of the CopyData messages of a COPY TO STDOUT (FORMAT binary)
+ * into the builders of a record batch */
+class BinaryCopyDecoder {
+ public:
+  BinaryCopyDecoder(std::vector<PgField> fields, arrow::RecordBatchBuilder* rbb)
+      : fields_(std::move(fields)), rbb_(rbb), header_read_(false), finished_(false),
+        num_rows_(0) {
+    for (const auto& f : fields_) {
+      int precision;
+      int scale = -1;
+      if (f.type == oid::kNumeric &&
+          (!numeric_precision_scale(f, &precision, &scale) || precision > kMaxDecimal128Precision)) {
+        scale = -1;
+      }
+      scales_.push_back(scale);
+    }
+  }
+
+  bool finished() const { return finished_; }
+
+  int64_t num_rows() const { return num_rows_; }
+
+  /* Decode the tuples in a message.  Returns false and sets *error for
+   * malformed messages. */
+  bool Decode(const char* data, int32_t length, std::string* error) {
+    const char* p = data;
+    const char* const end = data + length;
+    if (!header_read_) {
+      static const char kSignature[] = "PGCOPY\n\377\r\n";
+      const size_t kSignatureLength = 11;  /* with the NUL */
+      if (end - p < static_cast<ptrdiff_t>(kSignatureLength + 8) ||
+          std::memcmp(p, kSignature, kSignatureLength) != 0) {
+        *error = "invalid header of binary COPY";
+        return false;
+      }
+      p += kSignatureLength + 4;  /* the flags are reserved */
+      const int32_t extension_length = binary::read_int32(p);
+      p += 4;
+      if (extension_length < 0 || end - p < extension_length) {
+        *error = "invalid header extension of binary COPY";
+        return false;
+      }
+      p += extension_length;
+      header_read_ = true;
+    }
+
+    while (p < end) {
+      if (end - p < 2) {
+        *error = "truncated tuple in binary COPY";
+        return false;
+      }
+      const int16_t num_fields = binary::read_int16(p);
+      p += 2;
+      if (num_fields == -1) {
+        finished_ = true;
+        return true;
+      }
+      if (num_fields != static_cast<int16_t>(fields_.size())) {
+        *error = "unexpected number of fields in binary COPY";
+        return false;
+      }
+      for (int i = 0; i < num_fields; ++i) {
+        if (end - p < 4) {
+          *error = "truncated tuple in binary COPY";
+          return false;
+        }
+        const int32_t field_length = binary::read_int32(p);
+        p += 4;
+        if (field_length > end - p) {
+          *error = "truncated value in binary COPY";
+          return false;
+        }
+        const char* value = field_length < 0 ? nullptr : p;
+        if (!AppendValue(i, value, field_length < 0 ? 0 : field_length)) {
+          *error = "invalid value of column " + fields_[i].name + " in binary COPY";
+          return false;
+        }
+        if (value) p += field_length;
+      }
+      ++num_rows_;
+    }
+    return true;
+  }
+
+ private:
+  template <typename BuilderType>
+  BuilderType* builder(int i) { return rbb_->GetFieldAs<BuilderType>(i); }
+
+  /* Append a value in the binary send format.  val is NULL for SQL NULL.
+   * Returns false when the length does not match the type. */
+  bool AppendValue(int i, const char* val, int32_t length) {
+    if (val == nullptr) {
+      return rbb_->GetField(i)->AppendNull().ok();
+    }
+
+    switch (fields_[i].type) {
+      case oid::kBool:
+        if (length != 1) return false;
+        builder<arrow::BooleanBuilder>(i)->Append(val[0] != 0);
+        return true;
+
+      case oid::kInt2:
+        if (length != 2) return false;
+        builder<arrow::Int16Builder>(i)->Append(binary::read_int16(val));
+        return true;
+
+      case oid::kInt4:
+        if (length != 4) return false;
+        builder<arrow::Int32Builder>(i)->Append(binary::read_int32(val));
+        return true;
+
+      case oid::kInt8:
+        if (length != 8) return false;
+        builder<arrow::Int64Builder>(i)->Append(binary::read_int64(val));
+        return true;
+
+      case oid::kOid:
+        if (length != 4) return false;
+        builder<arrow::UInt32Builder>(i)->Append(binary::read_uint32(val));
+        return true;
+
+      case oid::kFloat4:
+        if (length != 4) return false;
+        builder<arrow::FloatBuilder>(i)->Append(binary::read_float(val));
+        return true;
+
+      case oid::kFloat8:
+        if (length != 8) return false;
+        builder<arrow::DoubleBuilder>(i)->Append(binary::read_double(val));
+        return true;
+
+      case oid::kNumeric:
+        return AppendNumeric(i, val, length);
+
+      case oid::kDate:
+        {
+          if (length != 4) return false;
+          const int32_t days = binary::read_int32(val);
+          /* infinity and -infinity have no dates */
+          if (days == INT32_MAX || days == INT32_MIN) {
+            builder<arrow::Date32Builder>(i)->AppendNull();
+          } else {
+            builder<arrow::Date32Builder>(i)->Append(days + kPostgresEpochDays);
+          }
+          return true;
+        }
+
+      case oid::kTime:
+        if (length != 8) return false;
+        builder<arrow::Time64Builder>(i)->Append(binary::read_int64(val));
+        return true;
+
+      case oid::kTimestamp:
+      case oid::kTimestampTz:
+        {
+          if (length != 8) return false;
+          const int64_t microseconds = binary::read_int64(val);
+          if (microseconds == INT64_MAX || microseconds == INT64_MIN) {
+            builder<arrow::TimestampBuilder>(i)->AppendNull();
+          } else {
+            builder<arrow::TimestampBuilder>(i)->Append(
+                microseconds + kPostgresEpochMicroseconds);
+          }
+          return true;
+        }
+
+      case oid::kJsonb:
+        /* the version of the format, and the text */
+        if (length < 1 || val[0] != 1) return false;
+        static_cast<arrow::BinaryBuilder*>(rbb_->GetField(i))->Append(val + 1, length - 1);
+        return true;
+
+      case oid::kUuid:
+        {
+          if (length != 16) return false;
+          char text[36];
+          binary::format_uuid(val, text);
+          builder<arrow::StringBuilder>(i)->Append(text, sizeof(text));
+          return true;
+        }
+
+      default:
+        /* text types and bytea are in the send format as is.  StringBuilder
+         * is a BinaryBuilder, so both utf8 and binary columns work. */
+        static_cast<arrow::BinaryBuilder*>(rbb_->GetField(i))->Append(val, length);
+        return true;
+    }
+  }
+
+  /* NUMERIC values are formatted and parsed at the scale of the column,
+   * which keeps the rounding of the text form.  NaN and the infinities are
+   * NULL in decimal128 columns, and their text in string columns. */
+  bool AppendNumeric(int i, const char* val, int32_t length) {
+    const char* special = binary::numeric_special_text(val, length);
+    if (scales_[i] < 0) {
+      auto string_builder = builder<arrow::StringBuilder>(i);
+      if (special) {
+        string_builder->Append(special, static_cast<int32_t>(std::strlen(special)));
+        return true;
+      }
+      if (!binary::format_numeric(val, length, &numeric_text_)) return false;
+      string_builder->Append(numeric_text_.data(), numeric_text_.size());
+      return true;
+    }
+
+    auto decimal_builder = builder<arrow::Decimal128Builder>(i);
+    if (special) {
+      decimal_builder->AppendNull();
+      return true;
+    }
+    parsers::Int128 parsed;
+    if (!binary::format_numeric(val, length, &numeric_text_) ||
+        !parsers::parse_decimal(numeric_text_.data(), numeric_text_.size(), scales_[i], &parsed)) {
+      return false;
+    }
+    decimal_builder->Append(arrow::Decimal128(parsed.high, parsed.low));
+    return true;
+  }
+
+  const std::vector<PgField> fields_;
+  arrow::RecordBatchBuilder* rbb_;
+  /* the scales of decimal128 columns, or -1 */
+  std::vector<int> scales_;
+  bool header_read_;
+  bool finished_;
+  int64_t num_rows_;
+  std::string numeric_text_;
+};
+
+}  // namespace internal
+
+#endif /* PG_ARROW_BINARY_COPY_H */
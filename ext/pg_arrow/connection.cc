@@ -0,0 +1,304 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pg-arrow.h"
+#include "binary_copy.h"
+
+#include <ruby/thread.h>
+
+#include <arrow/api.h>
+
+#include <arrow-glib/record-batch.h>
+#include <rbgobject.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ruby {
+
+class error {
+ public:
+  error(VALUE exc_klass, const char* message) {
+    exc_ = rb_exc_new_cstr(exc_klass, message);
+  }
+
+  error(VALUE exc_klass, const std::string& message)
+      : error(exc_klass, message.c_str()) {}
+
+  VALUE exception_object() const { return exc_; }
+
+ private:
+  VALUE exc_;
+};
+
+/* A non-local exit (raise, break, throw, ...) caught by rb_protect */
+class tag {
+ public:
+  explicit tag(int state) : state_(state) {}
+
+  int state() const { return state_; }
+
+ private:
+  int state_;
+};
+
+}  // namespace ruby
+
+namespace internal {
+
+/* The query sent to the server while the GVL is released, which is
+ * canceled by the unblocking function on interrupts */
+class Query {
+ public:
+  explicit Query(PGconn* conn) : conn_(conn), cancel_(PQgetCancel(conn)) {}
+
+  ~Query() {
+    if (cancel_) PQfreeCancel(cancel_);
+  }
+
+  static void Cancel(void* ptr) {
+    auto query = static_cast<Query*>(ptr);
+    char errbuf[256];
+    if (query->cancel_) {
+      PQcancel(query->cancel_, errbuf, sizeof(errbuf));
+    }
+  }
+
+  /* Describe the columns of the result of sql with the unnamed prepared
+   * statement, without running it */
+  bool Describe(const std::string& sql, std::vector<PgField>* fields) {
+    PGresult* res = PQprepare(conn_, "", sql.c_str(), 0, nullptr);
+    const bool prepared = PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!prepared) SetError(res);
+    PQclear(res);
+    if (!prepared) return false;
+
+    res = PQdescribePrepared(conn_, "");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      SetError(res);
+      PQclear(res);
+      return false;
+    }
+    for (int i = 0; i < PQnfields(res); ++i) {
+      fields->push_back(PgField{PQfname(res, i), PQftype(res, i), PQfmod(res, i)});
+    }
+    PQclear(res);
+    return true;
+  }
+
+  /* Run COPY (sql) TO STDOUT (FORMAT binary), and decode the tuples.
+   * The rest of the data is read after an error, so the connection can be
+   * used for the next query. */
+  bool Copy(const std::string& sql, BinaryCopyDecoder* decoder) {
+    const std::string copy = "COPY (" + sql + ") TO STDOUT (FORMAT binary)";
+    PGresult* res = PQexec(conn_, copy.c_str());
+    if (PQresultStatus(res) != PGRES_COPY_OUT) {
+      SetError(res);
+      PQclear(res);
+      return false;
+    }
+    PQclear(res);
+
+    bool ok = true;
+    while (true) {
+      char* buf = nullptr;
+      const int length = PQgetCopyData(conn_, &buf, 0);
+      if (length == -1) break;
+      if (length == -2) {
+        ok = false;
+        error_ = PQerrorMessage(conn_);
+        break;
+      }
+      if (ok) {
+        ok = decoder->Decode(buf, length, &error_);
+      }
+      PQfreemem(buf);
+    }
+
+    /* the status of COPY, which has the errors in the server */
+    while ((res = PQgetResult(conn_)) != nullptr) {
+      if (PQresultStatus(res) != PGRES_COMMAND_OK && ok) {
+        ok = false;
+        SetError(res);
+      }
+      PQclear(res);
+    }
+    if (ok && !decoder->finished()) {
+      ok = false;
+      error_ = "binary COPY ended without the trailer";
+    }
+    return ok;
+  }
+
+  const std::string& error() const { return error_; }
+
+ private:
+  void SetError(const PGresult* res) {
+    const char* message = res ? PQresultErrorMessage(res) : "";
+    error_ = message[0] ? message : PQerrorMessage(conn_);
+  }
+
+  PGconn* conn_;
+  PGcancel* cancel_;
+  std::string error_;
+};
+
+struct DescribeArgs {
+  Query* query;
+  const std::string* sql;
+  std::vector<PgField>* fields;
+  bool ok;
+};
+
+void*
+nogvl_describe(void* ptr)
+{
+  auto args = static_cast<DescribeArgs*>(ptr);
+  args->ok = args->query->Describe(*args->sql, args->fields);
+  return nullptr;
+}
+
+struct CopyArgs {
+  Query* query;
+  const std::string* sql;
+  BinaryCopyDecoder* decoder;
+  bool ok;
+};
+
+void*
+nogvl_copy(void* ptr)
+{
+  auto args = static_cast<CopyArgs*>(ptr);
+  args->ok = args->query->Copy(*args->sql, args->decoder);
+  return nullptr;
+}
+
+VALUE
+check_interrupts_protected(VALUE)
+{
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+/* Raise the pending interrupts, such as Interrupt by the cancellation */
+void
+check_interrupts()
+{
+  int state = 0;
+  rb_protect(check_interrupts_protected, Qnil, &state);
+  if (state) {
+    throw ruby::tag(state);
+  }
+}
+
+bool
+client_encoding_is_utf8(PGconn* conn)
+{
+  const char* encoding = PQparameterStatus(conn, "client_encoding");
+  return encoding != nullptr && std::strcmp(encoding, "UTF8") == 0;
+}
+
+VALUE
+record_batch_to_ruby(std::shared_ptr<arrow::RecordBatch> batch)
+{
+  auto gobj_batch = GARROW_RECORD_BATCH(
+      g_object_new(GARROW_TYPE_RECORD_BATCH,
+                   "record-batch", &batch, nullptr));
+  return GOBJ2RVAL(gobj_batch);
+}
+
+/* Read the result of a query into a record batch through binary COPY.
+ * The types of the columns are resolved by describing the query before it
+ * runs, and PgArrow::UnsupportedType is raised for the types without
+ * decoders. */
+VALUE
+pg_connection_copy_to_arrow(VALUE self, VALUE rb_sql)
+{
+  PGconn* conn = pg_get_pgconn(self);
+  StringValue(rb_sql);
+  const std::string sql(RSTRING_PTR(rb_sql), RSTRING_LEN(rb_sql));
+  Query query(conn);
+
+  std::vector<PgField> fields;
+  DescribeArgs describe_args = { &query, &sql, &fields, false };
+  rb_thread_call_without_gvl(nogvl_describe, &describe_args, Query::Cancel, &query);
+  check_interrupts();
+  if (!describe_args.ok) {
+    throw ruby::error(pa_ePGError, query.error());
+  }
+
+  const bool utf8 = client_encoding_is_utf8(conn);
+  std::vector<std::shared_ptr<arrow::Field>> arrow_fields;
+  for (const auto& f : fields) {
+    auto type = pg_arrow_type(f, utf8);
+    if (type == nullptr) {
+      throw ruby::error(pa_eUnsupportedType,
+                        "Unsupported type OID " + std::to_string(f.type) + " of column " + f.name);
+    }
+    arrow_fields.push_back(arrow::field(f.name, type));
+  }
+  auto schema = arrow::schema(arrow_fields);
+
+  std::unique_ptr<arrow::RecordBatchBuilder> rbb;
+  auto status = arrow::RecordBatchBuilder::Make(schema, arrow::default_memory_pool(), &rbb);
+  if (!status.ok()) {
+    throw ruby::error(rb_eRuntimeError, status.message());
+  }
+
+  BinaryCopyDecoder decoder(std::move(fields), rbb.get());
+  CopyArgs copy_args = { &query, &sql, &decoder, false };
+  rb_thread_call_without_gvl(nogvl_copy, &copy_args, Query::Cancel, &query);
+  check_interrupts();
+  if (!copy_args.ok) {
+    throw ruby::error(pa_ePGError, query.error());
+  }
+
+  std::shared_ptr<arrow::RecordBatch> batch;
+  status = rbb->Flush(&batch);
+  if (!status.ok()) {
+    throw ruby::error(rb_eRuntimeError, status.message());
+  }
+  return record_batch_to_ruby(batch);
+}
+
+}  // namespace internal
+
+static VALUE
+pg_connection_copy_to_arrow(VALUE self, VALUE sql)
+{
+  int state = 0;
+  try {
+    return internal::pg_connection_copy_to_arrow(self, sql);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  } catch (ruby::tag tag) {
+    state = tag.state();
+  }
+  rb_jump_tag(state);
+}
+
+void
+Init_pg_arrow_connection_extension(void)
+{
+  VALUE mConnectionExtension;
+
+  mConnectionExtension = rb_define_module_under(pa_mPgArrow, "ConnectionExtension");
+
+  rb_define_method(mConnectionExtension, "copy_to_arrow",
+                   reinterpret_cast<VALUE (*)(...)>(pg_connection_copy_to_arrow), 1);
+}
@@ -0,0 +1,38 @@
+require 'mkmf-gnome2'
+
+unless required_pkg_config_package("arrow")
+  exit(false)
+end
+
+unless required_pkg_config_package("arrow-glib")
+  exit(false)
+end
+
+[
+  ["glib2", "ext/glib2"],
+].each do |name, source_dir|
+  spec = find_gem_spec(name)
+  source_dir = File.join(spec.full_gem_path, source_dir)
+  build_dir = source_dir
+  add_depend_package_path(name, source_dir, build_dir)
+end
+
+pg_includedir, pg_libdir = dir_config('pg')
+unless pg_includedir && pg_libdir
+  pg_config = with_config('pg-config')
+  pg_config = 'pg_config' if pg_config.nil? || pg_config == true
+  $INCFLAGS += " -I#{`#{pg_config} --includedir`.chomp}"
+  $LDFLAGS += " -L#{`#{pg_config} --libdir`.chomp}"
+end
+
+unless have_header('libpq-fe.h') && have_library('pq', 'PQgetCopyData')
+  $stderr.puts "Unable to find libpq"
+  abort
+end
+
+# The parsers of decimal values are shared with mysql2_arrow
+$INCFLAGS += " -I#{File.expand_path('../mysql2_arrow', __dir__)}"
+
+$CXXFLAGS += ' -std=c++11 -Wno-deprecated-register'
+
+create_makefile('pg_arrow')
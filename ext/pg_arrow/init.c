@@ -0,0 +1,21 @@
+#include "pg-arrow.h"
+
+VALUE pa_mPgArrow;
+VALUE pa_ePGError;
+VALUE pa_eUnsupportedType;
+
+void Init_pg_arrow(void);
+
+void
+Init_pg_arrow(void)
+{
+  pa_mPgArrow = rb_define_module("PgArrow");
+
+  pa_ePGError = rb_path2class("PG::Error");
+
+  /* raised before the query runs, so the caller can fall back to the
+   * regular results */
+  pa_eUnsupportedType = rb_define_class_under(pa_mPgArrow, "UnsupportedType", rb_eNotImpError);
+
+  Init_pg_arrow_connection_extension();
+}
@@ -0,0 +1,27 @@
+#ifndef PG_ARROW_H
+#define PG_ARROW_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ruby.h>
+#include <ruby/encoding.h>
+
+#include <libpq-fe.h>
+
+/* this is defined in pg/pg_connection.c, and raises PG::ConnectionBad for
+ * finished connections */
+PGconn* pg_get_pgconn(VALUE self);
+
+void Init_pg_arrow_connection_extension(void);
+
+extern VALUE pa_mPgArrow;
+extern VALUE pa_ePGError;
+extern VALUE pa_eUnsupportedType;
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif /* PG_ARROW_H */
@@ -0,0 +1,723 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Aggregations over the columns of a record batch.
+ *
+ * The values are accumulated from the Arrow buffers directly, and only the
+ * results are converted into Ruby objects.
+ */
+
+#include "record_batch_ext.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static ID intern_BigDecimal, intern_sum, intern_mean, intern_min, intern_max, intern_count, intern_div;
+
+namespace internal {
+
+/* Call func(group, i) for each row i with a value.  Without group ids, all
+ * the rows are in group 0, and the loop over the rows without nulls is
+ * simple enough to be vectorized. */
+template <typename Func>
+inline void for_each_valid(const arrow::Array& array, const int64_t* group_ids, Func&& func) {
+  const int64_t length = array.length();
+  if (array.type_id() == arrow::Type::NA) {
+    return;
+  }
+  if (array.null_count() == 0) {
+    if (group_ids == nullptr) {
+      for (int64_t i = 0; i < length; ++i) func(0, i);
+    } else {
+      for (int64_t i = 0; i < length; ++i) func(group_ids[i], i);
+    }
+  } else {
+    for (int64_t i = 0; i < length; ++i) {
+      if (array.IsValid(i)) func(group_ids == nullptr ? 0 : group_ids[i], i);
+    }
+  }
+}
+
+inline VALUE sum_to_ruby(int64_t val) { return LL2NUM(val); }
+inline VALUE sum_to_ruby(uint64_t val) { return ULL2NUM(val); }
+inline VALUE sum_to_ruby(double val) { return DBL2NUM(val); }
+
+inline VALUE sum_to_ruby(__int128 val) {
+  if (val >= std::numeric_limits<int64_t>::min() && val <= std::numeric_limits<int64_t>::max()) {
+    return LL2NUM(static_cast<int64_t>(val));
+  }
+  char buf[48];
+  char* p = buf + sizeof(buf);
+  *--p = '\0';
+  unsigned __int128 u = val < 0 ? -static_cast<unsigned __int128>(val) : val;
+  do {
+    *--p = static_cast<char>('0' + static_cast<int>(u % 10));
+    u /= 10;
+  } while (u != 0);
+  if (val < 0) *--p = '-';
+  return rb_cstr2inum(p, 10);
+}
+
+/* The mean of integers is BigDecimal as ActiveRecord's average, and the
+ * one of floats is Float */
+inline VALUE mean_to_ruby(double sum, int64_t count) { return DBL2NUM(sum / count); }
+
+template <typename AccType>
+inline VALUE mean_to_ruby(AccType sum, int64_t count) {
+  VALUE big_sum = rb_funcall(rb_mKernel, intern_BigDecimal, 1, sum_to_ruby(sum));
+  return rb_funcall(big_sum, intern_div, 1, LL2NUM(count));
+}
+
+class Aggregator {
+ public:
+  virtual ~Aggregator() {}
+
+  /* Accumulate all the rows.  group_ids[i] is the group of row i in
+   * [0, num_groups), or group_ids is nullptr for a single group. */
+  virtual void Update(const int64_t* group_ids, int64_t num_groups) = 0;
+
+  /* The result of a group */
+  virtual VALUE Finish(int64_t group) = 0;
+};
+
+/* The number of the values, or the rows if array is nullptr */
+class CountAggregator : public Aggregator {
+ public:
+  CountAggregator(const std::shared_ptr<arrow::Array>& array, int64_t num_rows)
+      : array_(array), num_rows_(num_rows) {}
+
+  void Update(const int64_t* group_ids, int64_t num_groups) override {
+    counts_.assign(num_groups, 0);
+    int64_t* counts = counts_.data();
+    if (array_ == nullptr) {
+      if (group_ids == nullptr) {
+        counts[0] = num_rows_;
+      } else {
+        for (int64_t i = 0; i < num_rows_; ++i) ++counts[group_ids[i]];
+      }
+    } else {
+      for_each_valid(*array_, group_ids, [counts](int64_t g, int64_t) { ++counts[g]; });
+    }
+  }
+
+  VALUE Finish(int64_t group) override {
+    return LL2NUM(counts_[group]);
+  }
+
+ private:
+  std::shared_ptr<arrow::Array> array_;
+  const int64_t num_rows_;
+  std::vector<int64_t> counts_;
+};
+
+/* The sum of integers or floats, or the mean of them (see mean_to_ruby).
+ * The sum of no value is zero, and the mean of no value is nil. */
+template <typename ArrayType, typename AccType>
+class SumAggregator : public Aggregator {
+ public:
+  SumAggregator(const std::shared_ptr<arrow::Array>& array, bool mean)
+      : array_(static_cast<const ArrayType&>(*array)), mean_(mean) {}
+
+  void Update(const int64_t* group_ids, int64_t num_groups) override {
+    sums_.assign(num_groups, AccType());
+    counts_.assign(num_groups, 0);
+    AccType* sums = sums_.data();
+    int64_t* counts = counts_.data();
+    const auto* values = array_.raw_values();
+    for_each_valid(array_, group_ids, [sums, counts, values](int64_t g, int64_t i) {
+      sums[g] += values[i];
+      ++counts[g];
+    });
+  }
+
+  VALUE Finish(int64_t group) override {
+    if (!mean_) {
+      return sum_to_ruby(sums_[group]);
+    }
+    if (counts_[group] == 0) {
+      return Qnil;
+    }
+    return mean_to_ruby(sums_[group], counts_[group]);
+  }
+
+ private:
+  const ArrayType& array_;
+  const bool mean_;
+  std::vector<AccType> sums_;
+  std::vector<int64_t> counts_;
+};
+
+/* The exact sum of decimals, or the mean of them as BigDecimal */
+class DecimalSumAggregator : public Aggregator {
+ public:
+  DecimalSumAggregator(const std::shared_ptr<arrow::Array>& array, bool mean)
+      : array_(static_cast<const arrow::Decimal128Array&>(*array)),
+        scale_(static_cast<const arrow::Decimal128Type&>(*array->type()).scale()),
+        mean_(mean) {}
+
+  void Update(const int64_t* group_ids, int64_t num_groups) override {
+    sums_.assign(num_groups, arrow::Decimal128());
+    counts_.assign(num_groups, 0);
+    for_each_valid(array_, group_ids, [this](int64_t g, int64_t i) {
+      sums_[g] += arrow::Decimal128(array_.GetValue(i));
+      ++counts_[g];
+    });
+  }
+
+  VALUE Finish(int64_t group) override {
+    if (!mean_) {
+      return decimal_to_ruby(sums_[group], scale_);
+    }
+    if (counts_[group] == 0) {
+      return Qnil;
+    }
+    /* BigDecimal even for the scale of zero, as ActiveRecord's average */
+    const std::string str = sums_[group].ToIntegerString() + "e" + std::to_string(-scale_);
+    VALUE sum = rb_funcall(rb_mKernel, intern_BigDecimal, 1,
+                           rb_usascii_str_new(str.data(), str.size()));
+    return rb_funcall(sum, intern_div, 1, LL2NUM(counts_[group]));
+  }
+
+ private:
+  const arrow::Decimal128Array& array_;
+  const int32_t scale_;
+  const bool mean_;
+  std::vector<arrow::Decimal128> sums_;
+  std::vector<int64_t> counts_;
+};
+
+/* The minimum and the maximum of a column of nulls */
+class NilAggregator : public Aggregator {
+ public:
+  void Update(const int64_t*, int64_t) override {}
+  VALUE Finish(int64_t) override { return Qnil; }
+};
+
+/* The view of a binary value, which is ordered by bytes */
+struct BytesView {
+  const uint8_t* ptr;
+  int32_t length;
+
+  bool operator<(const BytesView& other) const {
+    const int c = std::memcmp(ptr, other.ptr, std::min(length, other.length));
+    return c < 0 || (c == 0 && length < other.length);
+  }
+};
+
+template <typename ArrayType>
+inline auto get_value(const ArrayType& array, int64_t i) -> decltype(array.Value(i)) {
+  return array.Value(i);
+}
+
+inline BytesView get_value(const arrow::BinaryArray& array, int64_t i) {
+  BytesView view;
+  view.ptr = array.GetValue(i, &view.length);
+  return view;
+}
+
+inline arrow::Decimal128 get_value(const arrow::Decimal128Array& array, int64_t i) {
+  return arrow::Decimal128(array.GetValue(i));
+}
+
+/* The minimum or the maximum value.  The row of the value is found from
+ * the Arrow values, and only the value of the row is converted. */
+template <typename ArrayType, bool IsMax>
+class ExtremeAggregator : public Aggregator {
+ public:
+  ExtremeAggregator(const std::shared_ptr<arrow::Array>& array,
+                    std::unique_ptr<ColumnConverter> converter)
+      : array_(static_cast<const ArrayType&>(*array)),
+        converter_(std::move(converter)) {}
+
+  void Update(const int64_t* group_ids, int64_t num_groups) override {
+    rows_.assign(num_groups, -1);
+    int64_t* rows = rows_.data();
+    const ArrayType& array = array_;
+    for_each_valid(array_, group_ids, [rows, &array](int64_t g, int64_t i) {
+      const int64_t best = rows[g];
+      if (best < 0 ||
+          (IsMax ? get_value(array, best) < get_value(array, i)
+                 : get_value(array, i) < get_value(array, best))) {
+        rows[g] = i;
+      }
+    });
+  }
+
+  VALUE Finish(int64_t group) override {
+    const int64_t row = rows_[group];
+    if (row < 0) {
+      return Qnil;
+    }
+    VALUE val;
+    converter_->Convert(row, row + 1, &val, 1);
+    return val;
+  }
+
+ private:
+  const ArrayType& array_;
+  std::unique_ptr<ColumnConverter> converter_;
+  std::vector<int64_t> rows_;
+};
+
+/* The minimum or the maximum of a dictionary-encoded column of strings,
+ * which is compared by the values in the dictionary.  The dictionary is
+ * ranked once, so the rows are compared by the ranks of their indices. */
+template <typename IndexArrayType, bool IsMax>
+class DictionaryExtremeAggregator : public Aggregator {
+ public:
+  DictionaryExtremeAggregator(const std::shared_ptr<arrow::Array>& array,
+                              std::unique_ptr<ColumnConverter> converter)
+      : indices_(static_cast<const IndexArrayType&>(
+            *static_cast<const arrow::DictionaryArray&>(*array).indices())),
+        converter_(std::move(converter)) {
+    const auto& dictionary = static_cast<const arrow::BinaryArray&>(
+        *static_cast<const arrow::DictionaryArray&>(*array).dictionary());
+    std::vector<int64_t> order(dictionary.length());
+    for (int64_t k = 0; k < dictionary.length(); ++k) order[k] = k;
+    std::sort(order.begin(), order.end(), [&dictionary](int64_t a, int64_t b) {
+      return get_value(dictionary, a) < get_value(dictionary, b);
+    });
+    ranks_.resize(dictionary.length());
+    for (int64_t r = 0; r < dictionary.length(); ++r) ranks_[order[r]] = r;
+  }
+
+  void Update(const int64_t* group_ids, int64_t num_groups) override {
+    rows_.assign(num_groups, -1);
+    int64_t* rows = rows_.data();
+    const int64_t* ranks = ranks_.data();
+    const IndexArrayType& indices = indices_;
+    for_each_valid(indices_, group_ids, [rows, ranks, &indices](int64_t g, int64_t i) {
+      const int64_t best = rows[g];
+      if (best < 0 ||
+          (IsMax ? ranks[indices.Value(best)] < ranks[indices.Value(i)]
+                 : ranks[indices.Value(i)] < ranks[indices.Value(best)])) {
+        rows[g] = i;
+      }
+    });
+  }
+
+  VALUE Finish(int64_t group) override {
+    const int64_t row = rows_[group];
+    if (row < 0) {
+      return Qnil;
+    }
+    VALUE val;
+    converter_->Convert(row, row + 1, &val, 1);
+    return val;
+  }
+
+ private:
+  const IndexArrayType& indices_;
+  std::unique_ptr<ColumnConverter> converter_;
+  std::vector<int64_t> ranks_;
+  std::vector<int64_t> rows_;
+};
+
+int
+column_index(const arrow::RecordBatch& record_batch, VALUE column) {
+  int index;
+  if (RB_INTEGER_TYPE_P(column)) {
+    index = NUM2INT(column);
+    if (index < 0) {
+      index += record_batch.num_columns();
+    }
+    if (index < 0 || index >= record_batch.num_columns()) {
+      throw ruby::error(rb_eIndexError,
+                        std::string("Column index out of range: ") + std::to_string(index));
+    }
+    return index;
+  }
+
+  if (SYMBOL_P(column)) {
+    column = rb_sym2str(column);
+  }
+  const std::string name(StringValuePtr(column), RSTRING_LEN(column));
+  index = record_batch.schema()->GetFieldIndex(name);
+  if (index < 0) {
+    throw ruby::error(rb_eArgError, std::string("Unknown column: ") + name);
+  }
+  return index;
+}
+
+std::unique_ptr<Aggregator>
+make_sum_aggregator(const std::shared_ptr<arrow::Array>& array, bool mean) {
+  using Type = arrow::Type;
+  switch (array->type_id()) {
+#define CASE(type_id, TypeName, AccType) \
+    case type_id: \
+      return std::unique_ptr<Aggregator>( \
+          new SumAggregator<arrow :: TypeName ## Array, AccType>(array, mean));
+
+    CASE(Type::UINT8,   UInt8,  uint64_t);
+    CASE(Type::INT8,    Int8,   int64_t);
+    CASE(Type::UINT16,  UInt16, uint64_t);
+    CASE(Type::INT16,   Int16,  int64_t);
+    CASE(Type::UINT32,  UInt32, uint64_t);
+    CASE(Type::INT32,   Int32,  int64_t);
+    CASE(Type::UINT64,  UInt64, __int128);
+    CASE(Type::INT64,   Int64,  __int128);
+    CASE(Type::FLOAT,   Float,  double);
+    CASE(Type::DOUBLE,  Double, double);
+
+#undef CASE
+
+    case Type::DECIMAL:
+      return std::unique_ptr<Aggregator>(new DecimalSumAggregator(array, mean));
+
+    default:
+      throw ruby::error(rb_eTypeError,
+                        std::string("Unsupported data type to sum: ") + array->type()->ToString());
+  }
+}
+
+template <bool IsMax>
+std::unique_ptr<Aggregator>
+make_extreme_aggregator(const std::shared_ptr<arrow::Field>& field,
+                        const std::shared_ptr<arrow::Array>& array,
+                        VALUE keep_alive) {
+  using Type = arrow::Type;
+  /* only one value of each group is converted */
+  const ConvertOptions options = { false, 0 };
+  auto converter = make_column_converter(field, array, options, keep_alive);
+  switch (array->type_id()) {
+#define CASE(type_id, TypeName) \
+    case type_id: \
+      return std::unique_ptr<Aggregator>( \
+          new ExtremeAggregator<arrow :: TypeName ## Array, IsMax>(array, std::move(converter)));
+
+    CASE(Type::BOOL,      Boolean);
+    CASE(Type::UINT8,     UInt8);
+    CASE(Type::INT8,      Int8);
+    CASE(Type::UINT16,    UInt16);
+    CASE(Type::INT16,     Int16);
+    CASE(Type::UINT32,    UInt32);
+    CASE(Type::INT32,     Int32);
+    CASE(Type::UINT64,    UInt64);
+    CASE(Type::INT64,     Int64);
+    CASE(Type::FLOAT,     Float);
+    CASE(Type::DOUBLE,    Double);
+    CASE(Type::DECIMAL,   Decimal128);
+    CASE(Type::DATE32,    Date32);
+    CASE(Type::TIMESTAMP, Timestamp);
+    CASE(Type::TIME64,    Time64);
+    CASE(Type::STRING,    Binary);
+    CASE(Type::BINARY,    Binary);
+
+#undef CASE
+
+    case Type::NA:
+      return std::unique_ptr<Aggregator>(new NilAggregator());
+
+    case Type::DICTIONARY:
+      {
+        const auto& dict_array = static_cast<const arrow::DictionaryArray&>(*array);
+        const auto value_type = dict_array.dictionary()->type_id();
+        if (value_type != Type::STRING && value_type != Type::BINARY) break;
+        switch (dict_array.indices()->type_id()) {
+#define CASE(type_id, TypeName) \
+          case type_id: \
+            return std::unique_ptr<Aggregator>( \
+                new DictionaryExtremeAggregator<arrow :: TypeName ## Array, IsMax>( \
+                    array, std::move(converter)));
+
+          CASE(Type::INT8,  Int8);
+          CASE(Type::INT16, Int16);
+          CASE(Type::INT32, Int32);
+          CASE(Type::INT64, Int64);
+
+#undef CASE
+
+          default:
+            break;
+        }
+      }
+      break;
+
+    default:
+      break;
+  }
+  throw ruby::error(rb_eTypeError,
+                    std::string("Unsupported data type to compare: ") + array->type()->ToString());
+}
+
+/* Make the aggregator of an operation, which is a pair of the name of the
+ * aggregation and the column such as [:sum, :price] */
+std::unique_ptr<Aggregator>
+make_aggregator(const arrow::RecordBatch& record_batch, VALUE operation, VALUE keep_alive) {
+  operation = rb_check_array_type(operation);
+  if (NIL_P(operation) || RARRAY_LEN(operation) < 1 || RARRAY_LEN(operation) > 2) {
+    throw ruby::error(rb_eArgError, "Aggregation must be a pair of a name and a column");
+  }
+  const ID name = rb_to_id(RARRAY_AREF(operation, 0));
+  const VALUE column = RARRAY_LEN(operation) > 1 ? RARRAY_AREF(operation, 1) : Qnil;
+
+  if (name == intern_count && NIL_P(column)) {
+    return std::unique_ptr<Aggregator>(new CountAggregator(nullptr, record_batch.num_rows()));
+  }
+  if (NIL_P(column)) {
+    throw ruby::error(rb_eArgError,
+                      std::string("Column is required for ") + rb_id2name(name));
+  }
+
+  const int index = column_index(record_batch, column);
+  auto field = record_batch.schema()->field(index);
+  auto array = record_batch.column(index);
+  if (name == intern_count) {
+    return std::unique_ptr<Aggregator>(new CountAggregator(array, record_batch.num_rows()));
+  } else if (name == intern_sum) {
+    return make_sum_aggregator(array, false);
+  } else if (name == intern_mean) {
+    return make_sum_aggregator(array, true);
+  } else if (name == intern_min) {
+    return make_extreme_aggregator<false>(field, array, keep_alive);
+  } else if (name == intern_max) {
+    return make_extreme_aggregator<true>(field, array, keep_alive);
+  }
+  throw ruby::error(rb_eArgError, std::string("Unknown aggregation: ") + rb_id2name(name));
+}
+
+std::vector<std::unique_ptr<Aggregator>>
+make_aggregators(const arrow::RecordBatch& record_batch, VALUE operations, VALUE keep_alive) {
+  operations = rb_convert_type(operations, T_ARRAY, "Array", "to_ary");
+  std::vector<std::unique_ptr<Aggregator>> aggregators;
+  for (long k = 0; k < RARRAY_LEN(operations); ++k) {
+    aggregators.push_back(make_aggregator(record_batch, RARRAY_AREF(operations, k), keep_alive));
+  }
+  return aggregators;
+}
+
+/* Encoder of the values of a key column into the bytes of group keys.
+ * The keys of dictionary-encoded columns are their indices. */
+class KeyEncoder {
+ public:
+  explicit KeyEncoder(const std::shared_ptr<arrow::Array>& array)
+      : array_(array), values_(nullptr), byte_width_(0) {
+    if (array_->type_id() == arrow::Type::DICTIONARY) {
+      array_ = static_cast<const arrow::DictionaryArray&>(*array_).indices();
+    }
+    switch (array_->type_id()) {
+      case arrow::Type::NA:
+      case arrow::Type::BOOL:
+      case arrow::Type::STRING:
+      case arrow::Type::BINARY:
+        break;
+      default:
+        {
+          const auto* type = dynamic_cast<const arrow::FixedWidthType*>(array_->type().get());
+          if (type == nullptr || array_->data()->buffers.size() < 2) {
+            throw ruby::error(rb_eTypeError,
+                              std::string("Unsupported data type to group by: ") +
+                              array->type()->ToString());
+          }
+          byte_width_ = type->bit_width() / 8;
+          values_ = array_->data()->buffers[1]->data() + array_->offset() * byte_width_;
+        }
+        break;
+    }
+  }
+
+  void Append(int64_t i, std::string* key) const {
+    const arrow::Type::type type_id = array_->type_id();
+    if (type_id == arrow::Type::NA || array_->IsNull(i)) {
+      key->push_back('\0');
+      return;
+    }
+    key->push_back('\1');
+    if (type_id == arrow::Type::BOOL) {
+      key->push_back(static_cast<const arrow::BooleanArray&>(*array_).Value(i) ? '\1' : '\0');
+    } else if (type_id == arrow::Type::STRING || type_id == arrow::Type::BINARY) {
+      int32_t length;
+      const uint8_t* ptr = static_cast<const arrow::BinaryArray&>(*array_).GetValue(i, &length);
+      key->append(reinterpret_cast<const char*>(&length), sizeof(length));
+      key->append(reinterpret_cast<const char*>(ptr), length);
+    } else if (type_id == arrow::Type::FLOAT) {
+      AppendFloat<float>(i, key);
+    } else if (type_id == arrow::Type::DOUBLE) {
+      AppendFloat<double>(i, key);
+    } else {
+      key->append(reinterpret_cast<const char*>(values_ + i * byte_width_), byte_width_);
+    }
+  }
+
+ private:
+  /* -0.0 is the same key as 0.0, as in the hashes of Ruby */
+  template <typename T>
+  void AppendFloat(int64_t i, std::string* key) const {
+    T value;
+    std::memcpy(&value, values_ + i * sizeof(T), sizeof(T));
+    if (value == 0) value = 0;
+    key->append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  std::shared_ptr<arrow::Array> array_;
+  const uint8_t* values_;
+  int byte_width_;
+};
+
+void
+group_rows(const arrow::RecordBatch& record_batch, const std::vector<int>& key_indices,
+           std::vector<int64_t>* group_ids, std::vector<int64_t>* first_rows) {
+  std::vector<KeyEncoder> encoders;
+  for (int index : key_indices) {
+    encoders.emplace_back(record_batch.column(index));
+  }
+
+  const int64_t num_rows = record_batch.num_rows();
+  group_ids->resize(num_rows);
+  first_rows->clear();
+  std::unordered_map<std::string, int64_t> groups;
+  std::string key;
+  for (int64_t i = 0; i < num_rows; ++i) {
+    key.clear();
+    for (const auto& encoder : encoders) {
+      encoder.Append(i, &key);
+    }
+    auto inserted = groups.emplace(key, static_cast<int64_t>(first_rows->size()));
+    if (inserted.second) {
+      first_rows->push_back(i);
+    }
+    (*group_ids)[i] = inserted.first->second;
+  }
+}
+
+/* The results of the aggregations in an array */
+VALUE
+record_batch_aggregate(VALUE obj, VALUE operations) {
+  auto record_batch = get_record_batch(obj);
+  VALUE keep_alive = rb_ary_new();
+  auto aggregators = make_aggregators(*record_batch, operations, keep_alive);
+
+  VALUE results = rb_ary_new_capa(aggregators.size());
+  for (auto& aggregator : aggregators) {
+    aggregator->Update(nullptr, 1);
+    rb_ary_push(results, aggregator->Finish(0));
+  }
+
+  RB_GC_GUARD(keep_alive);
+  return results;
+}
+
+/* The results of the aggregations of each group in a hash.  The keys are
+ * the values of the key column, or the arrays of them for multiple key
+ * columns, in the order of their first rows. */
+VALUE
+record_batch_group_aggregate(VALUE obj, VALUE keys, VALUE operations) {
+  auto record_batch = get_record_batch(obj);
+  VALUE keep_alive = rb_ary_new();
+
+  keys = rb_convert_type(keys, T_ARRAY, "Array", "to_ary");
+  if (RARRAY_LEN(keys) == 0) {
+    throw ruby::error(rb_eArgError, "No column to group by");
+  }
+  std::vector<int> key_indices;
+  std::vector<std::unique_ptr<ColumnConverter>> key_converters;
+  /* only one value of each group is converted */
+  const ConvertOptions options = { false, 0 };
+  for (long k = 0; k < RARRAY_LEN(keys); ++k) {
+    const int index = column_index(*record_batch, RARRAY_AREF(keys, k));
+    key_indices.push_back(index);
+    key_converters.push_back(make_column_converter(
+        record_batch->schema()->field(index), record_batch->column(index), options, keep_alive));
+  }
+
+  auto aggregators = make_aggregators(*record_batch, operations, keep_alive);
+
+  std::vector<int64_t> group_ids;
+  std::vector<int64_t> first_rows;
+  group_rows(*record_batch, key_indices, &group_ids, &first_rows);
+
+  const int64_t num_groups = static_cast<int64_t>(first_rows.size());
+  for (auto& aggregator : aggregators) {
+    aggregator->Update(group_ids.data(), num_groups);
+  }
+
+  VALUE results = rb_hash_new();
+  for (int64_t g = 0; g < num_groups; ++g) {
+    VALUE key;
+    if (key_converters.size() == 1) {
+      key_converters[0]->Convert(first_rows[g], first_rows[g] + 1, &key, 1);
+    } else {
+      key = rb_ary_new_capa(key_converters.size());
+      for (auto& converter : key_converters) {
+        VALUE val;
+        converter->Convert(first_rows[g], first_rows[g] + 1, &val, 1);
+        rb_ary_push(key, val);
+      }
+    }
+
+    VALUE values = rb_ary_new_capa(aggregators.size());
+    for (auto& aggregator : aggregators) {
+      rb_ary_push(values, aggregator->Finish(g));
+    }
+    rb_hash_aset(results, key, values);
+  }
+
+  RB_GC_GUARD(keep_alive);
+  return results;
+}
+
+}  // namespace internal
+
+VALUE
+record_batch_aggregate(VALUE obj, VALUE operations)
+{
+  VALUE res = Qnil;
+
+  try {
+    res = internal::record_batch_aggregate(obj, operations);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  }
+
+  return res;
+}
+
+VALUE
+record_batch_group_aggregate(VALUE obj, VALUE keys, VALUE operations)
+{
+  VALUE res = Qnil;
+
+  try {
+    res = internal::record_batch_group_aggregate(obj, keys, operations);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  }
+
+  return res;
+}
+
+void
+Init_record_batch_aggregate(VALUE mRecordBatchExt)
+{
+  intern_BigDecimal = rb_intern("BigDecimal");
+  intern_sum   = rb_intern("sum");
+  intern_mean  = rb_intern("mean");
+  intern_min   = rb_intern("min");
+  intern_max   = rb_intern("max");
+  intern_count = rb_intern("count");
+  intern_div   = rb_intern("/");
+
+  rb_define_method(mRecordBatchExt, "aggregate",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_aggregate), 1);
+  rb_define_method(mRecordBatchExt, "group_aggregate",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_group_aggregate), 2);
+}
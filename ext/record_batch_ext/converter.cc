@@ -0,0 +1,605 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Converters of the values of Arrow arrays into Ruby objects.
+ *
+ * This file depends only on Ruby and Arrow, not on the GObject bindings,
+ * so the converters can be driven by the decoder benchmark as well.
+ */
+
+#include "record_batch_ext.h"
+
+#include <ruby/encoding.h>
+
+#include <arrow/util/checked_cast.h>
+#include <arrow/util/key_value_metadata.h>
+
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static VALUE cDate;
+static ID intern_BigDecimal, intern_new, intern_local, intern_utc, intern_to_i, intern_uminus;
+
+namespace internal {
+
+inline VALUE to_ruby(bool val) { return val ? Qtrue : Qfalse; }
+inline VALUE to_ruby(int8_t val) { return INT2FIX(val); }
+inline VALUE to_ruby(int16_t val) { return INT2FIX(val); }
+inline VALUE to_ruby(int32_t val) { return INT2NUM(val); }
+inline VALUE to_ruby(int64_t val) { return LL2NUM(val); }
+inline VALUE to_ruby(uint8_t val) { return INT2FIX(val); }
+inline VALUE to_ruby(uint16_t val) { return INT2FIX(val); }
+inline VALUE to_ruby(uint32_t val) { return UINT2NUM(val); }
+inline VALUE to_ruby(uint64_t val) { return ULL2NUM(val); }
+inline VALUE to_ruby(float val) { return DBL2NUM(val); }
+inline VALUE to_ruby(double val) { return DBL2NUM(val); }
+
+template <typename ArrayType>
+class PrimitiveColumnConverter : public ColumnConverter {
+ public:
+  explicit PrimitiveColumnConverter(const std::shared_ptr<arrow::Array>& array)
+      : array_(static_cast<const ArrayType&>(*array)) {}
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    if (array_.null_count() == 0) {
+      for (int64_t i = begin; i < end; ++i, out += stride) {
+        *out = to_ruby(array_.Value(i));
+      }
+    } else {
+      for (int64_t i = begin; i < end; ++i, out += stride) {
+        *out = array_.IsNull(i) ? Qnil : to_ruby(array_.Value(i));
+      }
+    }
+  }
+
+ private:
+  const ArrayType& array_;
+};
+
+class StringColumnConverter : public ColumnConverter {
+ public:
+  /* Strings are utf8, and binary values are strings in the encoding in the
+   * field metadata if any.  They are exported to Encoding.default_internal
+   * like mysql2 does. */
+  StringColumnConverter(const std::shared_ptr<arrow::Field>& field,
+                        const std::shared_ptr<arrow::Array>& array)
+      : array_(static_cast<const arrow::BinaryArray&>(*array)),
+        encoding_(rb_ascii8bit_encoding()),
+        export_encoding_(nullptr),
+        dedup_(false),
+        dedup_limit_(0),
+        dedup_strings_(Qnil) {
+    if (field->type()->id() == arrow::Type::STRING) {
+      encoding_ = rb_utf8_encoding();
+    } else if (field->metadata() != nullptr) {
+      const int key_index = field->metadata()->FindKey("encoding");
+      if (key_index >= 0) {
+        const int enc_index = rb_enc_find_index(field->metadata()->value(key_index).c_str());
+        if (enc_index >= 0) {
+          encoding_ = rb_enc_from_index(enc_index);
+        }
+      }
+    }
+
+    rb_encoding* default_internal = rb_default_internal_encoding();
+    if (default_internal != nullptr && encoding_ != rb_ascii8bit_encoding() &&
+        default_internal != encoding_) {
+      export_encoding_ = default_internal;
+    }
+  }
+
+  /* Share interned frozen strings among the rows with the same value.
+   * The values are hashed by their bytes, and the deduplication stops when
+   * the column turns out to have more than limit distinct values. */
+  void EnableDedup(int64_t limit, VALUE keep_alive) {
+    dedup_ = true;
+    dedup_limit_ = limit;
+    dedup_strings_ = rb_ary_new();
+    rb_ary_push(keep_alive, dedup_strings_);
+  }
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      if (array_.IsNull(i)) {
+        *out = Qnil;
+        continue;
+      }
+      int32_t length;
+      const char* ptr = reinterpret_cast<const char*>(array_.GetValue(i, &length));
+      *out = dedup_ ? DedupString(ptr, length) : MakeString(ptr, length);
+    }
+  }
+
+ private:
+  VALUE MakeString(const char* ptr, int32_t length) const {
+    VALUE val = rb_enc_str_new(ptr, length, encoding_);
+    if (export_encoding_ != nullptr) {
+      val = rb_str_export_to_enc(val, export_encoding_);
+    }
+    return val;
+  }
+
+  VALUE DedupString(const char* ptr, int32_t length) {
+    key_.assign(ptr, length);
+    auto it = dedup_table_.find(key_);
+    if (it != dedup_table_.end()) {
+      return it->second;
+    }
+
+    if (static_cast<int64_t>(dedup_table_.size()) >= dedup_limit_) {
+      /* too many distinct values to be worth hashing */
+      dedup_ = false;
+      dedup_table_.clear();
+      rb_ary_clear(dedup_strings_);
+      return MakeString(ptr, length);
+    }
+
+    VALUE val = rb_funcall(MakeString(ptr, length), intern_uminus, 0);
+    dedup_table_.emplace(key_, val);
+    rb_ary_push(dedup_strings_, val);
+    return val;
+  }
+
+  const arrow::BinaryArray& array_;
+  rb_encoding* encoding_;
+  rb_encoding* export_encoding_;
+
+  bool dedup_;
+  int64_t dedup_limit_;
+  std::unordered_map<std::string, VALUE> dedup_table_;
+  /* the strings in dedup_table_, which is kept alive by keep_alive */
+  VALUE dedup_strings_;
+  /* reused for lookups not to allocate a string for each value */
+  std::string key_;
+};
+
+/* An Integer for the scale of zero, like mysql2 does */
+VALUE
+decimal_to_ruby(const arrow::Decimal128& value, int32_t scale) {
+  /* The unscaled integer and the exponent, such as "12345e-3" */
+  std::string str = value.ToIntegerString();
+  if (scale == 0) {
+    return rb_cstr2inum(str.c_str(), 10);
+  }
+  str += "e";
+  str += std::to_string(-scale);
+  return rb_funcall(rb_mKernel, intern_BigDecimal, 1,
+                    rb_usascii_str_new(str.data(), str.size()));
+}
+
+class DecimalColumnConverter : public ColumnConverter {
+ public:
+  explicit DecimalColumnConverter(const std::shared_ptr<arrow::Array>& array)
+      : array_(static_cast<const arrow::Decimal128Array&>(*array)),
+        scale_(static_cast<const arrow::Decimal128Type&>(*array->type()).scale()) {}
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      *out = array_.IsNull(i)
+        ? Qnil : decimal_to_ruby(arrow::Decimal128(array_.GetValue(i)), scale_);
+    }
+  }
+
+ private:
+  const arrow::Decimal128Array& array_;
+  const int32_t scale_;
+};
+
+/* The inverse of days_from_civil in ext/mysql2_arrow/temporal.h */
+inline void civil_from_days(int64_t days, int* year, unsigned* month, unsigned* day) {
+  days += 719468;
+  const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  const unsigned doe = static_cast<unsigned>(days - era * 146097);
+  const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  *day = doy - (153 * mp + 2) / 5 + 1;
+  *month = mp < 10 ? mp + 3 : mp - 9;
+  *year = static_cast<int>(yoe + era * 400 + (*month <= 2));
+}
+
+/* date32 values are Date objects made by Date.new like mysql2 does.
+ * The same object is reused for the runs of the same date. */
+class Date32ColumnConverter : public ColumnConverter {
+ public:
+  Date32ColumnConverter(const std::shared_ptr<arrow::Array>& array, VALUE keep_alive)
+      : array_(static_cast<const arrow::Date32Array&>(*array)),
+        keep_alive_(keep_alive),
+        keep_alive_index_(RARRAY_LEN(keep_alive)),
+        last_days_(0),
+        last_date_(Qnil) {
+    rb_ary_push(keep_alive_, Qnil);
+  }
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      if (array_.IsNull(i)) {
+        *out = Qnil;
+        continue;
+      }
+      const int32_t days = array_.Value(i);
+      if (NIL_P(last_date_) || days != last_days_) {
+        int year;
+        unsigned month, day;
+        civil_from_days(days, &year, &month, &day);
+        last_date_ = rb_funcall(cDate, intern_new, 3,
+                                INT2NUM(year), UINT2NUM(month), UINT2NUM(day));
+        last_days_ = days;
+        /* the date is referred only from this converter */
+        rb_ary_store(keep_alive_, keep_alive_index_, last_date_);
+      }
+      *out = last_date_;
+    }
+  }
+
+ private:
+  const arrow::Date32Array& array_;
+  VALUE keep_alive_;
+  const long keep_alive_index_;
+  int32_t last_days_;
+  VALUE last_date_;
+};
+
+inline int64_t floor_div(int64_t a, int64_t b) {
+  return a / b - (a % b < 0 ? 1 : 0);
+}
+
+/* The number of the units in a second */
+inline int64_t units_per_second(arrow::TimeUnit::type unit) {
+  switch (unit) {
+    case arrow::TimeUnit::SECOND: return 1;
+    case arrow::TimeUnit::MILLI:  return 1000;
+    case arrow::TimeUnit::MICRO:  return 1000000;
+    case arrow::TimeUnit::NANO:   return 1000000000;
+  }
+  return 1;
+}
+
+/* Make a Time object from the seconds and the subsecond units.
+ * utc_offset is the one of rb_time_timespec_new. */
+inline VALUE make_time(int64_t value, int64_t per_second, int utc_offset) {
+  struct timespec ts;
+  const int64_t seconds = floor_div(value, per_second);
+  ts.tv_sec = static_cast<time_t>(seconds);
+  ts.tv_nsec = static_cast<long>((value - seconds * per_second) * (1000000000 / per_second));
+  return rb_time_timespec_new(&ts, utc_offset);
+}
+
+/* timestamp values are Time objects in UTC if the timezone is "UTC",
+ * and the ones in the local time otherwise */
+class TimestampColumnConverter : public ColumnConverter {
+ public:
+  explicit TimestampColumnConverter(const std::shared_ptr<arrow::Array>& array)
+      : array_(static_cast<const arrow::TimestampArray&>(*array)) {
+    const auto& type = static_cast<const arrow::TimestampType&>(*array->type());
+    per_second_ = units_per_second(type.unit());
+    /* INT_MAX - 1 means UTC, and INT_MAX means the local time */
+    utc_offset_ = type.timezone() == "UTC" ? INT_MAX - 1 : INT_MAX;
+  }
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      *out = array_.IsNull(i) ? Qnil : make_time(array_.Value(i), per_second_, utc_offset_);
+    }
+  }
+
+ private:
+  const arrow::TimestampArray& array_;
+  int64_t per_second_;
+  int utc_offset_;
+};
+
+/* time64 values are Time objects on 2000-01-01 like mysql2 does for TIME
+ * values.  They are in the local time unless the metadata of the field
+ * says "database_timezone" is "UTC", and they are shown in UTC if its
+ * "timezone" is "UTC" as timestamp values. */
+class Time64ColumnConverter : public ColumnConverter {
+ public:
+  Time64ColumnConverter(const std::shared_ptr<arrow::Field>& field,
+                        const std::shared_ptr<arrow::Array>& array)
+      : array_(static_cast<const arrow::Time64Array&>(*array)),
+        per_second_(units_per_second(
+            static_cast<const arrow::Time64Type&>(*array->type()).unit())),
+        utc_offset_(INT_MAX) {
+    ID base_timezone = intern_local;
+    const auto& metadata = field->metadata();
+    if (metadata != nullptr) {
+      int key_index = metadata->FindKey("database_timezone");
+      if (key_index >= 0 && metadata->value(key_index) == "UTC") {
+        base_timezone = intern_utc;
+      }
+      key_index = metadata->FindKey("timezone");
+      if (key_index >= 0 && metadata->value(key_index) == "UTC") {
+        utc_offset_ = INT_MAX - 1;
+      }
+    }
+    VALUE base = rb_funcall(rb_cTime, base_timezone, 3, INT2FIX(2000), INT2FIX(1), INT2FIX(1));
+    base_ = NUM2LL(rb_funcall(base, intern_to_i, 0)) * per_second_;
+  }
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      *out = array_.IsNull(i) ? Qnil : make_time(base_ + array_.Value(i), per_second_, utc_offset_);
+    }
+  }
+
+ private:
+  const arrow::Time64Array& array_;
+  const int64_t per_second_;
+  int64_t base_;
+  int utc_offset_;
+};
+
+class NullColumnConverter : public ColumnConverter {
+ public:
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      *out = Qnil;
+    }
+  }
+};
+
+/* The values in the dictionary are converted only once,
+ * and the rows share the frozen objects. */
+template <typename IndexArrayType>
+class DictionaryColumnConverter : public ColumnConverter {
+ public:
+  DictionaryColumnConverter(const std::shared_ptr<arrow::Array>& indices, VALUE values)
+      : indices_(static_cast<const IndexArrayType&>(*indices)),
+        values_(values) {}
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      *out = indices_.IsNull(i) ? Qnil : RARRAY_AREF(values_, indices_.Value(i));
+    }
+  }
+
+ private:
+  const IndexArrayType& indices_;
+  /* this is kept alive by the caller of make_column_converter */
+  VALUE values_;
+};
+
+/* list values are arrays of the converted values */
+class ListColumnConverter : public ColumnConverter {
+ public:
+  ListColumnConverter(const std::shared_ptr<arrow::Array>& array,
+                      std::unique_ptr<ColumnConverter> value_converter)
+      : array_(static_cast<const arrow::ListArray&>(*array)),
+        value_converter_(std::move(value_converter)) {}
+
+  void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) override {
+    for (int64_t i = begin; i < end; ++i, out += stride) {
+      if (array_.IsNull(i)) {
+        *out = Qnil;
+        continue;
+      }
+      const int64_t offset = array_.value_offset(i);
+      const int64_t length = array_.value_length(i);
+      VALUE values = rb_ary_new_capa(length);
+      for (int64_t k = offset; k < offset + length; ++k) {
+        VALUE val;
+        value_converter_->Convert(k, k + 1, &val, 1);
+        rb_ary_push(values, val);
+      }
+      *out = values;
+    }
+  }
+
+ private:
+  const arrow::ListArray& array_;
+  std::unique_ptr<ColumnConverter> value_converter_;
+};
+
+/* Convert all the values in a dictionary into a frozen array */
+VALUE
+dictionary_values(const std::shared_ptr<arrow::Field>& field,
+                  const std::shared_ptr<arrow::Array>& dictionary,
+                  VALUE keep_alive) {
+  /* the encoding of binary values is in the metadata of the field */
+  auto value_field = std::make_shared<arrow::Field>(
+      field->name(), dictionary->type(), true, field->metadata());
+  /* the values in a dictionary are distinct */
+  ConvertOptions options = { false, 0 };
+  auto converter = make_column_converter(value_field, dictionary, options, keep_alive);
+
+  VALUE values = rb_ary_new_capa(dictionary->length());
+  for (int64_t i = 0; i < dictionary->length(); ++i) {
+    VALUE val;
+    converter->Convert(i, i + 1, &val, 1);
+    rb_ary_push(values, rb_obj_freeze(val));
+  }
+  return values;
+}
+
+std::unique_ptr<ColumnConverter>
+make_column_converter(const std::shared_ptr<arrow::Field>& field,
+                      const std::shared_ptr<arrow::Array>& array,
+                      const ConvertOptions& options,
+                      VALUE keep_alive) {
+  using Type = arrow::Type;
+  switch (array->type_id()) {
+#define CASE(type_id, TypeName) \
+    case type_id: \
+      return std::unique_ptr<ColumnConverter>( \
+          new PrimitiveColumnConverter<arrow :: TypeName ## Array>(array));
+
+    CASE(Type::BOOL,    Boolean);
+    CASE(Type::UINT8,   UInt8);
+    CASE(Type::INT8,    Int8);
+    CASE(Type::UINT16,  UInt16);
+    CASE(Type::INT16,   Int16);
+    CASE(Type::UINT32,  UInt32);
+    CASE(Type::INT32,   Int32);
+    CASE(Type::UINT64,  UInt64);
+    CASE(Type::INT64,   Int64);
+    CASE(Type::FLOAT,   Float);
+    CASE(Type::DOUBLE,  Double);
+
+#undef CASE
+
+    case Type::NA:
+      return std::unique_ptr<ColumnConverter>(new NullColumnConverter());
+
+    case Type::DECIMAL:
+      return std::unique_ptr<ColumnConverter>(new DecimalColumnConverter(array));
+
+    case Type::DATE32:
+      return std::unique_ptr<ColumnConverter>(new Date32ColumnConverter(array, keep_alive));
+
+    case Type::TIMESTAMP:
+      return std::unique_ptr<ColumnConverter>(new TimestampColumnConverter(array));
+
+    case Type::TIME64:
+      return std::unique_ptr<ColumnConverter>(new Time64ColumnConverter(field, array));
+
+    case Type::LIST:
+      {
+        const auto& list_array = static_cast<const arrow::ListArray&>(*array);
+        auto value_field = std::make_shared<arrow::Field>(
+            field->name(), list_array.value_type(), true, field->metadata());
+        return std::unique_ptr<ColumnConverter>(new ListColumnConverter(
+            array, make_column_converter(value_field, list_array.values(), options, keep_alive)));
+      }
+
+    case Type::STRING:
+    case Type::BINARY:
+      {
+        std::unique_ptr<StringColumnConverter> converter(new StringColumnConverter(field, array));
+        if (options.dedup_strings) {
+          converter->EnableDedup(options.dedup_limit, keep_alive);
+        }
+        return std::move(converter);
+      }
+
+    case Type::DICTIONARY:
+      {
+        const auto& dict_array = static_cast<const arrow::DictionaryArray&>(*array);
+        VALUE values = dictionary_values(field, dict_array.dictionary(), keep_alive);
+        rb_ary_push(keep_alive, values);
+        const auto& indices = dict_array.indices();
+        switch (indices->type_id()) {
+          case Type::INT8:
+            return std::unique_ptr<ColumnConverter>(
+                new DictionaryColumnConverter<arrow::Int8Array>(indices, values));
+          case Type::INT16:
+            return std::unique_ptr<ColumnConverter>(
+                new DictionaryColumnConverter<arrow::Int16Array>(indices, values));
+          case Type::INT32:
+            return std::unique_ptr<ColumnConverter>(
+                new DictionaryColumnConverter<arrow::Int32Array>(indices, values));
+          case Type::INT64:
+            return std::unique_ptr<ColumnConverter>(
+                new DictionaryColumnConverter<arrow::Int64Array>(indices, values));
+          default:
+            throw ruby::error(rb_eRuntimeError,
+                              std::string("Unsupported index type: ") + indices->type()->ToString());
+        }
+      }
+
+    default:
+      throw ruby::error(rb_eRuntimeError,
+                        std::string("Unsupported data type: ") + array->type()->ToString());
+  }
+}
+
+VALUE
+record_batch_rows_to_a(const std::shared_ptr<arrow::RecordBatch>& record_batch,
+                       int64_t begin, int64_t end, const ConvertOptions& options,
+                       ConvertStats* stats) {
+  const int num_columns = record_batch->num_columns();
+  auto schema = record_batch->schema();
+
+  VALUE keep_alive = rb_ary_new();
+  std::vector<std::unique_ptr<ColumnConverter>> converters;
+  converters.reserve(num_columns);
+  for (int j = 0; j < num_columns; ++j) {
+    converters.push_back(
+        make_column_converter(schema->field(j), record_batch->column(j), options, keep_alive));
+  }
+
+  VALUE rows = rb_ary_new_capa(end - begin);
+
+  if (num_columns == 0) {
+    for (int64_t i = begin; i < end; ++i) {
+      rb_ary_push(rows, rb_ary_new());
+    }
+  } else if (num_columns <= kTileCells) {
+    /* The values on the stack are marked by the conservative GC */
+    VALUE tile[kTileCells];
+    const int64_t tile_rows = kTileCells / num_columns;
+    for (int64_t tile_begin = begin; tile_begin < end; tile_begin += tile_rows) {
+      const int64_t tile_end = std::min(tile_begin + tile_rows, end);
+      if (stats) {
+        int64_t last = monotonic_ns();
+        for (int j = 0; j < num_columns; ++j) {
+          converters[j]->Convert(tile_begin, tile_end, tile + j, num_columns);
+          const int64_t now = monotonic_ns();
+          stats->column_ns[j] += now - last;
+          last = now;
+        }
+        for (int64_t i = 0; i < tile_end - tile_begin; ++i) {
+          rb_ary_push(rows, rb_ary_new_from_values(num_columns, tile + i * num_columns));
+        }
+        stats->rows_ns += monotonic_ns() - last;
+        continue;
+      }
+      for (int j = 0; j < num_columns; ++j) {
+        converters[j]->Convert(tile_begin, tile_end, tile + j, num_columns);
+      }
+      for (int64_t i = 0; i < tile_end - tile_begin; ++i) {
+        rb_ary_push(rows, rb_ary_new_from_values(num_columns, tile + i * num_columns));
+      }
+    }
+  } else {
+    for (int64_t i = begin; i < end; ++i) {
+      VALUE row = rb_ary_new_capa(num_columns);
+      for (int j = 0; j < num_columns; ++j) {
+        VALUE val;
+        converters[j]->Convert(i, i + 1, &val, 1);
+        rb_ary_push(row, val);
+      }
+      rb_ary_push(rows, row);
+    }
+  }
+
+  RB_GC_GUARD(keep_alive);
+  return rows;
+}
+
+}  // namespace internal
+
+void
+Init_record_batch_converter()
+{
+  rb_require("bigdecimal");
+  rb_require("date");
+  cDate = rb_const_get(rb_cObject, rb_intern("Date"));
+  rb_global_variable(&cDate);
+
+  intern_BigDecimal = rb_intern("BigDecimal");
+  intern_new        = rb_intern("new");
+  intern_local      = rb_intern("local");
+  intern_utc        = rb_intern("utc");
+  intern_to_i       = rb_intern("to_i");
+  intern_uminus     = rb_intern("-@");
+}
@@ -17,6 +17,9 @@ end
   add_depend_package_path(name, source_dir, build_dir)
 end
 
+have_func("rb_hash_new_capa", "ruby.h")
+have_func("rb_hash_bulk_insert", "ruby.h")
+
 $CXXFLAGS += ' -std=c++11 -Wno-deprecated-register'
 
 create_makefile('record_batch_ext')
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hashes keyed by a column of a record batch.
+ *
+ * The keys and the values are converted from the Arrow arrays directly into
+ * buffers on the stack, so no row array is made unless the values are rows.
+ */
+
+#include "record_batch_ext.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace internal {
+
+/* The number of rows whose keys and values are on the stack at once */
+static const int64_t kChunkRows = 256;
+
+inline VALUE
+hash_new_capa(int64_t capa) {
+#ifdef HAVE_RB_HASH_NEW_CAPA
+  return rb_hash_new_capa(capa);
+#else
+  (void)capa;
+  return rb_hash_new();
+#endif
+}
+
+/* Builder of the values of the rows, which are the values of a column, or
+ * the arrays of the values of columns */
+class ValueBuilder {
+ public:
+  ValueBuilder(const arrow::RecordBatch& record_batch, VALUE columns,
+               const ConvertOptions& options, VALUE keep_alive)
+      : scalar_(false) {
+    std::vector<int> indices;
+    if (NIL_P(columns)) {
+      for (int j = 0; j < record_batch.num_columns(); ++j) {
+        indices.push_back(j);
+      }
+    } else if (RB_TYPE_P(columns, T_ARRAY)) {
+      for (long k = 0; k < RARRAY_LEN(columns); ++k) {
+        indices.push_back(column_index(record_batch, RARRAY_AREF(columns, k)));
+      }
+    } else {
+      indices.push_back(column_index(record_batch, columns));
+      scalar_ = true;
+    }
+
+    for (int index : indices) {
+      converters_.push_back(make_column_converter(
+          record_batch.schema()->field(index), record_batch.column(index), options, keep_alive));
+    }
+  }
+
+  /* Store the values of the rows in [begin, end) into out[0], out[1], ...
+   * The values of the rows must be kept alive by the caller. */
+  void Build(int64_t begin, int64_t end, VALUE* out) {
+    if (scalar_) {
+      converters_[0]->Convert(begin, end, out, 1);
+      return;
+    }
+
+    const int64_t num_columns = static_cast<int64_t>(converters_.size());
+    if (num_columns == 0) {
+      for (int64_t i = begin; i < end; ++i) {
+        *out++ = rb_ary_new();
+      }
+    } else if (num_columns <= kTileCells) {
+      /* The values on the stack are marked by the conservative GC */
+      VALUE tile[kTileCells];
+      const int64_t tile_rows = kTileCells / num_columns;
+      for (int64_t tile_begin = begin; tile_begin < end; tile_begin += tile_rows) {
+        const int64_t tile_end = std::min(tile_begin + tile_rows, end);
+        for (int64_t j = 0; j < num_columns; ++j) {
+          converters_[j]->Convert(tile_begin, tile_end, tile + j, num_columns);
+        }
+        for (int64_t i = 0; i < tile_end - tile_begin; ++i) {
+          *out++ = rb_ary_new_from_values(num_columns, tile + i * num_columns);
+        }
+      }
+    } else {
+      for (int64_t i = begin; i < end; ++i) {
+        VALUE row = rb_ary_new_capa(num_columns);
+        *out++ = row;
+        for (auto& converter : converters_) {
+          VALUE val;
+          converter->Convert(i, i + 1, &val, 1);
+          rb_ary_push(row, val);
+        }
+      }
+    }
+  }
+
+ private:
+  bool scalar_;
+  std::vector<std::unique_ptr<ColumnConverter>> converters_;
+};
+
+/* A hash from the values of the key column to the values of the rows.
+ * The value of the last row wins for the same keys, like Array#to_h. */
+VALUE
+record_batch_index_by(VALUE obj, VALUE key_column, VALUE value_columns,
+                      const ConvertOptions& options) {
+  auto record_batch = get_record_batch(obj);
+  const int64_t num_rows = record_batch->num_rows();
+  VALUE keep_alive = rb_ary_new();
+
+  const int key_index = column_index(*record_batch, key_column);
+  auto key_converter = make_column_converter(
+      record_batch->schema()->field(key_index), record_batch->column(key_index),
+      options, keep_alive);
+  ValueBuilder value_builder(*record_batch, value_columns, options, keep_alive);
+
+  VALUE hash = hash_new_capa(num_rows);
+  /* The values on the stack are marked by the conservative GC */
+  VALUE keys[kChunkRows];
+  VALUE values[kChunkRows];
+  for (int64_t begin = 0; begin < num_rows; begin += kChunkRows) {
+    const int64_t end = std::min(begin + kChunkRows, num_rows);
+    const int64_t n = end - begin;
+    key_converter->Convert(begin, end, keys, 1);
+    value_builder.Build(begin, end, values);
+#ifdef HAVE_RB_HASH_BULK_INSERT
+    VALUE pairs[2 * kChunkRows];
+    for (int64_t i = 0; i < n; ++i) {
+      /* rb_hash_bulk_insert does not copy string keys as Hash#[]= does */
+      if (RB_TYPE_P(keys[i], T_STRING)) {
+        rb_obj_freeze(keys[i]);
+      }
+      pairs[2 * i] = keys[i];
+      pairs[2 * i + 1] = values[i];
+    }
+    rb_hash_bulk_insert(2 * n, pairs, hash);
+#else
+    for (int64_t i = 0; i < n; ++i) {
+      rb_hash_aset(hash, keys[i], values[i]);
+    }
+#endif
+  }
+
+  RB_GC_GUARD(keep_alive);
+  return hash;
+}
+
+/* A hash from the values of the key column to the arrays of the values of
+ * the rows.  The rows are grouped on the Arrow values, and each key is
+ * converted only once. */
+VALUE
+record_batch_group_by(VALUE obj, VALUE key_column, VALUE value_columns,
+                      const ConvertOptions& options) {
+  auto record_batch = get_record_batch(obj);
+  const int64_t num_rows = record_batch->num_rows();
+  VALUE keep_alive = rb_ary_new();
+
+  const int key_index = column_index(*record_batch, key_column);
+  std::vector<int64_t> group_ids;
+  std::vector<int64_t> first_rows;
+  group_rows(*record_batch, std::vector<int>(1, key_index), &group_ids, &first_rows);
+  const int64_t num_groups = static_cast<int64_t>(first_rows.size());
+
+  std::vector<int64_t> group_sizes(num_groups, 0);
+  for (int64_t g : group_ids) {
+    ++group_sizes[g];
+  }
+  VALUE groups = rb_ary_new_capa(num_groups);
+  for (int64_t g = 0; g < num_groups; ++g) {
+    rb_ary_push(groups, rb_ary_new_capa(group_sizes[g]));
+  }
+
+  ValueBuilder value_builder(*record_batch, value_columns, options, keep_alive);
+  VALUE values[kChunkRows];
+  for (int64_t begin = 0; begin < num_rows; begin += kChunkRows) {
+    const int64_t end = std::min(begin + kChunkRows, num_rows);
+    value_builder.Build(begin, end, values);
+    for (int64_t i = begin; i < end; ++i) {
+      rb_ary_push(RARRAY_AREF(groups, group_ids[i]), values[i - begin]);
+    }
+  }
+
+  /* only one key of each group is converted */
+  const ConvertOptions key_options = { false, 0 };
+  auto key_converter = make_column_converter(
+      record_batch->schema()->field(key_index), record_batch->column(key_index),
+      key_options, keep_alive);
+  VALUE hash = hash_new_capa(num_groups);
+  for (int64_t g = 0; g < num_groups; ++g) {
+    VALUE key;
+    key_converter->Convert(first_rows[g], first_rows[g] + 1, &key, 1);
+    /* Ruby may regard different Arrow values as the same key, such as
+     * 0.0 and -0.0, and then the groups are merged. */
+    VALUE group = rb_hash_lookup2(hash, key, Qundef);
+    if (group == Qundef) {
+      rb_hash_aset(hash, key, RARRAY_AREF(groups, g));
+    } else {
+      rb_ary_concat(group, RARRAY_AREF(groups, g));
+    }
+  }
+
+  RB_GC_GUARD(groups);
+  RB_GC_GUARD(keep_alive);
+  return hash;
+}
+
+}  // namespace internal
+
+VALUE
+record_batch_index_by_column(int argc, VALUE* argv, VALUE obj)
+{
+  VALUE key, values = Qnil, opts = Qnil;
+  rb_scan_args(argc, argv, "12", &key, &values, &opts);
+  const internal::ConvertOptions options = convert_options(opts);
+
+  VALUE res = Qnil;
+
+  try {
+    res = internal::record_batch_index_by(obj, key, values, options);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  }
+
+  return res;
+}
+
+VALUE
+record_batch_group_by_column(int argc, VALUE* argv, VALUE obj)
+{
+  VALUE key, values = Qnil, opts = Qnil;
+  rb_scan_args(argc, argv, "12", &key, &values, &opts);
+  const internal::ConvertOptions options = convert_options(opts);
+
+  VALUE res = Qnil;
+
+  try {
+    res = internal::record_batch_group_by(obj, key, values, options);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
+  }
+
+  return res;
+}
+
+void
+Init_record_batch_hash_builder(VALUE mRecordBatchExt)
+{
+  rb_define_method(mRecordBatchExt, "index_by_column",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_index_by_column), -1);
+  rb_define_method(mRecordBatchExt, "group_by_column",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_group_by_column), -1);
+}
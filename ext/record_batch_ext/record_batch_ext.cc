@@ -14,265 +14,259 @@
  * limitations under the License.
  */
 
-#include <ruby.h>
-
-#include <arrow/api.h>
-#include <arrow/util/decimal.h>
-#include <arrow/util/checked_cast.h>
+#include "record_batch_ext.h"
 
 #include <arrow-glib/arrow-glib.hpp>
 #include <rbgobject.h>
 
-#include <iostream>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
-namespace ruby {
+static VALUE sym_dedup_strings, sym_dedup_limit, sym_stats;
 
-class error {
- public:
-  error(VALUE exc_klass, const char* message) {
-    exc_ = rb_exc_new_cstr(exc_klass, message);
-  }
+namespace internal {
 
-  error(VALUE exc_klass, const std::string& message)
-      : error(exc_klass, message.c_str()) {}
+/* The default number of distinct values deduplicated in a string column */
+static const int64_t kDefaultDedupLimit = 1024;
 
-  VALUE exception_object() const { return exc_; }
+std::shared_ptr<arrow::RecordBatch>
+get_record_batch(VALUE obj) {
+  auto gobj_record_batch = GARROW_RECORD_BATCH(RVAL2GOBJ(obj));
+  return garrow_record_batch_get_raw(gobj_record_batch);
+}
 
- private:
-  VALUE exc_;
-};
+/* Store the stats of a conversion of num_rows rows of the columns in
+ * [begin_column, end_column) into the hash of the stats option, with the
+ * time converting the columns summed by their types, such as
+ * { "int32" => ..., "utf8" => ... } */
+void
+write_convert_stats(const arrow::RecordBatch& record_batch, int64_t num_rows,
+                    int begin_column, int end_column,
+                    const ConvertStats& stats, VALUE stats_hash) {
+  const int64_t total_ns = monotonic_ns() - stats.start_ns;
+  VALUE sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+  std::map<std::string, int64_t> convert_ns_by_type;
+  int64_t convert_ns = 0;
+  for (int j = begin_column; j < end_column; ++j) {
+    convert_ns += stats.column_ns[j];
+    convert_ns_by_type[record_batch.column(j)->type()->name()] += stats.column_ns[j];
+  }
+  VALUE by_type = rb_hash_new();
+  for (const auto& entry : convert_ns_by_type) {
+    rb_hash_aset(by_type, rb_str_new_cstr(entry.first.c_str()), LL2NUM(entry.second));
+  }
 
-}  // namespace ruby
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("rows")), LL2NUM(num_rows));
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("columns")), INT2NUM(end_column - begin_column));
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("total_ns")), LL2NUM(total_ns));
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("convert_ns")), LL2NUM(convert_ns));
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("convert_ns_by_type")), by_type);
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("row_arrays_ns")), LL2NUM(stats.rows_ns));
+  rb_hash_aset(stats_hash, ID2SYM(rb_intern("allocated_objects")),
+               SIZET2NUM(rb_gc_stat(sym_total_allocated_objects) - stats.allocated_objects));
+}
 
+/* record_batch_rows_to_a storing the stats into the hash stats_hash, or
+ * without the stats if it is nil.  The tiles of tables with more than
+ * kTileCells columns are not timed by the columns. */
+VALUE
+record_batch_rows_to_a_with_stats(const std::shared_ptr<arrow::RecordBatch>& record_batch,
+                                  int64_t begin, int64_t end, const ConvertOptions& options,
+                                  VALUE stats_hash) {
+  if (NIL_P(stats_hash)) {
+    return record_batch_rows_to_a(record_batch, begin, end, options);
+  }
+  ConvertStats stats(record_batch->num_columns());
+  VALUE rows = record_batch_rows_to_a(record_batch, begin, end, options, &stats);
+  write_convert_stats(*record_batch, end - begin, 0, record_batch->num_columns(),
+                      stats, stats_hash);
+  return rows;
+}
 
-namespace internal {
+VALUE
+record_batch_to_a(VALUE obj, const ConvertOptions& options, VALUE stats_hash) {
+  auto record_batch = get_record_batch(obj);
+  return record_batch_rows_to_a_with_stats(record_batch, 0, record_batch->num_rows(),
+                                           options, stats_hash);
+}
 
-using Status = arrow::Status;
-
-class ColumnConverter {
- public:
-  ColumnConverter(VALUE rows, int column_index, int num_columns)
-      : rows_(rows),
-        column_index_(column_index),
-        num_columns_(num_columns),
-        row_index_(0) {}
-
-  Status Convert(const std::shared_ptr<arrow::Array> arr) {
-    using Type = arrow::Type;
-    switch (arr->type_id()) {
-      default:
-        throw ruby::error(rb_eRuntimeError,
-                          std::string("Unsupported data type: ") + arr->type()->ToString());
-
-#define CASE(type_id, type_name, TypeName) \
-      case type_id: \
-        { \
-          auto type_name ## _array = std::static_pointer_cast<arrow :: TypeName ## Array>(arr); \
-          return Visit(type_name ## _array); \
-        }
-
-      CASE(Type::BOOL,    bool,    Boolean);
-      CASE(Type::UINT8,   uint8,   UInt8);
-      CASE(Type::INT8,    int8,    Int8);
-      CASE(Type::UINT16,  uint16,  UInt16);
-      CASE(Type::INT16,   int16,   Int16);
-      CASE(Type::UINT32,  uint32,  UInt32);
-      CASE(Type::INT32,   int32,   Int32);
-      CASE(Type::UINT64,  uint64,  UInt64);
-      CASE(Type::INT64,   int64,   Int64);
-      CASE(Type::FLOAT,   float,   Float);
-      CASE(Type::DOUBLE,  double,  Double);
-      CASE(Type::DECIMAL, decimal, Decimal128);
-      CASE(Type::STRING,  str,     Binary);
-      CASE(Type::BINARY,  bin,     Binary);
-
-#undef CASE
-    }
+/* Convert length rows from offset.  The range is clipped like Array#slice,
+ * and nil is returned if offset is out of range. */
+VALUE
+record_batch_slice_to_a(VALUE obj, int64_t offset, int64_t length,
+                        const ConvertOptions& options, VALUE stats_hash) {
+  auto record_batch = get_record_batch(obj);
+  const int64_t num_rows = record_batch->num_rows();
+  if (offset < 0) {
+    offset += num_rows;
   }
-
-  Status Visit(const std::shared_ptr<arrow::BinaryArray>& arr) {
-    const int64_t nr = arr->length();
-    if (arr->null_count() > 0) {
-      for (int64_t i = 0; i < nr; ++i) {
-        if (arr->IsNull(i)) {
-          RETURN_NOT_OK(VisitNull());
-        } else {
-          int32_t length;
-          const uint8_t* ptr = arr->GetValue(i, &length);
-          RETURN_NOT_OK(VisitValue(ptr, length));
-        }
-      }
-    } else {
-      for (int64_t i = 0; i < nr; ++i) {
-        int32_t length;
-        const uint8_t* ptr = arr->GetValue(i, &length);
-        RETURN_NOT_OK(VisitValue(ptr, length));
-      }
-    }
-    return Status::OK();
+  if (offset < 0 || offset > num_rows || length < 0) {
+    return Qnil;
   }
+  const int64_t end = std::min(offset + length, num_rows);
+  return record_batch_rows_to_a_with_stats(record_batch, offset, end, options, stats_hash);
+}
 
-  template <typename ArrayType>
-  Status Visit(const std::shared_ptr<ArrayType>& arr) {
-    const int64_t nr = arr->length();
-    if (arr->null_count() > 0) {
-      for (int64_t i = 0; i < nr; ++i) {
-        if (arr->IsNull(i)) {
-          RETURN_NOT_OK(VisitNull());
-        } else {
-          RETURN_NOT_OK(VisitValue(arr->Value(i)));
-        }
-      }
-    } else {
-      for (int64_t i = 0; i < nr; ++i) {
-        RETURN_NOT_OK(VisitValue(arr->Value(i)));
-      }
-    }
-    return Status::OK();
+/* Convert the row at index, which can be negative like Array#[] */
+VALUE
+record_batch_row_to_a(VALUE obj, int64_t index, const ConvertOptions& options,
+                      VALUE stats_hash) {
+  auto record_batch = get_record_batch(obj);
+  const int64_t num_rows = record_batch->num_rows();
+  if (index < 0) {
+    index += num_rows;
   }
-
-  Status VisitNull() {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, Qnil);
+  if (index < 0 || index >= num_rows) {
+    return Qnil;
   }
+  return rb_ary_entry(
+      record_batch_rows_to_a_with_stats(record_batch, index, index + 1, options, stats_hash), 0);
+}
 
-  Status VisitValue(bool val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, val ? Qtrue : Qfalse);
-    return Status::OK();
+/* Convert the values of a column into a flat array */
+VALUE
+record_batch_column_to_a(VALUE obj, int index, const ConvertOptions& options,
+                         VALUE stats_hash) {
+  auto record_batch = get_record_batch(obj);
+  const int num_columns = record_batch->num_columns();
+  if (index < 0) {
+    index += num_columns;
   }
-
-  Status VisitValue(int8_t val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, INT2NUM(val));
-    return Status::OK();
+  if (index < 0 || index >= num_columns) {
+    throw ruby::error(rb_eIndexError,
+                      std::string("Column index out of range: ") + std::to_string(index));
   }
 
-  Status VisitValue(int16_t val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, INT2NUM(val));
-    return Status::OK();
+  std::unique_ptr<ConvertStats> stats;
+  if (!NIL_P(stats_hash)) {
+    stats.reset(new ConvertStats(num_columns));
   }
 
-  Status VisitValue(int32_t val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, LONG2NUM(val));
-    return Status::OK();
+  VALUE keep_alive = rb_ary_new();
+  auto converter = make_column_converter(record_batch->schema()->field(index),
+                                         record_batch->column(index), options, keep_alive);
+
+  const int64_t num_rows = record_batch->num_rows();
+  VALUE values = rb_ary_new_capa(num_rows);
+  /* The values on the stack are marked by the conservative GC */
+  VALUE tile[kTileCells];
+  for (int64_t begin = 0; begin < num_rows; begin += kTileCells) {
+    const int64_t end = std::min(begin + kTileCells, num_rows);
+    const int64_t start = stats ? monotonic_ns() : 0;
+    converter->Convert(begin, end, tile, 1);
+    if (stats) {
+      stats->column_ns[index] += monotonic_ns() - start;
+    }
+    rb_ary_cat(values, tile, end - begin);
   }
 
-  Status VisitValue(int64_t val) {
-    VALUE cols = next_row();
-#if SIZEOF_LONG == 8
-    rb_ary_store(cols, column_index_, LONG2NUM(val));
-#else
-    rb_ary_store(cols, column_index_, LL2NUM(val));
-#endif
-    return Status::OK();
+  if (stats) {
+    write_convert_stats(*record_batch, num_rows, index, index + 1, *stats, stats_hash);
   }
+  RB_GC_GUARD(keep_alive);
+  return values;
+}
 
-  Status VisitValue(uint8_t val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, UINT2NUM(val));
-    return Status::OK();
-  }
+}  // namespace internal
 
-  Status VisitValue(uint16_t val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, UINT2NUM(val));
-    return Status::OK();
+internal::ConvertOptions
+convert_options(VALUE opts)
+{
+  internal::ConvertOptions options = { false, internal::kDefaultDedupLimit };
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    options.dedup_strings = RTEST(rb_hash_aref(opts, sym_dedup_strings));
+    VALUE limit = rb_hash_aref(opts, sym_dedup_limit);
+    if (!NIL_P(limit)) {
+      options.dedup_limit = NUM2LL(limit);
+    }
   }
+  return options;
+}
 
-  Status VisitValue(uint32_t val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, ULONG2NUM(val));
-    return Status::OK();
+/* The hash given by the stats option, or nil */
+static VALUE
+stats_option(VALUE opts)
+{
+  VALUE stats = NIL_P(opts) ? Qnil : rb_hash_aref(opts, sym_stats);
+  if (!NIL_P(stats)) {
+    Check_Type(stats, T_HASH);
   }
+  return stats;
+}
 
-  Status VisitValue(uint64_t val) {
-    VALUE cols = next_row();
-#if SIEOF_LONG == 8
-    rb_ary_store(cols, column_index_, ULONG2NUM(val));
-#else
-    rb_ary_store(cols, column_index_, ULL2NUM(val));
-#endif
-    return Status::OK();
-  }
+VALUE
+record_batch_to_a(int argc, VALUE* argv, VALUE obj)
+{
+  VALUE opts = Qnil;
+  rb_scan_args(argc, argv, "01", &opts);
+  const internal::ConvertOptions options = convert_options(opts);
+  VALUE stats = stats_option(opts);
 
-  Status VisitValue(double val) {
-    VALUE cols = next_row();
-    rb_ary_store(cols, column_index_, DBL2NUM(val));
-    return Status::OK();
-  }
+  VALUE res = Qnil;
 
-  // TODO: Support DECIMAL, too.
-  Status VisitValue(const uint8_t* ptr, const int32_t length) {
-    VALUE cols = next_row();
-    VALUE val = rb_str_new(reinterpret_cast<const char*>(ptr), length);
-    rb_ary_store(cols, column_index_, val);
-    return Status::OK();
+  try {
+    res = internal::record_batch_to_a(obj, options, stats);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
   }
 
- protected:
-  virtual void expand_rows(int64_t row_index) {}
+  return res;
+}
 
-  VALUE next_row() {
-    int64_t row_index = row_index_++;
-    expand_rows(row_index);
-    return RARRAY_AREF(rows_, row_index);
-  }
+VALUE
+record_batch_slice_to_a(int argc, VALUE* argv, VALUE obj)
+{
+  VALUE offset, length, opts = Qnil;
+  rb_scan_args(argc, argv, "21", &offset, &length, &opts);
+  const internal::ConvertOptions options = convert_options(opts);
+  VALUE stats = stats_option(opts);
 
-  const VALUE rows_;
-  const int column_index_;
-  const int num_columns_;
-  int64_t row_index_;
-};
-
-class FirstColumnConverter : public ColumnConverter {
- public:
-  using ColumnConverter::ColumnConverter;
-
- protected:
-  virtual void expand_rows(int64_t row_index) {
-    if (RARRAY_LEN(rows_) <= row_index) {
-      VALUE cols = rb_ary_new2(num_columns_);
-      rb_ary_push(rows_, cols);
-    }
+  VALUE res = Qnil;
+
+  try {
+    res = internal::record_batch_slice_to_a(obj, NUM2LL(offset), NUM2LL(length), options, stats);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
   }
-};
 
-VALUE
-record_batch_to_a(VALUE obj) {
-  auto gobj_record_batch = GARROW_RECORD_BATCH(RVAL2GOBJ(obj));
-  auto record_batch = garrow_record_batch_get_raw(gobj_record_batch);
-  auto num_rows = record_batch->num_rows();
-  auto num_columns = record_batch->num_columns();
-  auto schema = record_batch->schema();
+  return res;
+}
 
-  VALUE rows = rb_ary_new2(record_batch->num_rows());
+VALUE
+record_batch_row_to_a(int argc, VALUE* argv, VALUE obj)
+{
+  VALUE index, opts = Qnil;
+  rb_scan_args(argc, argv, "11", &index, &opts);
+  const internal::ConvertOptions options = convert_options(opts);
+  VALUE stats = stats_option(opts);
 
-  /* first column */
-  FirstColumnConverter converter0(rows, 0, num_columns);
-  converter0.Convert(record_batch->column(0));
+  VALUE res = Qnil;
 
-  if (num_columns > 1) {
-    for (int j = 1; j < num_columns; ++j) {
-      ColumnConverter converter(rows, j, num_columns);
-      converter.Convert(record_batch->column(j));
-    }
+  try {
+    res = internal::record_batch_row_to_a(obj, NUM2LL(index), options, stats);
+  } catch (ruby::error err) {
+    rb_exc_raise(err.exception_object());
   }
 
-  return rows;
+  return res;
 }
 
-}  // namespace internal
-
 VALUE
-record_batch_to_a(VALUE obj)
+record_batch_column_to_a(int argc, VALUE* argv, VALUE obj)
 {
+  VALUE index, opts = Qnil;
+  rb_scan_args(argc, argv, "11", &index, &opts);
+  const internal::ConvertOptions options = convert_options(opts);
+  VALUE stats = stats_option(opts);
+
   VALUE res = Qnil;
 
   try {
-    res = internal::record_batch_to_a(obj);
+    res = internal::record_batch_column_to_a(obj, NUM2INT(index), options, stats);
   } catch (ruby::error err) {
     rb_exc_raise(err.exception_object());
   }
@@ -285,6 +279,22 @@ Init_record_batch_ext()
 {
   VALUE mRecordBatchExt;
   mRecordBatchExt = rb_define_module("RecordBatchExt");
+
+  Init_record_batch_converter();
+
+  sym_dedup_strings = ID2SYM(rb_intern("dedup_strings"));
+  sym_dedup_limit   = ID2SYM(rb_intern("dedup_limit"));
+  sym_stats         = ID2SYM(rb_intern("stats"));
+
   rb_define_method(mRecordBatchExt, "to_a",
-                   reinterpret_cast<VALUE (*)(...)>(record_batch_to_a), 0);
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_to_a), -1);
+  rb_define_method(mRecordBatchExt, "slice_to_a",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_slice_to_a), -1);
+  rb_define_method(mRecordBatchExt, "row_to_a",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_row_to_a), -1);
+  rb_define_method(mRecordBatchExt, "column_to_a",
+                   reinterpret_cast<VALUE (*)(...)>(record_batch_column_to_a), -1);
+
+  Init_record_batch_aggregate(mRecordBatchExt);
+  Init_record_batch_hash_builder(mRecordBatchExt);
 }
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2018 Kenta Murata <mrkn@mrkn.jp>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECORD_BATCH_EXT_H
+#define RECORD_BATCH_EXT_H 1
+
+#include <ruby.h>
+
+#include <arrow/api.h>
+#include <arrow/util/decimal.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ruby {
+
+class error {
+ public:
+  error(VALUE exc_klass, const char* message) {
+    exc_ = rb_exc_new_cstr(exc_klass, message);
+  }
+
+  error(VALUE exc_klass, const std::string& message)
+      : error(exc_klass, message.c_str()) {}
+
+  VALUE exception_object() const { return exc_; }
+
+ private:
+  VALUE exc_;
+};
+
+}  // namespace ruby
+
+namespace internal {
+
+/* The number of values converted at once into a buffer on the stack.
+ * The rows are converted in tiles of kTileCells / num_columns rows, so the
+ * values of a tile stay in the cache until the row arrays are made. */
+static const int64_t kTileCells = 1024;
+
+struct ConvertOptions {
+  /* Whether the same strings in a column are shared frozen strings */
+  bool dedup_strings;
+  /* Deduplication of a column stops when it has more distinct values */
+  int64_t dedup_limit;
+};
+
+/* Converter of the values in a column into Ruby objects.
+ * Converters are resolved once per column, and convert a range of rows at
+ * once, so no type dispatch happens for each value. */
+class ColumnConverter {
+ public:
+  virtual ~ColumnConverter() {}
+
+  /* Store the values of the rows in [begin, end) into
+   * out[0], out[stride], out[2 * stride], ... */
+  virtual void Convert(int64_t begin, int64_t end, VALUE* out, int64_t stride) = 0;
+};
+
+/* Make the converter of a column (see converter.cc).  The Ruby objects
+ * referred by the converter are pushed to keep_alive, which the caller must
+ * keep alive during the conversion. */
+std::unique_ptr<ColumnConverter>
+make_column_converter(const std::shared_ptr<arrow::Field>& field,
+                      const std::shared_ptr<arrow::Array>& array,
+                      const ConvertOptions& options,
+                      VALUE keep_alive);
+
+inline int64_t
+monotonic_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* The time of the phases of a conversion, which is collected only if the
+ * stats option is given */
+struct ConvertStats {
+  explicit ConvertStats(int num_columns)
+      : column_ns(num_columns, 0), rows_ns(0),
+        allocated_objects(rb_gc_stat(ID2SYM(rb_intern("total_allocated_objects")))),
+        start_ns(monotonic_ns()) {}
+
+  /* the time converting the values of each column */
+  std::vector<int64_t> column_ns;
+  /* the time making the row arrays */
+  int64_t rows_ns;
+  /* the objects allocated and the time before the conversion */
+  size_t allocated_objects;
+  int64_t start_ns;
+};
+
+/* Convert the rows in [begin, end) into an array of row arrays (see
+ * converter.cc).  The time of the conversion is added to stats unless it
+ * is null. */
+VALUE record_batch_rows_to_a(const std::shared_ptr<arrow::RecordBatch>& record_batch,
+                             int64_t begin, int64_t end, const ConvertOptions& options,
+                             ConvertStats* stats = nullptr);
+
+/* DECIMAL values are BigDecimal, or Integer if the scale is zero */
+VALUE decimal_to_ruby(const arrow::Decimal128& value, int32_t scale);
+
+/* The record batch wrapped by a Ruby object */
+std::shared_ptr<arrow::RecordBatch> get_record_batch(VALUE obj);
+
+/* The index of a column given by its index or its name */
+int column_index(const arrow::RecordBatch& record_batch, VALUE column);
+
+/* Number the groups of the rows with the same values in the key columns.
+ * group_ids[i] is the group of row i, and first_rows[g] is the first row
+ * of group g, so the groups are in the order of their first rows. */
+void group_rows(const arrow::RecordBatch& record_batch, const std::vector<int>& key_indices,
+                std::vector<int64_t>* group_ids, std::vector<int64_t>* first_rows);
+
+}  // namespace internal
+
+/* The options of the conversion given by a hash such as
+ * { dedup_strings: true } */
+internal::ConvertOptions convert_options(VALUE opts);
+
+/* Resolve the Ruby classes and methods called by the converters in
+ * converter.cc, which must be called before they are made */
+void Init_record_batch_converter();
+
+/* Define the aggregation methods in aggregate.cc */
+void Init_record_batch_aggregate(VALUE mRecordBatchExt);
+
+/* Define the methods building hashes in hash_builder.cc */
+void Init_record_batch_hash_builder(VALUE mRecordBatchExt);
+
+#endif /* RECORD_BATCH_EXT_H */
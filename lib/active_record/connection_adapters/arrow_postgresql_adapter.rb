@@ -0,0 +1 @@
+require 'active_record_ext/arrow_postgresql_adapter'
@@ -1,6 +1,8 @@
 require 'active_record'
 require 'active_record/connection_adapters/mysql2_adapter'
 require 'active_record_ext/arrow_result'
+require 'active_record_ext/arrow_result_cache'
+require 'active_record_ext/instrumentation'
 
 module ActiveRecord
   module ConnectionHandling
@@ -28,38 +30,81 @@ end
 
 module ActiveRecordExt
   class ArrowMysql2Adapter < ActiveRecord::ConnectionAdapters::Mysql2Adapter
+    # The cache of the results of select_all_by_arrow(..., cache: true),
+    # which is made from the arrow_result_cache option of the database
+    # configuration, e.g. { app: 'myapp', ttl: 300 }
+    attr_accessor :arrow_result_cache
+
+    # The query options changing the values or the types of the results
+    ARROW_RESULT_OPTIONS = %i[
+      cast cast_booleans dictionary database_timezone application_timezone
+    ].freeze
+
     def initialize(*args, **kwargs)
       super
       @arrow_result = false
+      @arrow_result_cached = false
+      if (cache_config = @config[:arrow_result_cache])
+        cache_config = {} if cache_config == true
+        @arrow_result_cache = ArrowResultCache.new(
+          namespace: arrow_result_cache_namespace, **cache_config.symbolize_keys)
+      end
+      # the arrow_instrumentation option publishes the stats of the native
+      # conversions of the whole process, not only of this connection, see
+      # ActiveRecordExt::Instrumentation
+      Instrumentation.enable if @config[:arrow_instrumentation]
     end
 
     def exec_query(sql, name = "SQL", binds = [], prepare: false)
       return super unless @arrow_result
-      if without_prepared_statement?(binds)
-        execute_and_free(sql, name) do |result|
-          ArrowResult.new(result.to_arrow) if result
-        end
-      else
-        exec_stmt_and_free(sql, name, binds, cache_stmt: prepare) do |_, result|
-          ArrowResult.new(result.to_arrow) if result
+      if @arrow_result_cached && @arrow_result_cache
+        # statements without results return nil without being cached
+        return @arrow_result_cache.fetch(sql, binds) do
+          exec_arrow_query(sql, name, binds, prepare) || break
         end
       end
+      record_batch = exec_arrow_query(sql, name, binds, prepare)
+      ArrowResult.new(record_batch) if record_batch
     end
 
-    def select_all_by_arrow(arel, name = nil, binds = [], preparable: nil)
-      with_arrow_result do
+    # With cache: true, the result is shared with the other processes
+    # through arrow_result_cache if it is configured
+    def select_all_by_arrow(arel, name = nil, binds = [], preparable: nil, cache: false)
+      with_arrow_result(cache) do
         select_all(arel, name, binds, preparable: preparable)
       end
     end
 
     private
 
-    def with_arrow_result
+    # The results of the connections with different users, whose grants can
+    # differ, or with different options are cached separately
+    def arrow_result_cache_namespace
+      options = @connection.query_options.slice(*ARROW_RESULT_OPTIONS)
+      [@config[:host], @config[:port], @config[:socket], @config[:database],
+       @config[:username], @config[:encoding], options.sort].inspect
+    end
+
+    def exec_arrow_query(sql, name, binds, prepare)
+      if without_prepared_statement?(binds)
+        execute_and_free(sql, name) do |result|
+          result.to_arrow if result
+        end
+      else
+        exec_stmt_and_free(sql, name, binds, cache_stmt: prepare) do |_, result|
+          result.to_arrow if result
+        end
+      end
+    end
+
+    def with_arrow_result(cached = false)
       begin
         old_value, @arrow_result = @arrow_result, true
+        old_cached, @arrow_result_cached = @arrow_result_cached, cached
         yield
       ensure
         @arrow_result = old_value
+        @arrow_result_cached = old_cached
       end
     end
   end
@@ -0,0 +1,104 @@
+require 'active_record'
+require 'active_record/connection_adapters/postgresql_adapter'
+require 'pg-arrow'
+require 'active_record_ext/arrow_result'
+require 'active_record_ext/arrow_result_cache'
+
+module ActiveRecord
+  module ConnectionHandling
+    # The same as postgresql_connection of ActiveRecord 5.2
+    def arrow_postgresql_connection(config)
+      conn_params = config.symbolize_keys
+      conn_params.delete_if { |_, v| v.nil? }
+
+      # Map ActiveRecords param names to PGs.
+      conn_params[:user] = conn_params.delete(:username) if conn_params[:username]
+      conn_params[:dbname] = conn_params.delete(:database) if conn_params[:database]
+
+      # Forward only valid config params to PG::Connection.connect.
+      valid_conn_param_keys = PG::Connection.conndefaults_hash.keys + [:requiressl]
+      conn_params.slice!(*valid_conn_param_keys)
+
+      ActiveRecordExt::ArrowPostgreSQLAdapter.new(nil, logger, conn_params, config)
+    end
+  end
+end
+
+module ActiveRecordExt
+  # The results of select_all_by_arrow are read through
+  # COPY (query) TO STDOUT (FORMAT binary) into record batches, see
+  # PgArrow::ConnectionExtension#copy_to_arrow.
+  #
+  # COPY takes no parameters, so the binds are substituted into the SQL.
+  # The queries returning the types without decoders fall back to the
+  # regular results.
+  class ArrowPostgreSQLAdapter < ActiveRecord::ConnectionAdapters::PostgreSQLAdapter
+    ADAPTER_NAME = 'ArrowPostgreSQL'.freeze
+
+    # The cache of the results of select_all_by_arrow(..., cache: true),
+    # which is made from the arrow_result_cache option of the database
+    # configuration, see ArrowMysql2Adapter
+    attr_accessor :arrow_result_cache
+
+    def initialize(*args, **kwargs)
+      super
+      @arrow_result = false
+      @arrow_result_cached = false
+      if (cache_config = @config[:arrow_result_cache])
+        cache_config = {} if cache_config == true
+        namespace = "pg:#{@config[:host]}:#{@config[:port]}/#{@config[:database]}"
+        @arrow_result_cache = ArrowResultCache.new(
+          namespace: namespace, **cache_config.symbolize_keys)
+      end
+    end
+
+    def exec_query(sql, name = "SQL", binds = [], prepare: false)
+      return super unless @arrow_result && binds.empty?
+      if @arrow_result_cached && @arrow_result_cache
+        cached = @arrow_result_cache.read(sql)
+        return cached if cached
+      end
+      record_batch = exec_arrow_query(sql, name)
+      return super unless record_batch
+      if @arrow_result_cached && @arrow_result_cache
+        @arrow_result_cache.write(sql, [], record_batch)
+      end
+      ArrowResult.new(record_batch)
+    end
+
+    # With cache: true, the result is shared with the other processes
+    # through arrow_result_cache if it is configured
+    def select_all_by_arrow(arel, name = nil, binds = [], preparable: nil, cache: false)
+      with_arrow_result(cache) do
+        unprepared_statement do
+          select_all(arel, name, binds, preparable: preparable)
+        end
+      end
+    end
+
+    private
+
+    # The record batch of the result, or nil for the unsupported types
+    def exec_arrow_query(sql, name)
+      log(sql, name) do
+        ActiveSupport::Dependencies.interlock.permit_concurrent_loads do
+          @connection.copy_to_arrow(sql)
+        end
+      end
+    rescue ActiveRecord::StatementInvalid => error
+      raise unless error.cause.is_a?(PgArrow::UnsupportedType)
+      nil
+    end
+
+    def with_arrow_result(cached = false)
+      begin
+        old_value, @arrow_result = @arrow_result, true
+        old_cached, @arrow_result_cached = @arrow_result_cached, cached
+        yield
+      ensure
+        @arrow_result = old_value
+        @arrow_result_cached = old_cached
+      end
+    end
+  end
+end
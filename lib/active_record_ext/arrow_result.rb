@@ -3,12 +3,20 @@ require 'record_batch_ext'
 
 module ActiveRecordExt
   class ArrowResult < ActiveRecord::Result
+    # The number of rows materialized at a time by each
+    EACH_WINDOW_SIZE = 1024
+
+    # Options passed to RecordBatch#to_a when the rows are generated,
+    # e.g. { dedup_strings: true }
+    attr_accessor :to_a_options
+
     def initialize(record_batch)
       @record_batch = record_batch
       @columns = nil
       @column_types = {}
       @rows = nil
       @hash_rows = nil
+      @to_a_options = {}
     end
 
     def columns
@@ -27,12 +35,23 @@ module ActiveRecordExt
       @record_batch.n_rows
     end
 
+    # Rows are materialized window by window unless they already are,
+    # so breaking out of the loop early converts only the rows seen.
     def each
-      if block_given?
-        hash_rows.each(&proc)
+      return to_enum(:each) { length } unless block_given?
+
+      if @hash_rows || @rows
+        hash_rows.each { |row| yield row }
       else
-        hash_rows.to_enum { length }
+        offset = 0
+        while offset < length
+          @record_batch.slice_to_a(offset, EACH_WINDOW_SIZE, @to_a_options).each do |row|
+            yield row_to_hash(row)
+          end
+          offset += EACH_WINDOW_SIZE
+        end
       end
+      self
     end
 
     def to_hash
@@ -51,24 +70,93 @@ module ActiveRecordExt
     end
 
     def [](idx)
-      hash_rows[idx]
+      return hash_rows[idx] if @hash_rows
+      row = @rows ? @rows[idx] : @record_batch.row_to_a(idx, @to_a_options)
+      row && row_to_hash(row)
     end
 
     def first
-      return nil if @record_batch.empty?
-      Hash[columns.zip(rows.first)] # TODO
+      self[0]
     end
 
     def last
-      return nil if @record_batch.empty?
-      Hash[columns.zip(rows.last)] # TODO
+      self[-1]
+    end
+
+    # Aggregations computed over the Arrow columns without making Ruby
+    # objects for the rows.  Each aggregation is a pair of an operation
+    # (:sum, :mean, :min, :max or :count) and a column name, e.g.
+    #
+    #   result.aggregate([:sum, :amount], [:count, nil], group_by: :user_id)
+    #
+    # returns an array of the results, or a hash from the values of the
+    # group_by columns to the arrays of the results of the groups.
+    def aggregate(*aggregations, group_by: nil)
+      if group_by
+        @record_batch.group_aggregate(Array(group_by), aggregations)
+      else
+        @record_batch.aggregate(aggregations)
+      end
+    end
+
+    # The methods of Enumerable are used unless a column name is given
+    def sum(*args, &block)
+      return super unless column_argument?(args, block)
+      aggregate([:sum, args[0]])[0]
+    end
+
+    def count(*args, &block)
+      return length if args.empty? && !block
+      return super unless column_argument?(args, block)
+      aggregate([:count, args[0]])[0]
+    end
+
+    def minmax(*args, &block)
+      return super unless column_argument?(args, block)
+      aggregate([:min, args[0]], [:max, args[0]])
+    end
+
+    # ENUM and SET columns are compared by their strings as MySQL does
+    def minimum(column)
+      aggregate([:min, column])[0]
+    end
+
+    def maximum(column)
+      aggregate([:max, column])[0]
+    end
+
+    # The mean of an integer or decimal column is BigDecimal like
+    # ActiveRecord's average, and the one of a float column is Float.
+    # Unlike AVG of MySQL, the mean is not rounded to div_precision_increment.
+    def mean(column)
+      aggregate([:mean, column])[0]
+    end
+
+    # A hash from the values of the key column to the values of the rows,
+    # e.g. index_by_column(:id, :name) is the same as rows.to_h for the
+    # rows of the two columns.  values is a column, an array of columns
+    # for row arrays, or nil for the whole rows.
+    def index_by_column(key, values = nil)
+      @record_batch.index_by_column(key, values, @to_a_options)
+    end
+
+    # A hash from the values of the key column to the arrays of the values
+    # of the rows, in the order of the rows like Enumerable#group_by
+    def group_by_column(key, values = nil)
+      @record_batch.group_by_column(key, values, @to_a_options)
     end
 
     def cast_values(type_overrides = {})
-      if type_overrides.empty? || 
-           (column_types == column_types.merge(type_overrides))
-        result = rows
-        columns.one? ? result.map!(:first) : result
+      if columns.one?
+        # Converted straight into a flat array without row arrays
+        values = @rows ? @rows.map(&:first) : @record_batch.column_to_a(0, @to_a_options)
+        type = column_type(columns.first, type_overrides)
+        # the default type returns the values as they are
+        return values if type.instance_of?(ActiveModel::Type::Value)
+        values.map! { |value| type.deserialize(value) }
+      elsif type_overrides.empty? ||
+              (column_types == column_types.merge(type_overrides))
+        rows
       else
         super
       end
@@ -77,21 +165,30 @@ module ActiveRecordExt
     private
 
       def hash_rows
-        @hash_rows ||=
-          begin
-            columns = self.columns.map { |c| c.dup.freeze }
-            rows.map do |row|
-              {}.tap do |hash|
-                index = 0
-                length = columns.length
-
-                while index < length
-                  hash[columns[index]] = row[index]
-                  index += 1
-                end
-              end
-            end
+        @hash_rows ||= rows.map { |row| row_to_hash(row) }
+      end
+
+      def hash_columns
+        @hash_columns ||= columns.map { |c| c.dup.freeze }
+      end
+
+      def row_to_hash(row)
+        columns = hash_columns
+        {}.tap do |hash|
+          index = 0
+          length = columns.length
+
+          while index < length
+            hash[columns[index]] = row[index]
+            index += 1
           end
+        end
+      end
+
+      def column_argument?(args, block)
+        !block && args.length == 1 &&
+          (args[0].is_a?(String) || args[0].is_a?(Symbol)) &&
+          columns.include?(args[0].to_s)
       end
 
       def generate_columns
@@ -101,7 +198,7 @@ module ActiveRecordExt
       end
 
       def generate_rows
-        @record_batch.to_a
+        @record_batch.to_a(@to_a_options)
       end
   end
 end
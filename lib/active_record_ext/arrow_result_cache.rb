@@ -0,0 +1,154 @@
+require 'digest'
+require 'fileutils'
+require 'record_batch_ext'
+require 'active_record_ext/arrow_result'
+
+module ActiveRecordExt
+  # A cache of query results shared among processes.
+  #
+  # Each result is an Arrow IPC file in a directory on tmpfs, and it is read
+  # through a memory map, so the processes reading the same result share the
+  # pages of the file instead of holding their own copies.
+  #
+  # The files are keyed by the SQL and the values of the binds.  They expire
+  # after ttl seconds, and can be invalidated by #delete or #clear, e.g. from
+  # the callbacks of the models whose tables the cached queries read.
+  #
+  # The results are readable only by the user of the process: the directory
+  # is made with mode 0700, and directories of the other users or writable by
+  # them are refused, so nobody else can read the results or plant files.
+  class ArrowResultCache
+    DEFAULT_ROOT = '/dev/shm'.freeze
+
+    # Raised for a directory which other users can read or write
+    class InsecureDirectory < StandardError; end
+
+    attr_reader :directory, :ttl
+
+    # The directory of the user and the application, which is named after
+    # the working directory unless app is given
+    def self.default_directory(app = nil)
+      app ||= File.basename(Dir.pwd)
+      File.join(DEFAULT_ROOT, "active_record_ext-#{Process.uid}", app)
+    end
+
+    # namespace separates the keys of different databases and options in a
+    # directory
+    def initialize(directory: nil, app: nil, ttl: 600, namespace: nil)
+      @directory = directory || self.class.default_directory(app)
+      @ttl = ttl
+      @namespace = namespace
+      make_directory(@directory)
+    end
+
+    # The cached result, or the result of the record batch returned by the
+    # block, which is cached for the other processes.
+    def fetch(sql, binds = [])
+      result = read(sql, binds)
+      return result if result
+
+      record_batch = yield
+      write(sql, binds, record_batch)
+      ArrowResult.new(record_batch)
+    end
+
+    def read(sql, binds = [])
+      path = path_for(sql, binds)
+      return nil if expired?(path)
+
+      # The buffers of the batch refer to the mapped pages, so the stream
+      # is not closed here but when it is collected after the batch
+      input = Arrow::MemoryMappedInputStream.new(path)
+      reader = Arrow::RecordBatchFileReader.new(input)
+      ArrowResult.new(reader.read_record_batch(0))
+    rescue Errno::ENOENT, Arrow::Error
+      nil
+    end
+
+    # The file is written under a temporary name and renamed, so the other
+    # processes see either no file or the whole file.
+    def write(sql, binds, record_batch)
+      path = path_for(sql, binds)
+      tmp_path = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+      # the file is made only readable by the user before it is written
+      FileUtils.rm_f(tmp_path)
+      File.open(tmp_path, File::WRONLY | File::CREAT | File::EXCL, 0600).close
+      output = Arrow::FileOutputStream.new(tmp_path, false)
+      begin
+        writer = Arrow::RecordBatchFileWriter.new(output, record_batch.schema)
+        begin
+          writer.write_record_batch(record_batch)
+        ensure
+          writer.close
+        end
+      ensure
+        output.close
+      end
+      File.rename(tmp_path, path)
+    rescue
+      FileUtils.rm_f(tmp_path) if tmp_path
+      raise
+    end
+
+    def delete(sql, binds = [])
+      FileUtils.rm_f(path_for(sql, binds))
+    end
+
+    def clear
+      FileUtils.rm_f(Dir.glob(File.join(@directory, '*.arrow')))
+    end
+
+    # Delete the expired files, which are otherwise deleted when read
+    def cleanup
+      Dir.glob(File.join(@directory, '*.arrow')) do |path|
+        expired?(path)
+      end
+    end
+
+    def key_for(sql, binds = [])
+      values = binds.map do |bind|
+        bind.respond_to?(:value_for_database) ? bind.value_for_database : bind
+      end
+      Digest::SHA256.hexdigest(Marshal.dump([@namespace, sql, values]))
+    end
+
+    private
+
+      # Make the directory and its parents up to the first existing one with
+      # mode 0700, and check the directory is private to the user
+      def make_directory(directory)
+        parent = File.dirname(directory)
+        make_directory(parent) unless parent == directory || File.directory?(parent)
+        begin
+          Dir.mkdir(directory, 0700)
+        rescue Errno::EEXIST
+        end
+        check_directory(directory)
+      end
+
+      def check_directory(directory)
+        stat = File.lstat(directory)
+        unless stat.directory? && stat.uid == Process.uid && stat.mode & 0022 == 0
+          raise InsecureDirectory,
+                "#{directory} must be a directory owned by uid #{Process.uid} " \
+                "and not writable by the others"
+        end
+      end
+
+      def path_for(sql, binds)
+        File.join(@directory, "#{key_for(sql, binds)}.arrow")
+      end
+
+      def expired?(path)
+        return !File.exist?(path) unless @ttl
+        if File.mtime(path) + @ttl < Time.now
+          FileUtils.rm_f(path)
+          true
+        else
+          false
+        end
+      rescue Errno::ENOENT
+        true
+      end
+  end
+end
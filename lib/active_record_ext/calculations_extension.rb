@@ -1,13 +1,17 @@
 module ActiveRecordExt
   module CalculationsExtension
-    def pluck_by_arrow(*column_names)
+    # With dedup_strings: true, the same strings in a column are returned
+    # as shared frozen strings (see RecordBatchExt#to_a).
+    # With cache: true, the result is shared among processes through the
+    # arrow_result_cache of the connection if it is configured.
+    def pluck_by_arrow(*column_names, dedup_strings: false, cache: false)
       if loaded? && (column_names.map(&:to_s) - @klass.attribute_names - @klass.attribute_aliases.keys).empty?
         return records.pluck(*column_names)
       end
 
       if has_include?(column_names.first)
         relation = apply_join_dependency
-        relation.pluck_by_arrow(*column_names)
+        relation.pluck_by_arrow(*column_names, dedup_strings: dedup_strings, cache: cache)
       else
         enforce_raw_sql_whitelist(column_names)
         relation = spawn
@@ -15,8 +19,11 @@ module ActiveRecordExt
           @klass.has_attribute?(cn) || @klass.attribute_alias?(cn) ? arel_attribute(cn) : cn
         }
         result = skip_query_cache_if_necessary {
-          klass.connection.select_all_by_arrow(relation.arel, nil)
+          klass.connection.select_all_by_arrow(relation.arel, nil, cache: cache)
         }
+        if dedup_strings && result.respond_to?(:to_a_options=)
+          result.to_a_options = { dedup_strings: true }
+        end
         result.cast_values(klass.attribute_types)
       end
     end
@@ -0,0 +1,92 @@
+require 'active_support/notifications'
+require 'mysql2-arrow'
+require 'record_batch_ext'
+
+module ActiveRecordExt
+  # Notifications of the phases of the native conversions.
+  #
+  # When enabled, the reading methods of Mysql2::Result (to_arrow,
+  # each_arrow_batch and write_arrow) and the converting methods of
+  # Arrow::RecordBatch (to_a, slice_to_a, row_to_a and column_to_a) collect
+  # their timers and counters through the stats option, and publish them as
+  # the payloads of the to_arrow.mysql2_arrow and to_a.record_batch_ext
+  # events.  The name of the method is in payload[:method]:
+  #
+  #   ActiveSupport::Notifications.subscribe('to_arrow.mysql2_arrow') do |*, payload|
+  #     payload[:method]             # :to_arrow, :each_arrow_batch, ...
+  #     payload[:fetch_ns]           # reading the rows in libmysqlclient
+  #     payload[:decode_ns_by_type]  # { "int32" => ..., "bytes" => ... }
+  #   end
+  #
+  # The event of each_arrow_batch includes the time of its block.
+  #
+  # The methods are wrapped for the whole process, so enabling this, such as
+  # by the arrow_instrumentation option of a connection, instruments all the
+  # connections and the record batches.  The collection costs a few clock
+  # reads per cell, so it is disabled by default.
+  module Instrumentation
+    class << self
+      def enabled?
+        @enabled
+      end
+
+      def enable
+        unless @installed
+          Mysql2::Result.prepend(ResultInstrumentation)
+          Arrow::RecordBatch.prepend(RecordBatchInstrumentation)
+          @installed = true
+        end
+        @enabled = true
+      end
+
+      def disable
+        @enabled = false
+      end
+    end
+
+    module ResultInstrumentation
+      def to_arrow(opts = nil)
+        return super unless Instrumentation.enabled?
+
+        payload = { method: :to_arrow }
+        ActiveSupport::Notifications.instrument('to_arrow.mysql2_arrow', payload) do
+          super((opts || {}).merge(stats: payload))
+        end
+      end
+
+      def each_arrow_batch(opts = nil, &block)
+        return super unless Instrumentation.enabled? && block
+
+        payload = { method: :each_arrow_batch }
+        ActiveSupport::Notifications.instrument('to_arrow.mysql2_arrow', payload) do
+          super((opts || {}).merge(stats: payload), &block)
+        end
+      end
+
+      def write_arrow(dest, opts = nil)
+        return super unless Instrumentation.enabled?
+
+        payload = { method: :write_arrow }
+        ActiveSupport::Notifications.instrument('to_arrow.mysql2_arrow', payload) do
+          super(dest, (opts || {}).merge(stats: payload))
+        end
+      end
+    end
+
+    module RecordBatchInstrumentation
+      # The converting methods with the number of their positional arguments
+      # before the options
+      { to_a: 0, slice_to_a: 2, row_to_a: 1, column_to_a: 1 }.each do |name, arity|
+        define_method(name) do |*args|
+          return super(*args) unless Instrumentation.enabled?
+
+          opts = args.length > arity ? args.pop : nil
+          payload = { method: name }
+          ActiveSupport::Notifications.instrument('to_a.record_batch_ext', payload) do
+            super(*args, (opts || {}).merge(stats: payload))
+          end
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,5 @@
+require "pg"
+require "arrow"
+require "pg_arrow.so"
+
+PG::Connection.include PgArrow::ConnectionExtension
@@ -0,0 +1,55 @@
+require 'spec_helper'
+require 'active_record_ext'
+require 'active_record_ext/arrow_postgresql_adapter'
+
+RSpec.describe ActiveRecordExt::ArrowPostgreSQLAdapter do
+  subject(:conn) do
+    ActiveRecord::Base.establish_connection(
+      host: 'localhost',
+      database: 'test',
+      adapter: 'arrow_postgresql'
+    )
+    ActiveRecord::Base.connection
+  end
+
+  before do
+    conn.create_table(:pg_arrow_records, temporary: true, force: true) do |t|
+      t.integer :int_test
+      t.float :double_test
+      t.string :varchar_test
+      t.interval :interval_test
+    end
+    conn.execute(<<~SQL)
+      INSERT INTO pg_arrow_records (int_test, double_test, varchar_test, interval_test)
+      SELECT i, i / 2.0, 'row' || i, '1 day' FROM generate_series(1, 10) AS i
+    SQL
+  end
+
+  let(:model_class) do
+    Class.new(ActiveRecord::Base) do
+      self.table_name = 'pg_arrow_records'
+    end
+  end
+
+  describe '.select_all_by_arrow' do
+    specify do
+      result = conn.select_all_by_arrow('SELECT int_test, varchar_test FROM pg_arrow_records')
+      expect(result).to be_kind_of(ActiveRecordExt::ArrowResult)
+      expect(result.rows).to eq(conn.select_all('SELECT int_test, varchar_test FROM pg_arrow_records').rows)
+    end
+
+    specify 'unsupported types fall back to the regular result' do
+      result = conn.select_all_by_arrow('SELECT interval_test FROM pg_arrow_records')
+      expect(result).not_to be_kind_of(ActiveRecordExt::ArrowResult)
+      expect(result.length).to eq(10)
+    end
+  end
+
+  describe '.pluck_by_arrow' do
+    specify 'with binds' do
+      relation = model_class.where(int_test: 3..5).order(:int_test)
+      expect(relation.pluck_by_arrow(:int_test, :double_test, :varchar_test))
+        .to eq(relation.pluck(:int_test, :double_test, :varchar_test))
+    end
+  end
+end
@@ -0,0 +1,105 @@
+require 'spec_helper'
+require 'tmpdir'
+require 'active_record_ext'
+require 'active_record_ext/arrow_result_cache'
+
+RSpec.describe ActiveRecordExt::ArrowResultCache do
+  let(:mysql2_client) do
+    Mysql2::Client.new(host: 'localhost', username: 'root', database: 'test')
+  end
+
+  let(:query_stmt) do
+    'SELECT int_test, double_test, varchar_test, enum_test FROM mysql2_test LIMIT 100'
+  end
+
+  let(:record_batch) do
+    mysql2_client.query(query_stmt).to_arrow
+  end
+
+  let(:ttl) { 600 }
+
+  around do |example|
+    Dir.mktmpdir do |dir|
+      @directory = dir
+      example.run
+    end
+  end
+
+  subject(:cache) do
+    described_class.new(directory: @directory, ttl: ttl)
+  end
+
+  describe '.fetch' do
+    specify 'the block is called only on a miss' do
+      calls = 0
+      2.times do
+        result = cache.fetch(query_stmt) { calls += 1; record_batch }
+        expect(result.rows).to eq(record_batch.to_a)
+      end
+      expect(calls).to eq(1)
+    end
+
+    specify 'the results are shared with other instances' do
+      cache.fetch(query_stmt) { record_batch }
+      other = described_class.new(directory: @directory)
+      expect(other.read(query_stmt).rows).to eq(record_batch.to_a)
+    end
+
+    specify 'binds are parts of the key' do
+      cache.write(query_stmt, [1], record_batch)
+      expect(cache.read(query_stmt, [1])).not_to be_nil
+      expect(cache.read(query_stmt, [2])).to be_nil
+    end
+  end
+
+  context 'with an expired result' do
+    let(:ttl) { 0 }
+
+    specify do
+      cache.write(query_stmt, [], record_batch)
+      sleep 0.01
+      expect(cache.read(query_stmt)).to be_nil
+    end
+  end
+
+  describe 'permissions' do
+    specify 'the files are readable only by the user' do
+      cache.write(query_stmt, [], record_batch)
+      path = Dir.glob(File.join(@directory, '*.arrow')).first
+      expect(File.stat(path).mode & 0777).to eq(0600)
+    end
+
+    specify 'the directories are made with mode 0700' do
+      directory = File.join(@directory, 'user', 'app')
+      described_class.new(directory: directory)
+      expect(File.stat(directory).mode & 0777).to eq(0700)
+      expect(File.stat(File.dirname(directory)).mode & 0777).to eq(0700)
+    end
+
+    specify 'a directory writable by the others is refused' do
+      directory = File.join(@directory, 'shared')
+      Dir.mkdir(directory)
+      File.chmod(0777, directory)
+      expect {
+        described_class.new(directory: directory)
+      }.to raise_error(described_class::InsecureDirectory)
+    end
+
+    specify 'the default directory is of the user and the application' do
+      expect(described_class.default_directory('myapp')).to eq(
+        "/dev/shm/active_record_ext-#{Process.uid}/myapp")
+    end
+  end
+
+  describe '.delete and .clear' do
+    specify do
+      cache.write(query_stmt, [], record_batch)
+      cache.delete(query_stmt)
+      expect(cache.read(query_stmt)).to be_nil
+
+      cache.write(query_stmt, [], record_batch)
+      cache.clear
+      expect(Dir.children(@directory)).to be_empty
+    end
+  end
+end
@@ -68,4 +68,133 @@ RSpec.describe ActiveRecordExt::ArrowResult do
       expect(values).to eq(ar_result.cast_values)
     end
   end
+
+  describe '.first' do
+    specify do
+      expect(result.first).to eq(ar_result.first)
+    end
+  end
+
+  describe '.last' do
+    specify do
+      expect(result.last).to eq(ar_result.last)
+    end
+  end
+
+  describe '.[]' do
+    specify do
+      [0, 3, query_limit - 1, -1, -query_limit].each do |idx|
+        expect(result[idx]).to eq(ar_result[idx])
+      end
+      expect(result[query_limit]).to be_nil
+      expect(result[-query_limit - 1]).to be_nil
+    end
+
+    it 'does not materialize all the rows' do
+      result[1]
+      expect(result.instance_variable_get(:@rows)).to be_nil
+    end
+  end
+
+  describe '.each' do
+    specify do
+      expect(result.each.to_a).to eq(ar_result.each.to_a)
+    end
+
+    context 'with rows more than a window' do
+      let(:query_limit) { ActiveRecordExt::ArrowResult::EACH_WINDOW_SIZE * 2 + 1 }
+
+      specify do
+        expect(result.map { |row| row }).to eq(ar_result.to_a)
+      end
+    end
+
+    it 'stops materializing rows on break' do
+      result.each { |row| break row }
+      expect(result.instance_variable_get(:@rows)).to be_nil
+    end
+  end
+
+  describe 'aggregations' do
+    let(:query_limit) { 1000 }
+
+    def values_of(column)
+      ar_result.rows.map { |row| row[ar_result.columns.index(column)] }.compact
+    end
+
+    specify '.sum' do
+      expect(result.sum('int_test')).to eq(values_of('int_test').sum)
+      expect(result.sum(:double_test)).to be_within(1e-6).of(values_of('double_test').sum)
+    end
+
+    specify '.count' do
+      expect(result.count).to eq(ar_result.length)
+      expect(result.count(:int_test)).to eq(values_of('int_test').length)
+    end
+
+    specify '.minmax' do
+      expect(result.minmax(:int_test)).to eq(values_of('int_test').minmax)
+      expect(result.minmax(:varchar_test)).to eq(values_of('varchar_test').minmax)
+    end
+
+    specify '.minmax of an ENUM column' do
+      enum_result = ActiveRecordExt::ArrowResult.new(
+        mysql2_client.query('SELECT enum_test FROM mysql2_test LIMIT 1000').to_arrow
+      )
+      values = mysql2_client.query('SELECT enum_test FROM mysql2_test LIMIT 1000').to_a.map(&:first).compact
+      expect(enum_result.minmax(:enum_test)).to eq(values.minmax)
+      expect(enum_result.minimum(:enum_test)).to eq(values.min)
+      expect(enum_result.maximum(:enum_test)).to eq(values.max)
+    end
+
+    specify '.mean' do
+      values = values_of('int_test')
+      expect(result.mean(:int_test)).to be_a(BigDecimal)
+      expect(result.mean(:int_test)).to be_within(1e-9).of(values.sum.fdiv(values.length))
+      expect(result.mean(:double_test)).to be_a(Float)
+    end
+
+    specify '.aggregate with group_by' do
+      groups = ar_result.to_a.group_by { |row| row['varchar_test'] }
+      expected = groups.transform_values do |rows|
+        ints = rows.map { |row| row['int_test'] }.compact
+        [ints.sum, rows.length]
+      end
+
+      actual = result.aggregate([:sum, :int_test], [:count, nil], group_by: :varchar_test)
+      expect(actual).to eq(expected)
+    end
+
+    specify '.aggregate with group_by of 0.0 and -0.0' do
+      zeros_result = ActiveRecordExt::ArrowResult.new(
+        mysql2_client.query('SELECT 0e0 AS d, 1 AS n UNION ALL SELECT -0e0, 2').to_arrow
+      )
+      actual = zeros_result.aggregate([:sum, :n], [:count, nil], group_by: :d)
+      expect(actual).to eq({ 0.0 => [3, 2] })
+    end
+
+    it 'rejects unknown columns' do
+      expect { result.aggregate([:sum, :no_such_column]) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'hash builders' do
+    let(:query_limit) { 1000 }
+
+    specify '.index_by_column' do
+      expected = ar_result.rows.map { |row| [row[0], row[2]] }.to_h
+      expect(result.index_by_column(:int_test, :varchar_test)).to eq(expected)
+
+      expected = ar_result.rows.map { |row| [row[0], row] }.to_h
+      expect(result.index_by_column(:int_test)).to eq(expected)
+    end
+
+    specify '.group_by_column' do
+      expected = ar_result.rows.group_by { |row| row[2] }
+      expect(result.group_by_column(:varchar_test)).to eq(expected)
+
+      expected = expected.transform_values { |rows| rows.map { |row| [row[0], row[1]] } }
+      expect(result.group_by_column('varchar_test', %i[int_test double_test])).to eq(expected)
+    end
+  end
 end
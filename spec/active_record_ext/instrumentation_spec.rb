@@ -0,0 +1,101 @@
+require 'spec_helper'
+require 'stringio'
+require 'active_record_ext'
+require 'active_record_ext/instrumentation'
+
+RSpec.describe ActiveRecordExt::Instrumentation do
+  let(:mysql2_client) do
+    Mysql2::Client.new(host: 'localhost', username: 'root', database: 'test')
+  end
+
+  let(:query_stmt) do
+    'SELECT int_test, double_test, varchar_test FROM mysql2_test LIMIT 100'
+  end
+
+  def collect_events(name)
+    events = []
+    subscriber = ActiveSupport::Notifications.subscribe(name) do |*, payload|
+      events << payload
+    end
+    yield
+    events
+  ensure
+    ActiveSupport::Notifications.unsubscribe(subscriber)
+  end
+
+  after do
+    described_class.disable
+  end
+
+  specify 'to_arrow.mysql2_arrow' do
+    described_class.enable
+    record_batch = nil
+    events = collect_events('to_arrow.mysql2_arrow') do
+      record_batch = mysql2_client.query(query_stmt).to_arrow
+    end
+
+    expect(events.size).to eq(1)
+    payload = events[0]
+    expect(payload[:rows]).to eq(record_batch.n_rows)
+    expect(payload[:bytes]).to be > 0
+    expect(payload[:batches]).to eq(1)
+    expect(payload[:gvl_released_ns]).to be > 0
+    expect(payload[:decode_ns_by_type].keys).to include('int32', 'double')
+    expect(payload[:decode_ns]).to eq(payload[:decode_ns_by_type].values.sum)
+  end
+
+  specify 'to_a.record_batch_ext' do
+    record_batch = mysql2_client.query(query_stmt).to_arrow
+    described_class.enable
+    rows = nil
+    events = collect_events('to_a.record_batch_ext') do
+      rows = record_batch.to_a
+    end
+
+    expect(events.size).to eq(1)
+    payload = events[0]
+    expect(payload[:rows]).to eq(rows.size)
+    expect(payload[:columns]).to eq(3)
+    expect(payload[:convert_ns_by_type].keys).to include('int32', 'double')
+    expect(payload[:allocated_objects]).to be >= rows.size
+  end
+
+  specify 'to_a.record_batch_ext of slice_to_a, row_to_a and column_to_a' do
+    record_batch = mysql2_client.query(query_stmt).to_arrow
+    described_class.enable
+    events = collect_events('to_a.record_batch_ext') do
+      record_batch.slice_to_a(10, 20)
+      record_batch.row_to_a(0, dedup_strings: true)
+      record_batch.column_to_a(1)
+    end
+
+    expect(events.map { |payload| payload[:method] }).to eq([:slice_to_a, :row_to_a, :column_to_a])
+    expect(events.map { |payload| payload[:rows] }).to eq([20, 1, record_batch.n_rows])
+    expect(events.map { |payload| payload[:columns] }).to eq([3, 3, 1])
+    expect(events[2][:convert_ns_by_type].keys).to eq(['double'])
+  end
+
+  specify 'to_arrow.mysql2_arrow of each_arrow_batch and write_arrow' do
+    described_class.enable
+    num_rows = 0
+    events = collect_events('to_arrow.mysql2_arrow') do
+      mysql2_client.query(query_stmt).each_arrow_batch(batch_size: 30) do |batch|
+        num_rows += batch.n_rows
+      end
+      mysql2_client.query(query_stmt).write_arrow(StringIO.new)
+    end
+
+    expect(events.map { |payload| payload[:method] }).to eq([:each_arrow_batch, :write_arrow])
+    expect(events[0][:rows]).to eq(num_rows)
+    expect(events[1][:rows]).to eq(num_rows)
+  end
+
+  specify 'no event while disabled' do
+    described_class.enable
+    described_class.disable
+    events = collect_events('to_arrow.mysql2_arrow') do
+      mysql2_client.query(query_stmt).to_arrow
+    end
+    expect(events).to be_empty
+  end
+end
@@ -43,5 +43,19 @@ RSpec.describe ActiveRecordExt::Testing::Mysql2Test do
       expect(result).to be_kind_of(Array)
       expect(result).to eq(relation.pluck(*query_columns))
     end
+
+    specify 'with a single column' do
+      expected = relation.pluck(:int_test)
+      expect_any_instance_of(Arrow::RecordBatch).to receive(:column_to_a).and_call_original
+      expect_any_instance_of(ActiveRecordExt::ArrowResult).not_to receive(:rows)
+      result = relation.pluck_by_arrow(:int_test)
+      expect(result).to eq(expected)
+    end
+
+    specify 'with dedup_strings' do
+      result = relation.pluck_by_arrow(*query_columns, dedup_strings: true)
+      expect(result).to eq(relation.pluck(*query_columns))
+      expect(result.map { |row| row[2] }).to all(be_frozen)
+    end
   end
 end
@@ -1,6 +1,9 @@
 require 'spec_helper'
 require 'mysql2-arrow'
 require 'record_batch_ext'
+require 'stringio'
+require 'timeout'
+require 'tmpdir'
 
 RSpec.describe Mysql2::Result do
   let(:client) do
@@ -56,4 +59,455 @@ RSpec.describe Mysql2::Result do
       expect(ary.length).to eq(30_000)
     end
   end
+
+  describe '.to_arrow with prepared statement' do
+    let(:statement) do
+      client.prepare <<~SQL
+        SELECT int_test, double_test, varchar_test, text_test
+        FROM mysql2_test WHERE int_test >= ? LIMIT 100
+      SQL
+    end
+
+    specify do
+      record_batch = statement.execute(0).to_arrow
+      expect(record_batch.n_rows).to eq(100)
+      expect(record_batch.to_a).to eq(statement.execute(0, as: :array).to_a)
+    end
+  end
+
+  describe '.each_arrow_batch' do
+    subject(:result) do
+      client.query(<<~SQL, stream: true, cache_rows: false)
+        SELECT int_test, double_test, varchar_test, text_test
+        FROM mysql2_test LIMIT 25000
+      SQL
+    end
+
+    specify do
+      n_rows = []
+      result.each_arrow_batch(batch_size: 10_000) do |record_batch|
+        n_rows << record_batch.n_rows
+      end
+      expect(n_rows).to eq([10_000, 10_000, 5_000])
+    end
+
+    specify 'without block' do
+      expect(result.each_arrow_batch(batch_size: 10_000).map(&:n_rows).sum).to eq(25_000)
+    end
+  end
+
+  describe '.to_arrow with threads' do
+    let(:query_stmt) do
+      'SELECT int_test, big_int_test, double_test, varchar_test, text_test FROM mysql2_test LIMIT 10000'
+    end
+
+    specify 'values are same as ones decoded serially' do
+      expected = client.query(query_stmt).to_arrow.to_a
+      actual = client.query(query_stmt).to_arrow(threads: 4).to_a
+      expect(actual).to eq(expected)
+    end
+
+    specify 'with streaming' do
+      expected = client.query(query_stmt).to_arrow.to_a
+      actual = client.query(query_stmt, stream: true).to_arrow(threads: 4).to_a
+      expect(actual).to eq(expected)
+    end
+  end
+
+  describe '.to_arrow with pipeline' do
+    let(:query_stmt) do
+      'SELECT int_test, big_int_test, double_test, varchar_test, text_test FROM mysql2_test LIMIT 10000'
+    end
+
+    specify 'values are same as ones fetched serially' do
+      expected = client.query(query_stmt).to_arrow.to_a
+      actual = client.query(query_stmt, stream: true).to_arrow(pipeline: true).to_a
+      expect(actual).to eq(expected)
+    end
+
+    specify 'with each_arrow_batch' do
+      result = client.query(query_stmt, stream: true)
+      batches = result.each_arrow_batch(batch_size: 3000, pipeline: true).to_a
+      expect(batches.map(&:n_rows)).to eq([3000, 3000, 3000, 1000])
+    end
+
+    specify 'queries in the block of each_arrow_batch are rejected as in mysql2' do
+      expected = client.query(query_stmt).to_arrow.to_a
+      result = client.query(query_stmt, stream: true)
+      rows = []
+      errors = []
+      begin
+        result.each_arrow_batch(batch_size: 3000, pipeline: true) do |batch|
+          rows.concat(batch.to_a)
+          begin
+            client.query('SELECT 1')
+          rescue Mysql2::Error => e
+            errors << e
+          end
+        end
+      rescue Mysql2::Error
+        # the error of the last command is reported at the end of streaming
+      end
+      expect(errors).not_to be_empty
+      expect(rows).to eq(expected.first(rows.length))
+    end
+
+    specify 'other threads run while the interrupted producer is stopped' do
+      result = client.query('SELECT SLEEP(1) FROM mysql2_test LIMIT 3', stream: true)
+      ticks = 0
+      ticker = Thread.new { loop { ticks += 1; sleep 0.01 } }
+      expect {
+        Timeout.timeout(0.1) { result.to_arrow(pipeline: true) }
+      }.to raise_error(Timeout::Error)
+      ticker.kill
+      # the producer waits for the first row for about a second
+      expect(ticks).to be > 30
+    end
+  end
+
+  describe '.write_arrow' do
+    let(:query_stmt) do
+      'SELECT int_test, double_test, varchar_test, enum_test FROM mysql2_test LIMIT 25000'
+    end
+
+    let(:expected_rows) do
+      client.query(query_stmt).to_arrow.to_a
+    end
+
+    def read_rows(path, format)
+      table = Arrow::Table.load(path, format: format)
+      table.each_record_batch.flat_map(&:to_a)
+    end
+
+    specify 'IPC stream' do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'result.arrows')
+        n_rows = client.query(query_stmt, stream: true).write_arrow(path, batch_size: 10_000)
+        expect(n_rows).to eq(expected_rows.length)
+        expect(read_rows(path, :stream)).to eq(expected_rows)
+      end
+    end
+
+    specify 'IPC file' do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'result.arrow')
+        client.query(query_stmt).write_arrow(path, format: :ipc_file, batch_size: 10_000)
+        expect(read_rows(path, :arrow)).to eq(expected_rows)
+      end
+    end
+
+    specify 'IO object' do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'result.arrows')
+        File.open(path, 'wb') do |io|
+          client.query(query_stmt).write_arrow(io)
+        end
+        expect(read_rows(path, :stream)).to eq(expected_rows)
+      end
+    end
+
+    specify 'unknown format' do
+      expect {
+        client.query(query_stmt).write_arrow(StringIO.new, format: :csv)
+      }.to raise_error(ArgumentError)
+    end
+
+    specify 'an existing file is kept when the result cannot be read' do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'result.arrows')
+        File.write(path, 'previous')
+        result = client.query(query_stmt, stream: true)
+        result.to_arrow
+        expect { result.write_arrow(path) }.to raise_error(Mysql2::Error)
+        expect(File.read(path)).to eq('previous')
+      end
+    end
+  end
+
+  describe '.record_rows' do
+    let(:query_stmt) do
+      'SELECT int_test, varchar_test, date_test FROM mysql2_test LIMIT 1000'
+    end
+
+    specify 'the rows are recorded with the fields' do
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, 'result.rec')
+        n_rows = client.query(query_stmt).record_rows(path)
+        expect(n_rows).to eq(1000)
+        expect(File.binread(path, 8)).to eq('M2AREC01')
+        expect(File.binread(path)).to include('int_test', 'varchar_test', 'date_test')
+      end
+    end
+
+    specify 'prepared statement' do
+      stmt = client.prepare(query_stmt)
+      expect {
+        stmt.execute.record_rows(File::NULL)
+      }.to raise_error(NotImplementedError)
+    end
+  end
+
+  describe '.to_arrow with memory_pool' do
+    let(:query_stmt) do
+      'SELECT int_test, varchar_test, text_test FROM mysql2_test LIMIT 10000'
+    end
+
+    specify 'the buffers are counted by the tracking pool' do
+      before = Mysql2Arrow.memory_stats
+      record_batch = client.query(query_stmt).to_arrow
+      after = Mysql2Arrow.memory_stats
+
+      expect(after[:allocations]).to be > before[:allocations]
+      expect(after[:bytes_allocated]).to be > before[:bytes_allocated]
+      expect(after[:peak_bytes]).to be >= after[:bytes_allocated]
+      expect(record_batch.n_rows).to eq(10_000)
+    end
+
+    specify 'the default pool of Arrow' do
+      before = Mysql2Arrow.memory_stats
+      record_batch = client.query(query_stmt).to_arrow(memory_pool: :default)
+      expect(Mysql2Arrow.memory_stats[:allocations]).to eq(before[:allocations])
+      expect(record_batch.to_a).to eq(client.query(query_stmt).to_arrow.to_a)
+    end
+
+    specify 'unknown pool' do
+      expect {
+        client.query(query_stmt).to_arrow(memory_pool: :unknown)
+      }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '.to_arrow with schema cache' do
+    let(:query_stmt) do
+      'SELECT int_test, varchar_test, date_test FROM mysql2_test LIMIT 10'
+    end
+
+    before do
+      Mysql2Arrow.clear_schema_cache
+    end
+
+    specify 'the schema and the builders are reused for the same query' do
+      first = client.query(query_stmt).to_arrow
+      second = client.query(query_stmt).to_arrow
+      stats = Mysql2Arrow.schema_cache_stats
+
+      expect(stats[:size]).to eq(1)
+      expect(stats[:hits]).to eq(1)
+      expect(stats[:recycled_builders]).to eq(1)
+      expect(second.schema).to eq(first.schema)
+      expect(second.to_a).to eq(first.to_a)
+    end
+
+    specify 'the options affecting the types are in the key' do
+      casted = client.query(query_stmt).to_arrow
+      uncasted = client.query(query_stmt).to_arrow(cast: false)
+
+      expect(Mysql2Arrow.schema_cache_stats[:size]).to eq(2)
+      expect(uncasted.schema).not_to eq(casted.schema)
+    end
+  end
+
+  describe 'RecordBatch#to_a with dedup_strings' do
+    let(:query_stmt) do
+      'SELECT enum_test, varchar_test FROM mysql2_test LIMIT 1000'
+    end
+
+    specify 'the same strings are shared frozen strings' do
+      record_batch = client.query(query_stmt, cast: false).to_arrow
+      rows = record_batch.to_a(dedup_strings: true)
+      expect(rows).to eq(record_batch.to_a)
+
+      enum_values = rows.map(&:first).compact
+      expect(enum_values).to all(be_frozen)
+      expect(enum_values.map(&:object_id).uniq.length).to eq(enum_values.uniq.length)
+    end
+
+    specify 'deduplication stops at dedup_limit' do
+      record_batch = client.query(query_stmt, cast: false).to_arrow
+      rows = record_batch.to_a(dedup_strings: true, dedup_limit: 1)
+      expect(rows).to eq(record_batch.to_a)
+    end
+  end
+
+  describe 'RecordBatch#column_to_a' do
+    let(:query_stmt) do
+      'SELECT int_test, varchar_test FROM mysql2_test LIMIT 3000'
+    end
+
+    specify 'values are same as the column of to_a' do
+      record_batch = client.query(query_stmt).to_arrow
+      rows = record_batch.to_a
+      expect(record_batch.column_to_a(0)).to eq(rows.map(&:first))
+      expect(record_batch.column_to_a(-1)).to eq(rows.map(&:last))
+      expect { record_batch.column_to_a(2) }.to raise_error(IndexError)
+    end
+  end
+
+  describe '.to_arrow with numeric columns' do
+    let(:query_columns) do
+      %i[tiny_int_test small_int_test medium_int_test int_test big_int_test double_test decimal_test]
+    end
+
+    let(:query_stmt) do
+      "SELECT #{query_columns.join(', ')}, float_test FROM mysql2_test LIMIT 10000"
+    end
+
+    specify 'values are same as ones converted by mysql2' do
+      record_batch = client.query(query_stmt).to_arrow
+      expected = client.query(query_stmt, as: :array).to_a
+      actual = record_batch.to_a
+
+      query_columns.each_index do |j|
+        expect(actual.map { |row| row[j] }).to eq(expected.map { |row| row[j] })
+      end
+
+      # FLOAT values are decoded into float32
+      float_index = query_columns.length
+      expect(actual.map { |row| row[float_index] }).to eq(
+        expected.map { |row| row[float_index] && [row[float_index]].pack('f').unpack('f')[0] }
+      )
+    end
+  end
+
+  describe '.to_arrow with temporal columns' do
+    let(:query_stmt) do
+      'SELECT date_test, date_time_test, timestamp_test, time_test FROM mysql2_test LIMIT 100'
+    end
+
+    specify 'values are same as ones converted by mysql2' do
+      record_batch = client.query(query_stmt).to_arrow
+      expected = client.query(query_stmt, as: :array).to_a
+
+      expect(record_batch.schema.fields.map { |f| f.data_type.class }).to eq([
+        Arrow::Date32DataType,
+        Arrow::TimestampDataType,
+        Arrow::TimestampDataType,
+        Arrow::Time64DataType,
+      ])
+
+      columns = record_batch.columns
+      expected.each_with_index do |row, i|
+        date, date_time, timestamp, time = row
+        expect(columns[0].get_raw_value(i)).to eq((date - Date.new(1970, 1, 1)).to_i)
+        expect(columns[1].get_raw_value(i)).to eq(date_time.to_i * 1_000_000 + date_time.usec)
+        expect(columns[2].get_raw_value(i)).to eq(timestamp.to_i * 1_000_000 + timestamp.usec)
+        expect(columns[3].get_raw_value(i)).to eq(
+          ((time.hour * 60 + time.min) * 60 + time.sec) * 1_000_000 + time.usec
+        )
+      end
+    end
+
+    specify 'to_a returns Date and Time like mysql2' do
+      record_batch = client.query(query_stmt).to_arrow
+      expected = client.query(query_stmt, as: :array).to_a
+      expect(record_batch.to_a).to eq(expected)
+    end
+
+    specify 'TIME values are in the database timezone' do
+      record_batch = client.query(query_stmt, database_timezone: :utc).to_arrow
+      expected = client.query(query_stmt, as: :array, database_timezone: :utc).to_a
+      expect(record_batch.to_a).to eq(expected)
+    end
+
+    specify 'timestamp columns are labelled with the name of the local time zone' do
+      tz = ENV['TZ']
+      begin
+        ENV['TZ'] = 'America/New_York'
+        record_batch = client.query(query_stmt).to_arrow
+        expected = client.query(query_stmt, as: :array).to_a
+        expect(record_batch.schema.fields[1].data_type.to_s).to include('America/New_York')
+        expect(record_batch.to_a).to eq(expected)
+      ensure
+        ENV['TZ'] = tz
+      end
+    end
+  end
+
+  describe '.to_arrow with dictionary-encoded columns' do
+    let(:query_stmt) do
+      'SELECT enum_test, set_test, varchar_test FROM mysql2_test LIMIT 1000'
+    end
+
+    specify 'ENUM and SET columns are dictionary-encoded' do
+      record_batch = client.query(query_stmt).to_arrow
+      expected = client.query(query_stmt, as: :array).to_a
+
+      fields = record_batch.schema.fields
+      expect(fields[0].data_type).to be_a(Arrow::DictionaryDataType)
+      expect(fields[1].data_type).to be_a(Arrow::ListDataType)
+      expect(fields[2].data_type).to be_a(Arrow::StringDataType)
+
+      expect(fields[1].data_type.value_field.data_type).to be_a(Arrow::DictionaryDataType)
+
+      actual = record_batch.to_a
+      expect(actual.map { |row| row[0] }).to eq(expected.map { |row| row[0] })
+      expect(actual.map { |row| row[1]&.join(',') }).to eq(expected.map { |row| row[1] })
+    end
+
+    specify 'string columns listed in :dictionary option are dictionary-encoded' do
+      query_stmt = 'SELECT enum_test, varchar_test FROM mysql2_test LIMIT 1000'
+      record_batch = client.query(query_stmt).to_arrow(dictionary: [:varchar_test])
+      expected = client.query(query_stmt, as: :array).to_a
+
+      expect(record_batch.schema.fields[1].data_type).to be_a(Arrow::DictionaryDataType)
+      expect(record_batch.to_a).to eq(expected)
+    end
+
+    specify 'each batch has the dictionary of its own values' do
+      query_stmt = 'SELECT varchar_test FROM mysql2_test LIMIT 1000'
+      expected = client.query(query_stmt, as: :array).to_a
+      batches = client.query(query_stmt).each_arrow_batch(batch_size: 100, dictionary: [:varchar_test]).to_a
+
+      expect(batches.flat_map(&:to_a)).to eq(expected)
+      batches.each do |batch|
+        dictionary = batch.columns[0].dictionary.to_a
+        expect(dictionary).to match_array(batch.to_a.map(&:first).compact.uniq)
+      end
+    end
+
+    specify 'unknown columns in :dictionary option are rejected' do
+      expect {
+        client.query(query_stmt).to_arrow(dictionary: [:no_such_column])
+      }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '.to_arrow with GEOMETRY columns' do
+    let(:query_stmt) do
+      "SELECT ST_GeomFromText('POINT(1 2)') AS g UNION ALL SELECT NULL"
+    end
+
+    specify 'values are the bytes of the server like mysql2' do
+      record_batch = client.query(query_stmt).to_arrow
+      expect(record_batch.schema.fields[0].data_type.to_s).to eq('binary')
+      expect(record_batch.to_a).to eq(client.query(query_stmt, as: :array).to_a)
+    end
+
+    specify 'prepared statement' do
+      statement = client.prepare(query_stmt)
+      expect(statement.execute.to_arrow.to_a).to eq(statement.execute(as: :array).to_a)
+    end
+  end
+
+  describe '.to_arrow with cast: false' do
+    let(:query_stmt) do
+      'SELECT int_test, varchar_test, binary_test, text_test FROM mysql2_test LIMIT 1000'
+    end
+
+    specify 'values and encodings are same as ones of mysql2' do
+      record_batch = client.query(query_stmt, cast: false).to_arrow
+      expected = client.query(query_stmt, as: :array, cast: false).to_a
+
+      expect(record_batch.schema.fields.map { |f| f.data_type.class }).to eq([
+        Arrow::StringDataType,
+        Arrow::StringDataType,
+        Arrow::BinaryDataType,
+        Arrow::StringDataType,
+      ])
+
+      actual = record_batch.to_a
+      expect(actual).to eq(expected)
+      expect(actual[0][1..-1].map(&:encoding)).to eq(expected[0][1..-1].map(&:encoding))
+    end
+  end
 end
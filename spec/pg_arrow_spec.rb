@@ -0,0 +1,107 @@
+require 'spec_helper'
+require 'pg-arrow'
+require 'record_batch_ext'
+require 'bigdecimal'
+
+RSpec.describe PG::Connection do
+  let(:connection) do
+    PG.connect(host: 'localhost', dbname: 'test')
+  end
+
+  before do
+    connection.exec(<<~SQL)
+      CREATE TEMPORARY TABLE pg_arrow_test (
+        bool_test BOOLEAN,
+        smallint_test SMALLINT,
+        int_test INTEGER,
+        bigint_test BIGINT,
+        real_test REAL,
+        double_test DOUBLE PRECISION,
+        numeric_test NUMERIC(10, 3),
+        unconstrained_numeric_test NUMERIC,
+        date_test DATE,
+        timestamp_test TIMESTAMP,
+        timestamptz_test TIMESTAMPTZ,
+        text_test TEXT,
+        varchar_test VARCHAR(10),
+        bytea_test BYTEA,
+        uuid_test UUID
+      )
+    SQL
+    connection.exec(<<~SQL)
+      INSERT INTO pg_arrow_test VALUES
+        (true, 1, 2, 3, 1.5, 2.25, 1234.567, 0.000120, '2010-04-04',
+         '2010-04-04 11:44:00.123456', '2010-04-04 11:44:00+09', 'text', 'varchar',
+         '\\x00ff', 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'),
+        (false, -1, -2, -3, -1.5, -2.25, -0.5, -12345678901234567890.5, '1999-12-31',
+         '1999-12-31 23:59:59', '1999-12-31 23:59:59+00', '', 'v', '\\x', NULL),
+        (NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+         NULL, NULL, NULL, NULL, NULL, NULL)
+    SQL
+  end
+
+  after do
+    connection.close
+  end
+
+  describe '#copy_to_arrow' do
+    subject(:record_batch) do
+      connection.copy_to_arrow('SELECT * FROM pg_arrow_test')
+    end
+
+    specify 'the types of the columns' do
+      types = record_batch.schema.fields.map { |field| field.data_type.to_s }
+      expect(types).to eq([
+        'bool', 'int16', 'int32', 'int64', 'float', 'double', 'decimal(10, 3)', 'utf8',
+        'date32[day]', 'timestamp[us, tz=UTC]', 'timestamp[us, tz=UTC]',
+        'utf8', 'utf8', 'binary', 'utf8',
+      ])
+    end
+
+    specify 'the values' do
+      rows = record_batch.to_a
+      expect(rows[0][0..5]).to eq([true, 1, 2, 3, 1.5, 2.25])
+      expect(rows[0][6]).to eq(BigDecimal('1234.567'))
+      expect(rows[0][7]).to eq('0.000120')
+      expect(rows[0][8]).to eq(Date.new(2010, 4, 4))
+      expect(rows[0][9]).to eq(Time.utc(2010, 4, 4, 11, 44, Rational(123456, 1_000_000)))
+      expect(rows[0][10]).to eq(Time.utc(2010, 4, 4, 2, 44, 0))
+      expect(rows[0][11..14]).to eq(['text', 'varchar', "\x00\xff".b, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'])
+
+      expect(rows[1][6]).to eq(BigDecimal('-0.5'))
+      expect(rows[1][7]).to eq('-12345678901234567890.5')
+      expect(rows[1][8]).to eq(Date.new(1999, 12, 31))
+      expect(rows[1][11..13]).to eq(['', 'v', ''.b])
+
+      expect(rows[2]).to all(be_nil)
+    end
+
+    specify 'the special values of NUMERIC' do
+      skip 'the infinities of NUMERIC need PostgreSQL 14' if connection.server_version < 140000
+      record_batch = connection.copy_to_arrow(<<~SQL)
+        SELECT x::numeric, 'NaN'::numeric(10, 3)
+        FROM (VALUES ('Infinity'), ('-Infinity'), ('NaN')) AS v (x)
+      SQL
+      expect(record_batch.to_a).to eq([['Infinity', nil], ['-Infinity', nil], ['NaN', nil]])
+    end
+
+    specify 'empty result' do
+      record_batch = connection.copy_to_arrow('SELECT int_test FROM pg_arrow_test WHERE false')
+      expect(record_batch.n_rows).to eq(0)
+    end
+
+    specify 'unsupported type' do
+      expect {
+        connection.copy_to_arrow("SELECT '1 day'::interval")
+      }.to raise_error(PgArrow::UnsupportedType)
+      expect(connection.exec('SELECT 1').getvalue(0, 0)).to eq('1')
+    end
+
+    specify 'error in the server' do
+      expect {
+        connection.copy_to_arrow('SELECT 1 / 0')
+      }.to raise_error(PG::Error, /division by zero/)
+      expect(connection.exec('SELECT 1').getvalue(0, 0)).to eq('1')
+    end
+  end
+end